@@ -0,0 +1,180 @@
+#include <stdio.h>
+
+#include "level.h"
+
+// Grid of side*side square pillars of varying size, four walls each
+void synthetic_level(Level *level, SegmentArray *segments, int side)
+{
+	int num_pillars = side*side;
+
+	*level = (Level){0};
+	level->num_vertices = num_pillars*4;
+	level->vertices = SDL_malloc(sizeof(pol_Vec2)*level->num_vertices);
+	segments->len = num_pillars*4;
+	segments->items = SDL_malloc(sizeof(LineSegment)*segments->len);
+
+	for (int i = 0; i < num_pillars; i++)
+	{
+		float x = (i % side)*64.0f;
+		float y = (i / side)*64.0f;
+		float s = 8.0f + (i*7919 % 13);
+
+		pol_Vec2 *v = level->vertices + i*4;
+		v[0] = (pol_Vec2){x + s, y + s};
+		v[1] = (pol_Vec2){x - s, y + s};
+		v[2] = (pol_Vec2){x - s, y - s};
+		v[3] = (pol_Vec2){x + s, y - s};
+
+		for (int j = 0; j < 4; j++)
+			segments->items[i*4 + j] = (LineSegment){i*4 + j, i*4 + (j+1) % 4, 0.0f};
+	}
+}
+
+// Builds synthetic levels of doubling size to check that build time grows
+// close to linearly with the number of walls, then moves one pillar in the
+// middle and times the incremental rebuild
+void run_build_benchmark(BspOptions *options)
+{
+	printf("%10s %10s %10s %12s %10s %10s\n", "walls", "segs", "ms", "us/wall", "edit ms", "reused");
+
+	for (int side = 16; side <= 256; side *= 2)
+	{
+		Level level;
+		SegmentArray segments;
+		synthetic_level(&level, &segments, side);
+		size_t num_walls = segments.len;
+
+		Uint64 start = SDL_GetPerformanceCounter();
+		generate_bsp_tree(&level, &segments, options);
+		Uint64 end = SDL_GetPerformanceCounter();
+
+		Level edited;
+		SegmentArray edited_segments;
+		synthetic_level(&edited, &edited_segments, side);
+		int pillar = (side/2)*side + side/2;
+		for (int j = 0; j < 4; j++)
+			edited.vertices[pillar*4 + j].x += 4.0f;
+
+		BspRebuildStats stats;
+		Uint64 edit_start = SDL_GetPerformanceCounter();
+		rebuild_bsp_tree(&edited, &level, &edited_segments, options, &stats);
+		Uint64 edit_end = SDL_GetPerformanceCounter();
+
+		double ms = (double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency();
+		double edit_ms = (double)(edit_end - edit_start) * 1000.0 / SDL_GetPerformanceFrequency();
+		printf("%10zu %10zu %10.1f %12.2f %10.2f %9.1f%%\n", num_walls, level.num_segs, ms, ms * 1000.0 / num_walls,
+		       edit_ms, 100.0 * stats.reused_nodes / SDL_max(edited.num_nodes, 1));
+
+		free_level(&edited);
+		free_level(&level);
+	}
+}
+
+// Offline BSP compiler: reads a text level, builds the tree and writes the
+// binary file the game maps at startup.
+int main(int argc, char **argv)
+{
+	BspOptions options = BSP_DEFAULT_OPTIONS;
+	// 0 uses every core
+	options.num_threads = 0;
+
+	SDL_bool bench = SDL_FALSE;
+	SDL_bool vis = SDL_TRUE;
+	const char *generate = NULL;
+	int generate_segments = 0;
+	int vis_steps = PVS_DEFAULT_MAX_STEPS;
+	const char *paths[2];
+	int num_paths = 0;
+	for (int i = 1; i < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "--split-cost") == 0 && i+1 < argc)
+			options.split_cost = SDL_atof(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--balance-cost") == 0 && i+1 < argc)
+			options.balance_cost = SDL_atof(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--candidates") == 0 && i+1 < argc)
+			options.max_candidates = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+			options.num_threads = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--vis-steps") == 0 && i+1 < argc)
+			vis_steps = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--no-vis") == 0)
+			vis = SDL_FALSE;
+		else if (SDL_strcmp(argv[i], "--bench") == 0)
+			bench = SDL_TRUE;
+		else if (SDL_strcmp(argv[i], "--generate") == 0 && i+2 < argc)
+		{
+			generate = argv[++i];
+			generate_segments = SDL_atoi(argv[++i]);
+		}
+		else if (num_paths < 2)
+			paths[num_paths++] = argv[i];
+	}
+
+	if (options.num_threads == 0)
+		options.num_threads = SDL_GetCPUCount();
+
+	if (bench)
+	{
+		run_build_benchmark(&options);
+		return 0;
+	}
+
+	// A generated map takes the place of the input file
+	if (num_paths != (generate ? 1 : 2))
+	{
+		fprintf(stderr, "usage: %s [--split-cost N] [--balance-cost N] [--candidates N] [--threads N] [--no-vis] [--vis-steps N] [--bench] input.txt output.bsp\n", argv[0]);
+		fprintf(stderr, "       %s [options] --generate pillars|arena|maze|corridor SEGMENTS output.bsp\n", argv[0]);
+		return 1;
+	}
+
+	Level level;
+	SegmentArray segments;
+	const char *output = paths[num_paths-1];
+	if (generate)
+	{
+		MapKind kind;
+		if (!map_kind_from_name(generate, &kind))
+		{
+			fprintf(stderr, "Unknown map kind %s\n", generate);
+			return 1;
+		}
+		generate_map(&level, &segments, kind, generate_segments);
+	}
+	else if (!load_level_text(&level, &segments, paths[0]))
+		return 1;
+
+	size_t num_walls = segments.len;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	generate_bsp_tree(&level, &segments, &options);
+	Uint64 end = SDL_GetPerformanceCounter();
+
+	if (vis)
+	{
+		Uint64 vis_start = SDL_GetPerformanceCounter();
+		build_pvs(&level, options.num_threads, vis_steps);
+		Uint64 vis_end = SDL_GetPerformanceCounter();
+
+		printf("vis: %zu bytes (%.3f ms)\n", level.pvs_size,
+		       (double)(vis_end - vis_start) * 1000.0 / SDL_GetPerformanceFrequency());
+	}
+
+	if (!write_level_file(&level, output))
+		return 1;
+
+	BspTreeStats tree;
+	measure_bsp_tree(&level, &tree);
+	// Every split adds one segment
+	size_t splits = level.num_segs > num_walls ? level.num_segs - num_walls : 0;
+
+	printf("%s: %zu vertices, %zu nodes, %zu sectors, %zu segs (%.3f ms, %d %s)\n",
+	       output, level.num_vertices, level.num_nodes, level.num_sectors, level.num_segs,
+	       (double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency(), options.num_threads,
+	       options.num_threads == 1 ? "thread" : "threads");
+	printf("tree: %zu walls, %zu splits, depth %d max %.1f average\n",
+	       num_walls, splits, tree.max_depth, tree.average_depth);
+
+	free_level(&level);
+
+	return 0;
+}
@@ -0,0 +1,288 @@
+#include "export.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+FrameExport global_frame_export;
+
+// How long the writer sleeps without a new frame before checking for quit
+#define WRITER_POLL_MS 100
+
+static Uint32 align_up(Uint32 size, Uint32 alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
+static FrameExportSlot *get_slot(FrameExport *ex, Uint32 sequence)
+{
+	FrameExportHeader *header = ex->header;
+	return (FrameExportSlot*)(ex->mapping + header->slots_offset + (sequence % header->num_slots) * header->slot_stride);
+}
+
+static Uint8 *slot_pixels(FrameExportSlot *slot)
+{
+	return (Uint8*)slot + FRAME_EXPORT_SLOT_HEADER;
+}
+
+// Scales a slot to the stream size and converts it to the file's format.
+// Y4M is written as full range BT.601 4:4:4.
+static void convert_frame(FrameExport *ex, FrameExportSlot *slot)
+{
+	FrameExportHeader *header = ex->header;
+	int w = header->max_width;
+	int h = header->max_height;
+	Uint8 *src = slot_pixels(slot);
+	Uint8 *out = ex->converted;
+
+	for (int y = 0; y < h; y++)
+	{
+		Uint8 *row = src + (y * slot->height / h) * slot->pitch;
+
+		for (int x = 0; x < w; x++)
+		{
+			Uint8 *p = row + (x * slot->width / w) * 4;
+
+			if (!ex->y4m)
+			{
+				SDL_memcpy(out + (y*w + x) * 4, p, 4);
+				continue;
+			}
+
+			int r = p[0], g = p[1], b = p[2];
+			int luma = (77*r + 150*g + 29*b + 128) >> 8;
+			int cb = (-43*r - 85*g + 128*b + 32896) >> 8;
+			int cr = (128*r - 107*g - 21*b + 32896) >> 8;
+			out[y*w + x] = luma;
+			out[w*h + y*w + x] = SDL_min(cb, 255);
+			out[2*w*h + y*w + x] = SDL_min(cr, 255);
+		}
+	}
+}
+
+// Reads the ring like any other consumer would, so it never holds up the
+// thread publishing frames
+static int writer_main(void *data)
+{
+	FrameExport *ex = &global_frame_export;
+	FrameExportHeader *header = ex->header;
+	size_t frame_size = (size_t)header->max_width * header->max_height * (ex->y4m ? 3 : 4);
+	Uint32 next = 1;
+
+	// Rendering and presenting come first when cores are short
+	SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+
+	for (;;)
+	{
+		SDL_SemWaitTimeout(ex->wake, WRITER_POLL_MS);
+
+		// Quit is set after the last frame is published, so checking it
+		// first means that frame is seen below
+		SDL_bool quit = SDL_AtomicGet(&ex->quit);
+		Uint32 latest = SDL_AtomicGet(&header->latest);
+		while (latest - next < 0x80000000u)
+		{
+			// Already overwritten
+			if (latest - next >= header->num_slots)
+			{
+				Uint32 skip = latest - next - header->num_slots + 1;
+				ex->writer_dropped += skip;
+				next += skip;
+			}
+
+			FrameExportSlot *slot = get_slot(ex, next);
+			SDL_bool intact = (Uint32)SDL_AtomicGet(&slot->sequence) == next;
+			if (intact)
+			{
+				convert_frame(ex, slot);
+				SDL_MemoryBarrierAcquire();
+				intact = (Uint32)SDL_AtomicGet(&slot->sequence) == next;
+			}
+
+			if (intact)
+			{
+				if (ex->y4m)
+					fputs("FRAME\n", ex->file);
+				fwrite(ex->converted, frame_size, 1, ex->file);
+				ex->written++;
+			}
+			else
+				ex->writer_dropped++;
+
+			next++;
+		}
+
+		if (quit)
+			break;
+	}
+
+	return 0;
+}
+
+// Maps the ring, in shared memory at shm_name when it is set, and starts a
+// writer thread for file_path when that is set. A path ending in .y4m gets
+// a Y4M stream, anything else raw RGBA frames. Frames of any size up to
+// max_width x max_height can be published, the file always has that size.
+SDL_bool init_frame_export(const char *shm_name, const char *file_path, int num_slots, int max_width, int max_height)
+{
+	FrameExport *ex = &global_frame_export;
+	*ex = (FrameExport){0};
+
+	if (num_slots < 2)
+		num_slots = 2;
+
+	Uint32 slots_offset = align_up(sizeof(FrameExportHeader), 4096);
+	Uint32 slot_stride = align_up(FRAME_EXPORT_SLOT_HEADER + max_width*max_height*4, 4096);
+	ex->mapping_size = slots_offset + (size_t)slot_stride * num_slots;
+
+	if (shm_name)
+	{
+		// POSIX shared memory names start with a single slash
+		SDL_snprintf(ex->shm_name, sizeof(ex->shm_name), "/%s", shm_name);
+		int fd = shm_open(ex->shm_name, O_CREAT | O_RDWR, 0600);
+		if (fd < 0)
+		{
+			fprintf(stderr, "Could not create shared memory %s\n", ex->shm_name);
+			return SDL_FALSE;
+		}
+
+		if (ftruncate(fd, ex->mapping_size) != 0)
+		{
+			fprintf(stderr, "Could not size shared memory %s\n", ex->shm_name);
+			close(fd);
+			shm_unlink(ex->shm_name);
+			return SDL_FALSE;
+		}
+
+		ex->mapping = mmap(NULL, ex->mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	else
+	{
+		ex->mapping = mmap(NULL, ex->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+
+	if (ex->mapping == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not map the frame export ring\n");
+		if (shm_name)
+			shm_unlink(ex->shm_name);
+		return SDL_FALSE;
+	}
+
+	// Touch every page now rather than during the first frames
+	SDL_memset(ex->mapping, 0, ex->mapping_size);
+
+	ex->header = (FrameExportHeader*)ex->mapping;
+	ex->header->version = FRAME_EXPORT_VERSION;
+	ex->header->num_slots = num_slots;
+	ex->header->max_width = max_width;
+	ex->header->max_height = max_height;
+	ex->header->slots_offset = slots_offset;
+	ex->header->slot_stride = slot_stride;
+	// Last, so a reader that sees the magic sees the rest
+	SDL_MemoryBarrierRelease();
+	ex->header->magic = FRAME_EXPORT_MAGIC;
+
+	ex->start_time = SDL_GetPerformanceCounter();
+
+	if (file_path)
+	{
+		ex->file = fopen(file_path, "wb");
+		if (!ex->file)
+		{
+			fprintf(stderr, "Couldn't open export file %s\n", file_path);
+			shutdown_frame_export();
+			return SDL_FALSE;
+		}
+
+		size_t len = SDL_strlen(file_path);
+		ex->y4m = len > 4 && SDL_strcasecmp(file_path + len - 4, ".y4m") == 0;
+		if (ex->y4m)
+			fprintf(ex->file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444 XCOLORRANGE=FULL\n", max_width, max_height);
+
+		ex->converted = SDL_malloc((size_t)max_width * max_height * 4);
+		ex->wake = SDL_CreateSemaphore(0);
+		ex->writer = SDL_CreateThread(writer_main, "export_writer", NULL);
+		if (!ex->writer)
+		{
+			fprintf(stderr, "SDL_CreateThread failed. SDL_Error: %s\n", SDL_GetError());
+			shutdown_frame_export();
+			return SDL_FALSE;
+		}
+	}
+
+	ex->enabled = SDL_TRUE;
+	return SDL_TRUE;
+}
+
+// Returns where to put the next frame's pixels, width*4 bytes per row. The
+// frame is published by export_frame_end.
+void *export_frame_begin(int width, int height)
+{
+	FrameExport *ex = &global_frame_export;
+	FrameExportHeader *header = ex->header;
+
+	Uint32 sequence = ++ex->sequence;
+	FrameExportSlot *slot = get_slot(ex, sequence);
+
+	// Overwriting a frame the reader hasn't finished with
+	Uint32 old = SDL_AtomicGet(&slot->sequence);
+	Uint32 consumed = SDL_AtomicGet(&header->consumed);
+	if (old && consumed && old - consumed < 0x80000000u && old != consumed)
+		SDL_AtomicAdd(&header->dropped, 1);
+
+	SDL_AtomicSet(&slot->sequence, 0);
+	slot->width = SDL_min(width, (int)header->max_width);
+	slot->height = SDL_min(height, (int)header->max_height);
+	slot->pitch = slot->width * 4;
+	slot->time_us = (double)(SDL_GetPerformanceCounter() - ex->start_time) * 1000000.0 / SDL_GetPerformanceFrequency();
+
+	return slot_pixels(slot);
+}
+
+void export_frame_end(void)
+{
+	FrameExport *ex = &global_frame_export;
+
+	SDL_AtomicSet(&get_slot(ex, ex->sequence)->sequence, ex->sequence);
+	SDL_AtomicSet(&ex->header->latest, ex->sequence);
+
+	if (ex->writer)
+		SDL_SemPost(ex->wake);
+}
+
+// Lets the writer finish the frames in the ring, then unmaps it and prints
+// how many frames went where
+void shutdown_frame_export(void)
+{
+	FrameExport *ex = &global_frame_export;
+
+	if (ex->writer)
+	{
+		SDL_AtomicSet(&ex->quit, 1);
+		SDL_SemPost(ex->wake);
+		SDL_WaitThread(ex->writer, NULL);
+	}
+	if (ex->wake)
+		SDL_DestroySemaphore(ex->wake);
+	if (ex->file)
+		fclose(ex->file);
+	SDL_free(ex->converted);
+
+	if (ex->enabled)
+	{
+		printf("export: %u frames published, %d dropped by the reader", ex->sequence, SDL_AtomicGet(&ex->header->dropped));
+		if (ex->writer)
+			printf(", %u written, %u dropped by the writer", ex->written, ex->writer_dropped);
+		printf("\n");
+	}
+
+	if (ex->mapping && ex->mapping != MAP_FAILED)
+		munmap(ex->mapping, ex->mapping_size);
+	// Readers that have it mapped keep it
+	if (ex->shm_name[0])
+		shm_unlink(ex->shm_name);
+
+	*ex = (FrameExport){0};
+}
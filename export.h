@@ -0,0 +1,84 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdio.h>
+#include <SDL2/SDL.h>
+
+// Finished frames are published into a ring of fixed slots, in shared memory
+// when a name is given, so another process on the machine can read them in
+// place. The layout below is the whole protocol.
+//
+// The mapping starts with a FrameExportHeader. Slot i starts at
+// slots_offset + i*slot_stride with a FrameExportSlot, followed by the
+// pixels at FRAME_EXPORT_SLOT_HEADER bytes into the slot: height rows of
+// pitch bytes, each pixel R, G, B, A.
+//
+// Frame n (numbered from 1) goes into slot n % num_slots. A slot's sequence
+// is 0 while it is being written and n once frame n is complete. To read
+// frame n, load the sequence, read the pixels and load the sequence again;
+// the frame is intact when both loads gave n. The publisher never waits for
+// a reader, so a slow reader sees frames overwritten and has to skip ahead.
+// A reader that stores the last frame it finished in consumed gets frames
+// overwritten before it was done with them counted in dropped.
+#define FRAME_EXPORT_MAGIC 0x58455046 // "FPEX"
+#define FRAME_EXPORT_VERSION 1
+#define FRAME_EXPORT_SLOT_HEADER 64
+
+typedef struct
+{
+	Uint32 magic;
+	Uint32 version;
+	Uint32 num_slots;
+	Uint32 max_width, max_height;
+	Uint32 slots_offset;
+	Uint32 slot_stride;
+	// Newest complete frame, 0 before the first
+	SDL_atomic_t latest;
+	// Written by the reader
+	SDL_atomic_t consumed;
+	SDL_atomic_t dropped;
+} FrameExportHeader;
+
+typedef struct
+{
+	SDL_atomic_t sequence;
+	Uint32 width, height;
+	Uint32 pitch;
+	// Microseconds since export started
+	Uint64 time_us;
+} FrameExportSlot;
+
+#define FRAME_EXPORT_DEFAULT_SLOTS 8
+
+// Owned by the thread presenting frames, apart from the writer thread's
+// own fields
+typedef struct
+{
+	SDL_bool enabled;
+	Uint8 *mapping;
+	size_t mapping_size;
+	char shm_name[64];
+	FrameExportHeader *header;
+	Uint32 sequence;
+	Uint64 start_time;
+
+	// Writer thread streaming the ring to a file, Y4M or raw RGBA at
+	// max_width x max_height
+	SDL_Thread *writer;
+	SDL_sem *wake;
+	SDL_atomic_t quit;
+	FILE *file;
+	SDL_bool y4m;
+	Uint8 *converted;
+	Uint32 written;
+	Uint32 writer_dropped;
+} FrameExport;
+
+extern FrameExport global_frame_export;
+
+SDL_bool init_frame_export(const char *shm_name, const char *file_path, int num_slots, int max_width, int max_height);
+void *export_frame_begin(int width, int height);
+void export_frame_end(void);
+void shutdown_frame_export(void);
+
+#endif
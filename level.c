@@ -0,0 +1,1481 @@
+#include "level.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Emit out-of-line copies of the inline helpers in level.h
+extern inline float vec2_dot_product(pol_Vec2 v1, pol_Vec2 v2);
+extern inline float vec2_cross_product(pol_Vec2 v1, pol_Vec2 v2);
+extern inline float vec2_angle(pol_Vec2 v1, pol_Vec2 v2);
+extern inline float vec2_len(pol_Vec2 v1);
+extern inline pol_Vec2 vec2_subtract(pol_Vec2 v1, pol_Vec2 v2);
+extern inline pol_Vec2 vec2_add(pol_Vec2 v1, pol_Vec2 v2);
+extern inline int point_on_side(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 p);
+
+pol_Vec2 vec2_rotate(pol_Vec2 v, float angle)
+{
+    pol_Vec2 result;
+
+    float cosres = SDL_cosf(angle);
+    float sinres = SDL_sinf(angle);
+
+    result.x = v.x*cosres - v.y*sinres;
+    result.y = v.x*sinres + v.y*cosres;
+
+    return result;
+}
+
+pol_Vec2 line_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4)
+{
+	pol_Vec2 v;
+
+	float det = (v1.x - v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x - v4.x);
+	if (SDL_fabsf(det) < EPSILON)
+		return (pol_Vec2){NAN, NAN};
+
+	v.x = ((v1.x*v2.y - v1.y*v2.x)*(v3.x - v4.x) - (v1.x - v2.x)*(v3.x*v4.y - v3.y*v4.x))/det;
+	v.y = ((v1.x*v2.y - v1.y*v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x*v4.y - v3.y*v4.x))/det;
+
+	return v;
+}
+
+pol_Vec2 line_segment_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4)
+{
+    pol_Vec2 v = {NAN, NAN};
+
+    float det = (v1.x - v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x - v4.x);
+    if (SDL_fabsf(det) < EPSILON)
+        return v;
+
+    float t_num = (v1.x - v3.x)*(v3.y - v4.y) - (v1.y - v3.y)*(v3.x - v4.x);
+    float u_num = (v1.x - v2.x)*(v1.y - v3.y) - (v1.y - v2.y)*(v1.x - v3.x);
+
+    float t = t_num / det;
+    float u = -u_num / det;
+
+    if (t < 0.0f || t > 1.0f || u < 0.0f || u > 1.0f)
+        return v;
+
+    v.x = v1.x + t*(v2.x - v1.x);
+    v.y = v1.y + t*(v2.y - v1.y);
+
+    return v;
+}
+
+// Bump allocator for everything the builder creates. Blocks are only freed
+// together once the tree has been flattened.
+typedef struct ArenaBlock
+{
+	struct ArenaBlock *next;
+	size_t used;
+	size_t size;
+} ArenaBlock;
+
+typedef struct
+{
+	ArenaBlock *blocks;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_HEADER_SIZE ((sizeof(ArenaBlock) + 15) & ~(size_t)15)
+
+static void *arena_alloc(Arena *arena, size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+
+	ArenaBlock *block = arena->blocks;
+	if (!block || block->used + size > block->size)
+	{
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = SDL_malloc(ARENA_HEADER_SIZE + block_size);
+		block->next = arena->blocks;
+		block->used = 0;
+		block->size = block_size;
+		arena->blocks = block;
+	}
+
+	void *result = (Uint8*)block + ARENA_HEADER_SIZE + block->used;
+	block->used += size;
+
+	return result;
+}
+
+// Hands all of src's blocks over to dst
+static void arena_merge(Arena *dst, Arena *src)
+{
+	while (src->blocks)
+	{
+		ArenaBlock *block = src->blocks;
+		src->blocks = block->next;
+		block->next = dst->blocks;
+		dst->blocks = block;
+	}
+}
+
+static void arena_free(Arena *arena)
+{
+	while (arena->blocks)
+	{
+		ArenaBlock *block = arena->blocks;
+		arena->blocks = block->next;
+		SDL_free(block);
+	}
+}
+
+// Makes room for at least count items, doubling the capacity
+void *grow_array(void *items, size_t *capacity, size_t count, size_t item_size)
+{
+	if (count <= *capacity)
+		return items;
+
+	size_t new_capacity = *capacity ? *capacity : 16;
+	while (new_capacity < count)
+		new_capacity *= 2;
+
+	*capacity = new_capacity;
+	return SDL_realloc(items, new_capacity * item_size);
+}
+
+// Build-time vertex. Split points are created while subtrees are built in
+// parallel, so vertices only get an index in Level.vertices when the
+// finished tree is flattened.
+typedef struct
+{
+	pol_Vec2 p;
+	Sint32 index;
+} BuildVertex;
+
+typedef struct
+{
+	BuildVertex *v1, *v2;
+	float offset;
+	Sint32 texture;
+} BuildSegment;
+
+typedef struct
+{
+	BuildSegment *items;
+	size_t len;
+} BuildSegmentArray;
+
+typedef struct BuildNode BuildNode;
+
+typedef struct
+{
+	// NULL when the side is a convex leaf, which then keeps its segs
+	BuildNode *node;
+	BuildSegmentArray segs;
+	float box[4];
+	// Hash of segs as split from the parent, before any further splits
+	Uint64 hash;
+	// Set when an unchanged subtree of the previous level is kept in place
+	// of building this side
+	SDL_bool reuse;
+	Sint32 old_child;
+} BuildChild;
+
+struct BuildNode
+{
+	BuildSegment splitter;
+	BuildChild left;
+	BuildChild right;
+};
+
+typedef struct
+{
+	BspOptions options;
+	// Subtrees above this depth are handed to their own thread
+	int spawn_depth;
+	// Level being rebuilt, NULL for a full build
+	Level *old;
+} BuildContext;
+
+// Segments with fewer than this are not worth a thread
+#define BSP_MIN_PARALLEL_SEGS 256
+// Splitter scoring is spread over threads above this many side tests
+#define BSP_MIN_PARALLEL_SCORE (1 << 16)
+// Candidates are tested against at most about this many segments, which
+// keeps the scoring cost of the big nodes near the root linear
+#define BSP_SCORE_SAMPLES 1024
+
+// Only needed when splitter scoring sampled the segments and could not tell
+static SDL_bool is_convex(BuildSegmentArray *segments_list)
+{
+	BuildSegment *segments = segments_list->items;
+	size_t num_segments = segments_list->len;
+
+	for (int i = 0; i < num_segments; i++)
+	{
+		pol_Vec2 v1 = segments[i].v1->p;
+		pol_Vec2 v2 = segments[i].v2->p;
+
+		for (int j = 0; j < num_segments; j++)
+		{
+			if (i == j)
+				continue;
+
+			pol_Vec2 v3 = segments[j].v1->p;
+			pol_Vec2 v4 = segments[j].v2->p;
+
+			int a = point_on_side(v1, v2, v3);
+			int b = point_on_side(v1, v2, v4);
+
+			// Intersection found
+			if (a * b == -1)
+				return SDL_FALSE;
+
+			if (a == -1 || b == -1)
+				return SDL_FALSE;
+		}
+	}
+
+	return SDL_TRUE;
+}
+
+// Cost of splitting with segments->items[c]: every cut segment ends up on
+// both sides and costs split_cost, and every segment of difference between
+// the two sides costs balance_cost. Also tells whether anything lies behind
+// the candidate, which is all a convexity test needs. Large nodes are
+// estimated from every sample_stride'th segment.
+static float score_splitter(BuildSegmentArray *segments, size_t c, size_t sample_stride, BspOptions *options, SDL_bool *has_back)
+{
+	pol_Vec2 split_v1 = segments->items[c].v1->p;
+	pol_Vec2 split_v2 = segments->items[c].v2->p;
+
+	int num_left = 0;
+	int num_right = 0;
+	int num_splits = 0;
+	int num_back = 0;
+
+	for (size_t i = 0; i < segments->len; i += sample_stride)
+	{
+		if (i == c)
+			continue;
+
+		int a = point_on_side(split_v1, split_v2, segments->items[i].v1->p);
+		int b = point_on_side(split_v1, split_v2, segments->items[i].v2->p);
+
+		if (a == -1 || b == -1)
+			num_back++;
+
+		if (a * b == -1)
+			num_splits++;
+		else if (a == 1 || b == 1)
+			num_right++;
+		else
+			num_left++;
+	}
+
+	// Same placement of the splitter itself as split_segments
+	if (num_right + num_splits == 0)
+		num_right++;
+	else
+		num_left++;
+
+	num_left += num_splits;
+	num_right += num_splits;
+
+	*has_back = num_back > 0;
+
+	return num_splits*options->split_cost + SDL_abs(num_left - num_right)*options->balance_cost;
+}
+
+typedef struct
+{
+	BuildSegmentArray *segments;
+	BspOptions *options;
+	size_t stride;
+	size_t sample_stride;
+	size_t first, last;
+	size_t best;
+	float best_cost;
+	SDL_bool any_back;
+} ScoreTask;
+
+static int score_candidates(void *data)
+{
+	ScoreTask *task = data;
+
+	task->best = task->first * task->stride;
+	task->best_cost = INFINITY;
+	task->any_back = SDL_FALSE;
+
+	for (size_t k = task->first; k < task->last; k++)
+	{
+		size_t c = k * task->stride;
+		SDL_bool has_back;
+		float cost = score_splitter(task->segments, c, task->sample_stride, task->options, &has_back);
+
+		task->any_back |= has_back;
+
+		// Strict compare keeps the lowest index on ties, whatever the slicing
+		if (cost < task->best_cost)
+		{
+			task->best = c;
+			task->best_cost = cost;
+		}
+	}
+
+	return 0;
+}
+
+// Scores up to max_candidates evenly spaced segments and returns the index
+// of the cheapest. Slices of the candidates are scored on num_threads >> depth
+// threads, since that many subtrees are already being built in parallel.
+// *convex is set when no segment has another one behind it.
+static size_t choose_splitter(BuildContext *ctx, BuildSegmentArray *segments, int depth, SDL_bool *convex)
+{
+	// An empty side is a valid, if useless, leaf
+	*convex = SDL_TRUE;
+	if (segments->len == 0)
+		return 0;
+
+	size_t num_candidates = segments->len;
+	if (ctx->options.max_candidates > 0 && num_candidates > ctx->options.max_candidates)
+		num_candidates = ctx->options.max_candidates;
+
+	size_t sample_stride = (segments->len + BSP_SCORE_SAMPLES - 1) / BSP_SCORE_SAMPLES;
+
+	int num_tasks = ctx->options.num_threads >> depth;
+	if (num_tasks < 1 || num_candidates * segments->len / sample_stride < BSP_MIN_PARALLEL_SCORE)
+		num_tasks = 1;
+	if (num_tasks > num_candidates)
+		num_tasks = num_candidates;
+
+	ScoreTask tasks[num_tasks];
+	SDL_Thread *threads[num_tasks];
+
+	for (int i = 0; i < num_tasks; i++)
+	{
+		tasks[i] = (ScoreTask){
+			.segments = segments,
+			.options = &ctx->options,
+			.stride = segments->len / num_candidates,
+			.sample_stride = sample_stride,
+			.first = num_candidates * i / num_tasks,
+			.last = num_candidates * (i+1) / num_tasks
+		};
+
+		threads[i] = i > 0 ? SDL_CreateThread(score_candidates, "bsp_score", &tasks[i]) : NULL;
+		if (i > 0 && !threads[i])
+			score_candidates(&tasks[i]);
+	}
+
+	score_candidates(&tasks[0]);
+
+	size_t best = tasks[0].best;
+	float best_cost = tasks[0].best_cost;
+	SDL_bool any_back = tasks[0].any_back;
+	for (int i = 1; i < num_tasks; i++)
+	{
+		if (threads[i])
+			SDL_WaitThread(threads[i], NULL);
+
+		any_back |= tasks[i].any_back;
+		if (tasks[i].best_cost < best_cost)
+		{
+			best = tasks[i].best;
+			best_cost = tasks[i].best_cost;
+		}
+	}
+
+	if (any_back)
+		*convex = SDL_FALSE;
+	else if (num_candidates == segments->len && sample_stride == 1)
+		*convex = SDL_TRUE;
+	else
+		*convex = is_convex(segments);
+
+	return best;
+}
+
+// Splits segments along segments->items[splitter] into the node's left and
+// right children. Sides are classified first so every array is allocated
+// once, at its final size. With NO_SPLITTER the line is node->splitter,
+// which isn't one of the segments.
+#define NO_SPLITTER ((size_t)-1)
+
+static void split_segments(Arena *arena, BuildSegmentArray *segments_list, size_t splitter, BuildNode *node)
+{
+	BuildSegment *segments = segments_list->items;
+	size_t num_segs = segments_list->len;
+
+	if (splitter != NO_SPLITTER)
+		node->splitter = segments[splitter];
+
+	pol_Vec2 split_v1 = node->splitter.v1->p;
+	pol_Vec2 split_v2 = node->splitter.v2->p;
+
+	Sint8 *sides = arena_alloc(arena, num_segs);
+	int num_left = 0;
+	int num_right = 0;
+	int num_splits = 0;
+
+	for (int i = 0; i < num_segs; i++)
+	{
+		if (i == splitter)
+			continue;
+
+		int a = point_on_side(split_v1, split_v2, segments[i].v1->p);
+		int b = point_on_side(split_v1, split_v2, segments[i].v2->p);
+
+		// Intersection
+		if (a * b == -1)
+		{
+			sides[i] = a == -1 ? 2 : 3;
+			num_splits++;
+		}
+		// Right side
+		else if (a == 1 || b == 1)
+		{
+			sides[i] = 1;
+			num_right++;
+		}
+		// Left side or splitter
+		else
+		{
+			sides[i] = 0;
+			num_left++;
+		}
+	}
+
+	BuildSegment *left = arena_alloc(arena, sizeof(BuildSegment)*(num_left + num_splits + 1));
+	BuildSegment *right = arena_alloc(arena, sizeof(BuildSegment)*(num_right + num_splits + 1));
+	BuildVertex *split_vertices = arena_alloc(arena, sizeof(BuildVertex)*num_splits);
+	num_left = num_right = num_splits = 0;
+
+	for (int i = 0; i < num_segs; i++)
+	{
+		if (i == splitter)
+			continue;
+
+		if (sides[i] == 0)
+		{
+			left[num_left++] = segments[i];
+		}
+		else if (sides[i] == 1)
+		{
+			right[num_right++] = segments[i];
+		}
+		else
+		{
+			BuildVertex *v1 = segments[i].v1;
+			BuildVertex *v2 = segments[i].v2;
+
+			pol_Vec2 split_point = line_intersect(split_v1, split_v2, v1->p, v2->p);
+			float split_offset = segments[i].offset + vec2_len(vec2_subtract(split_point, v1->p));
+
+			BuildVertex *split = &split_vertices[num_splits++];
+			*split = (BuildVertex){split_point, -1};
+
+			BuildSegment first = {v1, split, segments[i].offset, segments[i].texture};
+			BuildSegment second = {split, v2, split_offset, segments[i].texture};
+
+			if (sides[i] == 2)
+			{
+				left[num_left++] = first;
+				right[num_right++] = second;
+			}
+			else
+			{
+				right[num_right++] = first;
+				left[num_left++] = second;
+			}
+		}
+	}
+
+	if (splitter != NO_SPLITTER)
+	{
+		// Move splitter to right side if empty
+		if (num_right == 0)
+			right[num_right++] = segments[splitter];
+		// Else in left side
+		else
+			left[num_left++] = segments[splitter];
+	}
+	node->left.segs = (BuildSegmentArray){left, num_left};
+	node->right.segs = (BuildSegmentArray){right, num_right};
+}
+
+static void segments_bbox(BuildSegmentArray *segments_list, float *box)
+{
+	box[BOX_TOP] = box[BOX_RIGHT] = -INFINITY;
+	box[BOX_BOTTOM] = box[BOX_LEFT] = INFINITY;
+
+	for (int i = 0; i < segments_list->len; i++)
+	{
+		pol_Vec2 v[2] = {
+			segments_list->items[i].v1->p,
+			segments_list->items[i].v2->p
+		};
+
+		for (int j = 0; j < 2; j++)
+		{
+			box[BOX_TOP] = MAX(box[BOX_TOP], v[j].y);
+			box[BOX_BOTTOM] = MIN(box[BOX_BOTTOM], v[j].y);
+			box[BOX_LEFT] = MIN(box[BOX_LEFT], v[j].x);
+			box[BOX_RIGHT] = MAX(box[BOX_RIGHT], v[j].x);
+		}
+	}
+}
+
+static Uint64 segment_hash(BuildSegment *seg)
+{
+	float values[6] = {seg->v1->p.x, seg->v1->p.y, seg->v2->p.x, seg->v2->p.y, seg->offset, (float)seg->texture};
+	Uint8 *bytes = (Uint8*)values;
+
+	// FNV-1a, then a final mix so the sum below keeps every bit spread
+	Uint64 h = 14695981039346656037ull;
+	for (size_t i = 0; i < sizeof(values); i++)
+	{
+		h ^= bytes[i];
+		h *= 1099511628211ull;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+
+	return h;
+}
+
+// Order independent, since splitting doesn't keep the order of segments
+static Uint64 segments_hash(BuildSegmentArray *segments)
+{
+	Uint64 h = segments->len * 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < segments->len; i++)
+		h += segment_hash(&segments->items[i]);
+
+	return h;
+}
+
+static BuildNode *build_node(BuildContext *ctx, Arena *arena, BuildSegmentArray *segments, size_t splitter, int depth);
+
+static void build_child(BuildContext *ctx, Arena *arena, BuildChild *child, int depth)
+{
+	SDL_bool convex;
+	size_t splitter = choose_splitter(ctx, &child->segs, depth, &convex);
+
+	if (!convex)
+	{
+		child->node = build_node(ctx, arena, &child->segs, splitter, depth);
+		child->segs = (BuildSegmentArray){0};
+	}
+}
+
+typedef struct
+{
+	BuildContext *ctx;
+	// Each thread allocates from its own arena, merged back after the join
+	Arena arena;
+	BuildChild *child;
+	int depth;
+} SubtreeTask;
+
+static int build_subtree(void *data)
+{
+	SubtreeTask *task = data;
+	build_child(task->ctx, &task->arena, task->child, task->depth);
+	return 0;
+}
+
+static BuildNode *build_node(BuildContext *ctx, Arena *arena, BuildSegmentArray *segments, size_t splitter, int depth)
+{
+	BuildNode *node = arena_alloc(arena, sizeof(BuildNode));
+	*node = (BuildNode){0};
+
+	split_segments(arena, segments, splitter, node);
+
+	segments_bbox(&node->left.segs, node->left.box);
+	segments_bbox(&node->right.segs, node->right.box);
+	node->left.hash = segments_hash(&node->left.segs);
+	node->right.hash = segments_hash(&node->right.segs);
+
+	// The two sides share nothing but the read-only parent vertices, so the
+	// left one can be built on another thread while this one does the right
+	SDL_Thread *thread = NULL;
+	SubtreeTask task = {ctx, {0}, &node->left, depth+1};
+	if (depth < ctx->spawn_depth && node->left.segs.len >= BSP_MIN_PARALLEL_SEGS && node->right.segs.len >= BSP_MIN_PARALLEL_SEGS)
+		thread = SDL_CreateThread(build_subtree, "bsp_build", &task);
+
+	if (!thread)
+		build_child(ctx, arena, &node->left, depth+1);
+
+	build_child(ctx, arena, &node->right, depth+1);
+
+	if (thread)
+	{
+		SDL_WaitThread(thread, NULL);
+		arena_merge(arena, &task.arena);
+	}
+
+	return node;
+}
+
+// Merges vertices that land on the same 1/WELD_SCALE grid point, mostly
+// split points made by collinear splitters in different subtrees
+#define WELD_SCALE 1024.0f
+
+// Finds the segment lying on an old splitter, which was welded and may
+// have moved by up to a weld step
+static SDL_bool find_splitter(BuildSegmentArray *segments, pol_Vec2 v1, pol_Vec2 v2, size_t *splitter)
+{
+	const float tolerance = 2.0f / WELD_SCALE;
+
+	for (size_t i = 0; i < segments->len; i++)
+	{
+		pol_Vec2 a = segments->items[i].v1->p;
+		pol_Vec2 b = segments->items[i].v2->p;
+
+		if (SDL_fabsf(a.x - v1.x) <= tolerance && SDL_fabsf(a.y - v1.y) <= tolerance &&
+		    SDL_fabsf(b.x - v2.x) <= tolerance && SDL_fabsf(b.y - v2.y) <= tolerance)
+		{
+			*splitter = i;
+			return SDL_TRUE;
+		}
+	}
+
+	return SDL_FALSE;
+}
+
+static void rebuild_child(BuildContext *ctx, Arena *arena, BuildChild *child, Sint32 old_child, Uint64 old_hash, int depth);
+
+// Splits along the same line as the old node. When the wall it came from
+// was edited away the line is still used, so the subtrees below can match.
+static BuildNode *rebuild_node(BuildContext *ctx, Arena *arena, BuildSegmentArray *segments, Sint32 old_node, int depth)
+{
+	Level *old = ctx->old;
+	Node *n = &old->nodes[old_node];
+	pol_Vec2 v1 = old->vertices[n->splitter.v1];
+	pol_Vec2 v2 = old->vertices[n->splitter.v2];
+
+	BuildNode *node = arena_alloc(arena, sizeof(BuildNode));
+	*node = (BuildNode){0};
+
+	size_t splitter;
+	if (!find_splitter(segments, v1, v2, &splitter))
+	{
+		BuildVertex *line = arena_alloc(arena, sizeof(BuildVertex)*2);
+		line[0] = (BuildVertex){v1, -1};
+		line[1] = (BuildVertex){v2, -1};
+		node->splitter = (BuildSegment){&line[0], &line[1], n->splitter.offset};
+		splitter = NO_SPLITTER;
+	}
+
+	split_segments(arena, segments, splitter, node);
+
+	segments_bbox(&node->left.segs, node->left.box);
+	segments_bbox(&node->right.segs, node->right.box);
+	node->left.hash = segments_hash(&node->left.segs);
+	node->right.hash = segments_hash(&node->right.segs);
+
+	Uint64 *hashes = &old->node_hashes[old_node*2];
+	rebuild_child(ctx, arena, &node->left, n->left, hashes[0], depth+1);
+	rebuild_child(ctx, arena, &node->right, n->right, hashes[1], depth+1);
+
+	return node;
+}
+
+// Keeps the old child when it was built from exactly these segments and
+// follows the old splitters while there is anything left to split. Only
+// leaves whose walls changed are built from scratch.
+static void rebuild_child(BuildContext *ctx, Arena *arena, BuildChild *child, Sint32 old_child, Uint64 old_hash, int depth)
+{
+	if (child->hash == old_hash)
+	{
+		child->reuse = SDL_TRUE;
+		child->old_child = old_child;
+		child->segs = (BuildSegmentArray){0};
+		return;
+	}
+
+	if (!(old_child & SECTOR_FLAG) && child->segs.len > 0)
+	{
+		child->node = rebuild_node(ctx, arena, &child->segs, old_child, depth);
+		child->segs = (BuildSegmentArray){0};
+		return;
+	}
+
+	build_child(ctx, arena, child, depth);
+}
+
+typedef struct
+{
+	Level *level;
+	// Level that reused subtrees are copied from, and the new index of each
+	// of its vertices or -1
+	Level *old;
+	Sint32 *old_vertices;
+	BspRebuildStats stats;
+	size_t vertices_capacity;
+	size_t nodes_capacity;
+	size_t hashes_capacity;
+	size_t sectors_capacity;
+	size_t segs_capacity;
+
+	// Open addressing table of vertex index + 1, 0 when empty
+	Sint32 *weld;
+	size_t weld_capacity;
+	size_t num_welded;
+} Flattener;
+
+static Uint32 weld_hash(pol_Vec2 p, Sint32 *qx, Sint32 *qy)
+{
+	*qx = (Sint32)SDL_floorf(p.x*WELD_SCALE + 0.5f);
+	*qy = (Sint32)SDL_floorf(p.y*WELD_SCALE + 0.5f);
+
+	// Grid coordinates have mostly zero low bits, so mix before masking
+	Uint32 h = (Uint32)*qx*73856093u ^ (Uint32)*qy*19349663u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+
+	return h;
+}
+
+static Sint32 *weld_find(Flattener *flat, pol_Vec2 p)
+{
+	Sint32 qx, qy;
+	Uint32 mask = flat->weld_capacity - 1;
+
+	for (Uint32 i = weld_hash(p, &qx, &qy) & mask;; i = (i + 1) & mask)
+	{
+		Sint32 *slot = &flat->weld[i];
+		if (*slot == 0)
+			return slot;
+
+		Sint32 sx, sy;
+		weld_hash(flat->level->vertices[*slot - 1], &sx, &sy);
+		if (sx == qx && sy == qy)
+			return slot;
+	}
+}
+
+// Keeps the table at most half full
+static void weld_grow(Flattener *flat)
+{
+	if (flat->num_welded*2 < flat->weld_capacity)
+		return;
+
+	Sint32 *old_weld = flat->weld;
+	size_t old_capacity = flat->weld_capacity;
+
+	flat->weld_capacity = old_capacity ? old_capacity*2 : 1024;
+	flat->weld = SDL_calloc(flat->weld_capacity, sizeof(Sint32));
+
+	for (size_t i = 0; i < old_capacity; i++)
+	{
+		if (old_weld[i])
+			*weld_find(flat, flat->level->vertices[old_weld[i] - 1]) = old_weld[i];
+	}
+
+	SDL_free(old_weld);
+}
+
+static Sint32 flatten_point(pol_Vec2 p, Flattener *flat)
+{
+	Level *level = flat->level;
+
+	weld_grow(flat);
+	Sint32 *slot = weld_find(flat, p);
+	if (*slot == 0)
+	{
+		level->vertices = grow_array(level->vertices, &flat->vertices_capacity, level->num_vertices+1, sizeof(pol_Vec2));
+		level->vertices[level->num_vertices++] = p;
+		*slot = level->num_vertices;
+		flat->num_welded++;
+	}
+
+	return *slot - 1;
+}
+
+// Vertices of reused subtrees were welded when they were first built, so
+// they are appended as they are. New vertices on the same spot are kept apart.
+static Sint32 flatten_old_vertex(Sint32 index, Flattener *flat)
+{
+	Level *level = flat->level;
+
+	if (flat->old_vertices[index] < 0)
+	{
+		level->vertices = grow_array(level->vertices, &flat->vertices_capacity, level->num_vertices+1, sizeof(pol_Vec2));
+		level->vertices[level->num_vertices] = flat->old->vertices[index];
+		flat->old_vertices[index] = level->num_vertices++;
+	}
+
+	return flat->old_vertices[index];
+}
+
+static Sint32 flatten_vertex(BuildVertex *v, Flattener *flat)
+{
+	if (v->index < 0)
+		v->index = flatten_point(v->p, flat);
+
+	return v->index;
+}
+
+static LineSegment flatten_segment(BuildSegment *seg, Flattener *flat)
+{
+	Sint32 v1 = flatten_vertex(seg->v1, flat);
+	Sint32 v2 = flatten_vertex(seg->v2, flat);
+
+	return (LineSegment){v1, v2, seg->offset, seg->texture};
+}
+
+// Copies a convex segment list into Level.segs as a new leaf sector
+static int add_sector(BuildSegmentArray *segments, Flattener *flat)
+{
+	Level *level = flat->level;
+
+	level->segs = grow_array(level->segs, &flat->segs_capacity, level->num_segs+segments->len, sizeof(LineSegment));
+	for (size_t i = 0; i < segments->len; i++)
+		level->segs[level->num_segs + i] = flatten_segment(&segments->items[i], flat);
+
+	level->sectors = grow_array(level->sectors, &flat->sectors_capacity, level->num_sectors+1, sizeof(Sector));
+	level->sectors[level->num_sectors].first_seg = level->num_segs;
+	level->sectors[level->num_sectors].num_segments = segments->len;
+	level->num_segs += segments->len;
+
+	return level->num_sectors++;
+}
+
+static int add_node(Node *node, Uint64 *hashes, Flattener *flat)
+{
+	Level *level = flat->level;
+
+	int node_index = level->num_nodes++;
+	level->nodes = grow_array(level->nodes, &flat->nodes_capacity, level->num_nodes, sizeof(Node));
+	level->node_hashes = grow_array(level->node_hashes, &flat->hashes_capacity, level->num_nodes*2, sizeof(Uint64));
+	level->nodes[node_index] = *node;
+	level->node_hashes[node_index*2] = hashes[0];
+	level->node_hashes[node_index*2 + 1] = hashes[1];
+
+	return node_index;
+}
+
+// Copies a subtree of the old level, giving its vertices, nodes and
+// sectors their place in the new one
+static Sint32 copy_child(Sint32 child, Flattener *flat)
+{
+	Level *level = flat->level;
+	Level *old = flat->old;
+
+	if (child & SECTOR_FLAG)
+	{
+		Sector *sector = &old->sectors[child & ~SECTOR_FLAG];
+
+		level->segs = grow_array(level->segs, &flat->segs_capacity, level->num_segs+sector->num_segments, sizeof(LineSegment));
+		for (int i = 0; i < sector->num_segments; i++)
+		{
+			LineSegment *seg = &old->segs[sector->first_seg + i];
+			level->segs[level->num_segs + i] = (LineSegment){
+				flatten_old_vertex(seg->v1, flat),
+				flatten_old_vertex(seg->v2, flat),
+				seg->offset,
+				seg->texture
+			};
+		}
+
+		level->sectors = grow_array(level->sectors, &flat->sectors_capacity, level->num_sectors+1, sizeof(Sector));
+		level->sectors[level->num_sectors].first_seg = level->num_segs;
+		level->sectors[level->num_sectors].num_segments = sector->num_segments;
+		level->num_segs += sector->num_segments;
+		flat->stats.reused_sectors++;
+
+		return level->num_sectors++ | SECTOR_FLAG;
+	}
+
+	Node *old_node = &old->nodes[child];
+	Node node = *old_node;
+	node.splitter.v1 = flatten_old_vertex(old_node->splitter.v1, flat);
+	node.splitter.v2 = flatten_old_vertex(old_node->splitter.v2, flat);
+
+	int node_index = add_node(&node, &old->node_hashes[child*2], flat);
+	flat->stats.reused_nodes++;
+
+	// Children are numbered after their parent, as in flatten_node
+	Sint32 left = copy_child(old_node->left, flat);
+	Sint32 right = copy_child(old_node->right, flat);
+	level->nodes[node_index].left = left;
+	level->nodes[node_index].right = right;
+
+	return node_index;
+}
+
+static int flatten_node(BuildNode *build, Flattener *flat);
+
+static Sint32 flatten_child(BuildChild *child, Flattener *flat)
+{
+	if (child->reuse)
+		return copy_child(child->old_child, flat);
+
+	if (child->node)
+		return flatten_node(child->node, flat);
+
+	return add_sector(&child->segs, flat) | SECTOR_FLAG;
+}
+
+// Numbers nodes, sectors and vertices depth first, left before right, so
+// the output doesn't depend on how the build was scheduled
+static int flatten_node(BuildNode *build, Flattener *flat)
+{
+	Level *level = flat->level;
+
+	Node node;
+	node.splitter = flatten_segment(&build->splitter, flat);
+	SDL_memcpy(node.left_box, build->left.box, sizeof(node.left_box));
+	SDL_memcpy(node.right_box, build->right.box, sizeof(node.right_box));
+
+	Uint64 hashes[2] = {build->left.hash, build->right.hash};
+	int node_index = add_node(&node, hashes, flat);
+
+	Sint32 left = flatten_child(&build->left, flat);
+	Sint32 right = flatten_child(&build->right, flat);
+	level->nodes[node_index].left = left;
+	level->nodes[node_index].right = right;
+
+	return node_index;
+}
+
+void build_segment_table(Level *level)
+{
+	level->seg_infos = SDL_malloc(sizeof(SegmentInfo)*level->num_segs);
+
+	for (size_t i = 0; i < level->num_segs; i++)
+	{
+		LineSegment *seg = &level->segs[i];
+		pol_Vec2 d = vec2_subtract(level->vertices[seg->v2], level->vertices[seg->v1]);
+		float len = vec2_len(d);
+
+		level->seg_infos[i] = (SegmentInfo){
+			.length = len,
+			// Points to the side the wall is seen from
+			.normal = {d.y/len, -d.x/len},
+			.offset = seg->offset,
+			.texture = seg->texture
+		};
+	}
+}
+
+static void build_tree(Level *level, Level *old, SegmentArray *segments, BspOptions *options, BspRebuildStats *stats)
+{
+	BuildContext ctx = {.options = *options, .old = old};
+	if (ctx.options.num_threads < 1)
+		ctx.options.num_threads = 1;
+	while ((1 << ctx.spawn_depth) < ctx.options.num_threads)
+		ctx.spawn_depth++;
+
+	Arena arena = {0};
+
+	BuildVertex *vertices = arena_alloc(&arena, sizeof(BuildVertex)*level->num_vertices);
+	for (size_t i = 0; i < level->num_vertices; i++)
+		vertices[i] = (BuildVertex){level->vertices[i], -1};
+
+	BuildSegmentArray build_segments = {
+		arena_alloc(&arena, sizeof(BuildSegment)*segments->len),
+		segments->len
+	};
+	for (size_t i = 0; i < segments->len; i++)
+	{
+		LineSegment *seg = &segments->items[i];
+		build_segments.items[i] = (BuildSegment){&vertices[seg->v1], &vertices[seg->v2], seg->offset, seg->texture};
+	}
+	SDL_free(segments->items);
+	*segments = (SegmentArray){0};
+
+	// The root is always a node, even for a convex level
+	BuildNode *root;
+	if (old)
+	{
+		root = rebuild_node(&ctx, &arena, &build_segments, 0, 0);
+	}
+	else
+	{
+		SDL_bool convex;
+		size_t splitter = choose_splitter(&ctx, &build_segments, 0, &convex);
+		root = build_node(&ctx, &arena, &build_segments, splitter, 0);
+	}
+
+	// Vertices are renumbered in tree order, dropping unused and welded ones
+	SDL_free(level->vertices);
+	level->vertices = NULL;
+	level->num_vertices = 0;
+
+	Flattener flat = {.level = level, .old = old};
+	if (old)
+	{
+		flat.old_vertices = SDL_malloc(sizeof(Sint32)*old->num_vertices);
+		for (size_t i = 0; i < old->num_vertices; i++)
+			flat.old_vertices[i] = -1;
+	}
+
+	flatten_node(root, &flat);
+	SDL_free(flat.weld);
+	SDL_free(flat.old_vertices);
+	arena_free(&arena);
+
+	if (stats)
+		*stats = flat.stats;
+
+	// Compact the output arrays down to their final sizes
+	level->vertices = SDL_realloc(level->vertices, sizeof(pol_Vec2)*level->num_vertices);
+	level->nodes = SDL_realloc(level->nodes, sizeof(Node)*level->num_nodes);
+	level->node_hashes = SDL_realloc(level->node_hashes, sizeof(Uint64)*2*level->num_nodes);
+	level->sectors = SDL_realloc(level->sectors, sizeof(Sector)*level->num_sectors);
+	level->segs = SDL_realloc(level->segs, sizeof(LineSegment)*level->num_segs);
+
+	build_segment_table(level);
+}
+
+// Builds the tree, the leaf sectors and the segment table from a list of
+// walls over level->vertices. Takes ownership of segments->items.
+void generate_bsp_tree(Level *level, SegmentArray *segments, BspOptions *options)
+{
+	build_tree(level, NULL, segments, options, NULL);
+}
+
+// Same as generate_bsp_tree, but splits along the splitters of old, a level
+// built in memory, for as long as they still exist, and copies every subtree
+// of old whose segments are unchanged instead of building it again. Only the
+// parts of the tree an edit touched cost build time. old must stay valid
+// until this returns, and the result has no PVS.
+void rebuild_bsp_tree(Level *level, Level *old, SegmentArray *segments, BspOptions *options, BspRebuildStats *stats)
+{
+	if (!old->node_hashes || old->num_nodes == 0)
+		old = NULL;
+
+	build_tree(level, old, segments, options, stats);
+}
+
+// Walks the tree with its own stack, degenerate trees can be as deep as they
+// have nodes
+void measure_bsp_tree(Level *level, BspTreeStats *stats)
+{
+	*stats = (BspTreeStats){0};
+
+	stats->memory = sizeof(pol_Vec2)*level->num_vertices + sizeof(Node)*level->num_nodes +
+		sizeof(Sector)*level->num_sectors + (sizeof(LineSegment) + sizeof(SegmentInfo))*level->num_segs +
+		sizeof(LevelTexture)*level->num_textures + level->pvs_size;
+	if (level->pvs)
+		stats->memory += sizeof(Uint32)*level->num_sectors;
+	if (level->node_hashes)
+		stats->memory += sizeof(Uint64)*2*level->num_nodes;
+
+	if (level->num_nodes == 0)
+		return;
+
+	typedef struct { Sint32 node; int depth; } Entry;
+	Entry *stack = NULL;
+	size_t capacity = 0, top = 0;
+	double depth_sum = 0.0;
+	size_t leaves = 0;
+
+	stack = grow_array(stack, &capacity, 1, sizeof(Entry));
+	stack[top++] = (Entry){0, 0};
+
+	while (top > 0)
+	{
+		Entry entry = stack[--top];
+		if (entry.node & SECTOR_FLAG)
+		{
+			stats->max_depth = SDL_max(stats->max_depth, entry.depth);
+			depth_sum += entry.depth;
+			leaves++;
+			continue;
+		}
+
+		Node *node = &level->nodes[entry.node];
+		stack = grow_array(stack, &capacity, top+2, sizeof(Entry));
+		stack[top++] = (Entry){node->left, entry.depth+1};
+		stack[top++] = (Entry){node->right, entry.depth+1};
+	}
+
+	stats->average_depth = leaves ? depth_sum / leaves : 0.0;
+	SDL_free(stack);
+}
+
+// Reads a level description: "v <x> <y>" adds a vertex, "t <path>" a
+// texture and "s <v1> <v2> [texture]" a wall between two earlier vertices,
+// using the first texture unless one is given. '#' starts a comment.
+SDL_bool load_level_text(Level *level, SegmentArray *segments, const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (!file)
+	{
+		fprintf(stderr, "Could not open %s\n", path);
+		return SDL_FALSE;
+	}
+
+	*level = (Level){0};
+	*segments = (SegmentArray){0};
+
+	size_t vertices_capacity = 0;
+	size_t segments_capacity = 0;
+	size_t textures_capacity = 0;
+
+	char line[256];
+	int line_number = 0;
+	while (fgets(line, sizeof(line), file))
+	{
+		line_number++;
+
+		char *comment = SDL_strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		float x, y;
+		int v1, v2, texture = 0;
+		char texture_path[LEVEL_TEXTURE_PATH_SIZE];
+		char trailing;
+
+		if (sscanf(line, " v %f %f %c", &x, &y, &trailing) == 2)
+		{
+			level->vertices = grow_array(level->vertices, &vertices_capacity, level->num_vertices+1, sizeof(pol_Vec2));
+			level->vertices[level->num_vertices++] = (pol_Vec2){x, y};
+		}
+		else if (sscanf(line, " t %63s %c", texture_path, &trailing) == 1)
+		{
+			level->textures = grow_array(level->textures, &textures_capacity, level->num_textures+1, sizeof(LevelTexture));
+			SDL_memset(&level->textures[level->num_textures], 0, sizeof(LevelTexture));
+			SDL_strlcpy(level->textures[level->num_textures++].path, texture_path, LEVEL_TEXTURE_PATH_SIZE);
+		}
+		else if (sscanf(line, " s %d %d %c", &v1, &v2, &trailing) == 2 ||
+		         sscanf(line, " s %d %d %d %c", &v1, &v2, &texture, &trailing) == 3)
+		{
+			if (v1 < 0 || v2 < 0 || v1 >= level->num_vertices || v2 >= level->num_vertices || v1 == v2)
+			{
+				fprintf(stderr, "%s:%d: bad vertex index\n", path, line_number);
+				goto fail;
+			}
+
+			if (texture < 0 || (texture > 0 && texture >= level->num_textures))
+			{
+				fprintf(stderr, "%s:%d: bad texture index\n", path, line_number);
+				goto fail;
+			}
+
+			segments->items = grow_array(segments->items, &segments_capacity, segments->len+1, sizeof(LineSegment));
+			segments->items[segments->len++] = (LineSegment){v1, v2, 0.0f, texture};
+		}
+		else
+		{
+			char *c = line;
+			while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')
+				c++;
+
+			if (*c)
+			{
+				fprintf(stderr, "%s:%d: syntax error\n", path, line_number);
+				goto fail;
+			}
+		}
+	}
+
+	fclose(file);
+
+	if (segments->len == 0)
+	{
+		fprintf(stderr, "%s: no walls\n", path);
+		free_level(level);
+		return SDL_FALSE;
+	}
+
+	return SDL_TRUE;
+
+fail:
+	fclose(file);
+	SDL_free(segments->items);
+	*segments = (SegmentArray){0};
+	free_level(level);
+	return SDL_FALSE;
+}
+
+static Uint32 align_offset(Uint32 offset)
+{
+	return (offset + 15) & ~15u;
+}
+
+static SDL_bool write_block(FILE *file, Uint32 offset, void *data, size_t size)
+{
+	if (fseek(file, offset, SEEK_SET) != 0)
+		return SDL_FALSE;
+
+	return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+SDL_bool write_level_file(Level *level, const char *path)
+{
+	LevelFileHeader header = {
+		.magic = LEVEL_FILE_MAGIC,
+		.version = LEVEL_FILE_VERSION,
+		.num_vertices = level->num_vertices,
+		.num_nodes = level->num_nodes,
+		.num_sectors = level->num_sectors,
+		.num_segs = level->num_segs,
+		.num_pvs_bytes = level->pvs_size,
+		.num_textures = level->num_textures
+	};
+	SDL_memcpy(header.pvs_box, level->pvs_box, sizeof(header.pvs_box));
+
+	size_t num_pvs_offsets = level->pvs_size ? level->num_sectors : 0;
+
+	Uint32 offset = align_offset(sizeof(header));
+	header.vertices_offset = offset;
+	offset = align_offset(offset + sizeof(pol_Vec2)*level->num_vertices);
+	header.nodes_offset = offset;
+	offset = align_offset(offset + sizeof(Node)*level->num_nodes);
+	header.sectors_offset = offset;
+	offset = align_offset(offset + sizeof(Sector)*level->num_sectors);
+	header.segs_offset = offset;
+	offset = align_offset(offset + sizeof(LineSegment)*level->num_segs);
+	header.seg_infos_offset = offset;
+	offset = align_offset(offset + sizeof(SegmentInfo)*level->num_segs);
+	header.pvs_offsets_offset = offset;
+	offset = align_offset(offset + sizeof(Uint32)*num_pvs_offsets);
+	header.pvs_offset = offset;
+	offset = align_offset(offset + level->pvs_size);
+	header.textures_offset = offset;
+	offset = offset + sizeof(LevelTexture)*level->num_textures;
+	header.file_size = offset;
+
+	FILE *file = fopen(path, "wb");
+	if (!file)
+	{
+		fprintf(stderr, "Could not open %s for writing\n", path);
+		return SDL_FALSE;
+	}
+
+	// Padding between blocks is left to fseek, which fills gaps with zeros
+	SDL_bool ok = write_block(file, 0, &header, sizeof(header)) &&
+		write_block(file, header.vertices_offset, level->vertices, sizeof(pol_Vec2)*level->num_vertices) &&
+		write_block(file, header.nodes_offset, level->nodes, sizeof(Node)*level->num_nodes) &&
+		write_block(file, header.sectors_offset, level->sectors, sizeof(Sector)*level->num_sectors) &&
+		write_block(file, header.segs_offset, level->segs, sizeof(LineSegment)*level->num_segs) &&
+		write_block(file, header.seg_infos_offset, level->seg_infos, sizeof(SegmentInfo)*level->num_segs) &&
+		write_block(file, header.pvs_offsets_offset, level->pvs_offsets, sizeof(Uint32)*num_pvs_offsets) &&
+		write_block(file, header.pvs_offset, level->pvs, level->pvs_size) &&
+		write_block(file, header.textures_offset, level->textures, sizeof(LevelTexture)*level->num_textures);
+
+	// Empty blocks at the end only seek, so the padding before them has to
+	// be added to reach file_size
+	if (ok && (fflush(file) != 0 || ftruncate(fileno(file), header.file_size) != 0))
+		ok = SDL_FALSE;
+
+	if (fclose(file) != 0)
+		ok = SDL_FALSE;
+
+	if (!ok)
+		fprintf(stderr, "Could not write %s\n", path);
+
+	return ok;
+}
+
+static SDL_bool block_in_file(LevelFileHeader *header, Uint32 offset, size_t count, size_t size)
+{
+	return (offset % 4 == 0 || size == 1) && offset <= header->file_size &&
+		count <= (header->file_size - offset) / size;
+}
+
+// Checks every index stored in a mapped level against the arrays it points
+// into, so a corrupt file is rejected here instead of read out of bounds
+// while rendering
+static SDL_bool level_indices_valid(Level *level)
+{
+	size_t num_textures = SDL_max(level->num_textures, 1);
+
+	// With no nodes the whole level is sector 0
+	if (level->num_nodes == 0 && level->num_sectors == 0)
+		return SDL_FALSE;
+
+	for (size_t i = 0; i < level->num_nodes; i++)
+	{
+		Node *node = &level->nodes[i];
+		if (node->splitter.v1 < 0 || node->splitter.v1 >= level->num_vertices ||
+		    node->splitter.v2 < 0 || node->splitter.v2 >= level->num_vertices)
+			return SDL_FALSE;
+
+		// Children are numbered after their parent, which also rules out
+		// cycles
+		Sint32 children[2] = {node->left, node->right};
+		for (int side = 0; side < 2; side++)
+		{
+			Uint32 child = children[side];
+			if (child & SECTOR_FLAG)
+			{
+				if ((child & ~SECTOR_FLAG) >= level->num_sectors)
+					return SDL_FALSE;
+			}
+			else if (child <= i || child >= level->num_nodes)
+				return SDL_FALSE;
+		}
+	}
+
+	for (size_t i = 0; i < level->num_sectors; i++)
+	{
+		Sector *sector = &level->sectors[i];
+		if (sector->first_seg < 0 || sector->num_segments < 0 ||
+		    sector->first_seg > level->num_segs || sector->num_segments > level->num_segs - sector->first_seg)
+			return SDL_FALSE;
+	}
+
+	for (size_t i = 0; i < level->num_segs; i++)
+	{
+		LineSegment *seg = &level->segs[i];
+		if (seg->v1 < 0 || seg->v1 >= level->num_vertices || seg->v2 < 0 || seg->v2 >= level->num_vertices ||
+		    seg->texture < 0 || seg->texture >= num_textures ||
+		    level->seg_infos[i].texture < 0 || level->seg_infos[i].texture >= num_textures)
+			return SDL_FALSE;
+	}
+
+	for (size_t i = 0; i < level->num_textures; i++)
+	{
+		char *path = level->textures[i].path;
+		int len = 0;
+		while (len < LEVEL_TEXTURE_PATH_SIZE && path[len])
+			len++;
+		if (len == LEVEL_TEXTURE_PATH_SIZE)
+			return SDL_FALSE;
+	}
+
+	// Every row has to decompress without running off the end. Sectors that
+	// see everything share one row, which is only walked once.
+	if (level->pvs_size == 0)
+		return SDL_TRUE;
+
+	size_t row_bytes = (level->num_sectors + 7) >> 3;
+	// Bits past the last sector in a row's final byte
+	Uint8 padding = (level->num_sectors & 7) ? 0xff << (level->num_sectors & 7) : 0;
+	Uint32 last_checked = 0xffffffffu;
+	for (size_t s = 0; s < level->num_sectors; s++)
+	{
+		Uint32 offset = level->pvs_offsets[s];
+		if (offset == last_checked)
+			continue;
+
+		size_t in = offset;
+		for (size_t i = 0; i < row_bytes;)
+		{
+			if (in >= level->pvs_size)
+				return SDL_FALSE;
+
+			if (level->pvs[in])
+			{
+				if (i == row_bytes-1 && (level->pvs[in] & padding))
+					return SDL_FALSE;
+				i++;
+				in++;
+				continue;
+			}
+
+			if (in + 1 >= level->pvs_size)
+				return SDL_FALSE;
+			i += level->pvs[in+1];
+			in += 2;
+		}
+
+		last_checked = offset;
+	}
+
+	return SDL_TRUE;
+}
+
+// Maps a file written by write_level_file and points the level's arrays
+// straight into it. Nothing is parsed or copied, though the indices are
+// validated, which reads the whole file once.
+SDL_bool load_level_file(Level *level, const char *path)
+{
+	*level = (Level){0};
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Could not open %s\n", path);
+		return SDL_FALSE;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(LevelFileHeader))
+	{
+		fprintf(stderr, "%s: not a level file\n", path);
+		close(fd);
+		return SDL_FALSE;
+	}
+
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		fprintf(stderr, "Could not map %s\n", path);
+		return SDL_FALSE;
+	}
+
+	LevelFileHeader *header = mapping;
+	if (header->magic != LEVEL_FILE_MAGIC || header->version != LEVEL_FILE_VERSION ||
+	    header->file_size != st.st_size ||
+	    !block_in_file(header, header->vertices_offset, header->num_vertices, sizeof(pol_Vec2)) ||
+	    !block_in_file(header, header->nodes_offset, header->num_nodes, sizeof(Node)) ||
+	    !block_in_file(header, header->sectors_offset, header->num_sectors, sizeof(Sector)) ||
+	    !block_in_file(header, header->segs_offset, header->num_segs, sizeof(LineSegment)) ||
+	    !block_in_file(header, header->seg_infos_offset, header->num_segs, sizeof(SegmentInfo)) ||
+	    !block_in_file(header, header->pvs_offsets_offset, header->num_pvs_bytes ? header->num_sectors : 0, sizeof(Uint32)) ||
+	    !block_in_file(header, header->pvs_offset, header->num_pvs_bytes, 1) ||
+	    !block_in_file(header, header->textures_offset, header->num_textures, sizeof(LevelTexture)))
+	{
+		fprintf(stderr, "%s: not a level file of version %d\n", path, LEVEL_FILE_VERSION);
+		munmap(mapping, st.st_size);
+		return SDL_FALSE;
+	}
+
+	Uint8 *base = mapping;
+	level->vertices = (pol_Vec2*)(base + header->vertices_offset);
+	level->num_vertices = header->num_vertices;
+	level->nodes = (Node*)(base + header->nodes_offset);
+	level->num_nodes = header->num_nodes;
+	level->sectors = (Sector*)(base + header->sectors_offset);
+	level->num_sectors = header->num_sectors;
+	level->segs = (LineSegment*)(base + header->segs_offset);
+	level->seg_infos = (SegmentInfo*)(base + header->seg_infos_offset);
+	level->num_segs = header->num_segs;
+	level->pvs_offsets = (Uint32*)(base + header->pvs_offsets_offset);
+	level->pvs = base + header->pvs_offset;
+	level->pvs_size = header->num_pvs_bytes;
+	level->textures = (LevelTexture*)(base + header->textures_offset);
+	level->num_textures = header->num_textures;
+	SDL_memcpy(level->pvs_box, header->pvs_box, sizeof(level->pvs_box));
+	level->mapping = mapping;
+	level->mapping_size = st.st_size;
+
+	if (!level_indices_valid(level))
+	{
+		fprintf(stderr, "%s: corrupt level file\n", path);
+		free_level(level);
+		return SDL_FALSE;
+	}
+
+	return SDL_TRUE;
+}
+
+void free_level(Level *level)
+{
+	if (level->mapping)
+	{
+		munmap(level->mapping, level->mapping_size);
+	}
+	else
+	{
+		SDL_free(level->vertices);
+		SDL_free(level->nodes);
+		SDL_free(level->node_hashes);
+		SDL_free(level->sectors);
+		SDL_free(level->segs);
+		SDL_free(level->seg_infos);
+		SDL_free(level->pvs_offsets);
+		SDL_free(level->pvs);
+		SDL_free(level->textures);
+	}
+
+	*level = (Level){0};
+}
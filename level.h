@@ -0,0 +1,294 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+#include <SDL2/SDL.h>
+
+#define DEG2RAD (M_PI/180.0f)
+#define EPSILON 0.000001f
+
+#define MAX(a, b) (a) > (b) ? (a) : (b)
+#define MIN(a, b) (a) < (b) ? (a) : (b)
+#define CLAMP(a, b, c) MAX(b, MIN(c, a))
+
+#define VEC2ZERO (pol_Vec2){0}
+
+#define SECTOR_FLAG 0x80000000
+
+typedef struct pol
+{
+	float x, y;
+} pol_Vec2;
+
+typedef struct
+{
+	Sint32 v1, v2;
+	// Distance along the original wall to v1, kept across splits
+	float offset;
+	// Index into Level.textures
+	Sint32 texture;
+} LineSegment;
+
+typedef struct
+{
+	LineSegment *items;
+	size_t len;
+} SegmentArray;
+
+// Per-segment values that don't change after the level is built
+typedef struct
+{
+	float length;
+	pol_Vec2 normal;
+	float offset;
+	Sint32 texture;
+} SegmentInfo;
+
+typedef struct
+{
+	Sint32 first_seg;
+	Sint32 num_segments;
+} Sector;
+
+#define LEVEL_TEXTURE_PATH_SIZE 64
+
+// Image file a level's walls refer to by index. Fixed size, so the table can
+// be used straight out of a mapped level file.
+typedef struct
+{
+	char path[LEVEL_TEXTURE_PATH_SIZE];
+} LevelTexture;
+
+// Axis aligned bounds, indexed with BOX_*
+enum { BOX_TOP, BOX_BOTTOM, BOX_LEFT, BOX_RIGHT };
+
+typedef struct Node
+{
+	LineSegment splitter;
+	Sint32 left;
+	Sint32 right;
+	float left_box[4];
+	float right_box[4];
+} Node;
+
+typedef struct
+{
+	pol_Vec2 *vertices;
+	size_t num_vertices;
+	Node *nodes;
+	size_t num_nodes;
+	Sector *sectors;
+	size_t num_sectors;
+	// Segments of all sectors, each sector owning a contiguous run
+	LineSegment *segs;
+	SegmentInfo *seg_infos;
+	size_t num_segs;
+	// Empty when the level names no textures, every wall then uses the
+	// game's default one
+	LevelTexture *textures;
+	size_t num_textures;
+
+	// Potentially visible set: for every sector, the offset of a run length
+	// compressed bitset of the sectors that can be seen from it. Empty when
+	// the level was built without vis. Only valid inside pvs_box. A row
+	// without the sector's own bit means it can't be used for culling.
+	Uint32 *pvs_offsets;
+	Uint8 *pvs;
+	size_t pvs_size;
+	float pvs_box[4];
+
+	// Hash of the segments each child of a node was built from, left then
+	// right for every node. Only kept for levels built in memory, where
+	// rebuild_bsp_tree uses it to find the subtrees an edit didn't touch.
+	Uint64 *node_hashes;
+
+	// Set when the arrays point into a mapped level file
+	void *mapping;
+	size_t mapping_size;
+} Level;
+
+// Splitter choice and threading for generate_bsp_tree
+typedef struct
+{
+	// Cost per segment cut in two by a splitter
+	float split_cost;
+	// Cost per segment of difference between the two sides
+	float balance_cost;
+	// Splitters scored per node, spread evenly over its segments. 0 scores all
+	int max_candidates;
+	int num_threads;
+} BspOptions;
+
+#define BSP_DEFAULT_OPTIONS (BspOptions){8.0f, 1.0f, 128, 1}
+
+// Parts of the previous tree rebuild_bsp_tree could keep
+typedef struct
+{
+	size_t reused_nodes;
+	size_t reused_sectors;
+} BspRebuildStats;
+
+// Shape and size of a built tree, from measure_bsp_tree
+typedef struct
+{
+	int max_depth;
+	double average_depth;
+	// Bytes the level's arrays take up
+	size_t memory;
+} BspTreeStats;
+
+// Procedural stress maps, see mapgen.c
+typedef enum
+{
+	MAP_PILLARS,
+	MAP_ARENA,
+	MAP_MAZE,
+	MAP_CORRIDOR,
+	MAP_KIND_COUNT
+} MapKind;
+
+extern const char *map_kind_names[MAP_KIND_COUNT];
+
+// Binary level file, produced by bspc and mapped read-only by the game.
+// Every array is stored exactly as the in-memory struct, starting at its
+// offset from the beginning of the file.
+#define LEVEL_FILE_MAGIC 0x50534250 // "PBSP"
+#define LEVEL_FILE_VERSION 3
+
+typedef struct
+{
+	Uint32 magic;
+	Uint32 version;
+	Uint32 num_vertices;
+	Uint32 num_nodes;
+	Uint32 num_sectors;
+	Uint32 num_segs;
+	Uint32 num_pvs_bytes;
+	Uint32 num_textures;
+	float pvs_box[4];
+	Uint32 vertices_offset;
+	Uint32 nodes_offset;
+	Uint32 sectors_offset;
+	Uint32 segs_offset;
+	Uint32 seg_infos_offset;
+	Uint32 pvs_offsets_offset;
+	Uint32 pvs_offset;
+	Uint32 textures_offset;
+	Uint32 file_size;
+} LevelFileHeader;
+
+inline float vec2_dot_product(pol_Vec2 v1, pol_Vec2 v2)
+{
+	return v1.x*v2.x + v1.y*v2.y;
+}
+
+inline float vec2_cross_product(pol_Vec2 v1, pol_Vec2 v2)
+{
+	return v1.x * v2.y - v1.y*v2.x;
+}
+
+inline float vec2_angle(pol_Vec2 v1, pol_Vec2 v2)
+{
+    float result;
+
+    float dot = v1.x*v2.x + v1.y*v2.y;
+    float det = v1.x*v2.y - v1.y*v2.x;
+
+    result = SDL_atan2f(det, dot);
+
+    return result;
+}
+
+inline float vec2_len(pol_Vec2 v1)
+{
+	return SDL_sqrtf(v1.x * v1.x + v1.y * v1.y);
+}
+
+inline pol_Vec2 vec2_subtract(pol_Vec2 v1, pol_Vec2 v2)
+{
+	pol_Vec2 result;
+	result.x = v1.x - v2.x;
+	result.y = v1.y - v2.y;
+
+	return result;
+}
+
+inline pol_Vec2 vec2_add(pol_Vec2 v1, pol_Vec2 v2)
+{
+	pol_Vec2 result;
+	result.x = v1.x + v2.x;
+	result.y = v1.y + v2.y;
+
+	return result;
+}
+
+inline int point_on_side(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 p)
+{
+	float cross = vec2_cross_product(vec2_subtract(v2, v1), vec2_subtract(p, v1));
+
+	// On the line
+	if (SDL_fabsf(cross) < EPSILON)
+		return 0;
+
+	if (cross > 0)
+		return -1;
+
+	return 1;
+}
+
+pol_Vec2 vec2_rotate(pol_Vec2 v, float angle);
+pol_Vec2 line_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4);
+pol_Vec2 line_segment_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4);
+
+void *grow_array(void *items, size_t *capacity, size_t count, size_t item_size);
+
+void build_segment_table(Level *level);
+void generate_bsp_tree(Level *level, SegmentArray *segments, BspOptions *options);
+void rebuild_bsp_tree(Level *level, Level *old, SegmentArray *segments, BspOptions *options, BspRebuildStats *stats);
+void measure_bsp_tree(Level *level, BspTreeStats *stats);
+
+void generate_map(Level *level, SegmentArray *segments, MapKind kind, int num_segments);
+SDL_bool map_kind_from_name(const char *name, MapKind *kind);
+
+// Sectors are treated as open space this far outside the walls
+#define PVS_MARGIN 64.0f
+// Portal flow steps per sector before it gives up and sees everything
+#define PVS_DEFAULT_MAX_STEPS 4096
+
+void build_pvs(Level *level, int num_threads, int max_steps);
+void decompress_pvs_row(Level *level, Uint32 sector, Uint8 *row);
+
+// Circle to move by delta. move_circles fills in the position it ends up at
+// after sliding along walls and whether it hit any.
+typedef struct
+{
+	pol_Vec2 pos;
+	pol_Vec2 delta;
+	float radius;
+	pol_Vec2 result;
+	SDL_bool blocked;
+} CircleMove;
+
+// Line to test. trace_lines fills in the fraction of the way to the first
+// wall hit, 1 without a hit, and that wall's segment or -1.
+typedef struct
+{
+	pol_Vec2 from;
+	pol_Vec2 to;
+	float fraction;
+	Sint32 seg;
+} LineTrace;
+
+Sint32 locate_sector(Level *level, pol_Vec2 p);
+void locate_sectors(Level *level, pol_Vec2 *points, Sint32 *sectors, int count);
+pol_Vec2 move_circle(Level *level, pol_Vec2 pos, pol_Vec2 delta, float radius, SDL_bool *blocked);
+void move_circles(Level *level, CircleMove *moves, int count);
+float trace_line(Level *level, pol_Vec2 from, pol_Vec2 to, Sint32 *seg);
+SDL_bool line_of_sight(Level *level, pol_Vec2 from, pol_Vec2 to);
+void trace_lines(Level *level, LineTrace *traces, int count);
+
+SDL_bool load_level_text(Level *level, SegmentArray *segments, const char *path);
+SDL_bool write_level_file(Level *level, const char *path);
+SDL_bool load_level_file(Level *level, const char *path);
+void free_level(Level *level);
+
+#endif
@@ -1,31 +1,28 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
 
-#define SCREEN_WIDTH 640
-#define SCREEN_HEIGHT 400
-
-#define SW2 (SCREEN_WIDTH/2.0f)
-#define SH2 (SCREEN_HEIGHT/2.0f)
-
-#define YSCALE (float)SCREEN_WIDTH/SCREEN_HEIGHT
+#include <sys/stat.h>
 
-#define DEG2RAD (M_PI/180.0f)
-#define EPSILON 0.000001f
+#include "export.h"
+#include "level.h"
+#include "profile.h"
 
-#define FOV (90.0f*DEG2RAD)
+#if defined(__x86_64__) || defined(__i386__)
+#define POL_X86 1
+#include <immintrin.h>
+#endif
 
-#define MAX(a, b) (a) > (b) ? (a) : (b)
-#define MIN(a, b) (a) < (b) ? (a) : (b)
-#define CLAMP(a, b, c) MAX(b, MIN(c, a))
+// Default window size and internal resolution
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 400
 
-#define VEC2ZERO (pol_Vec2){0}
+// Largest internal resolution, which sizes the per-column and per-row arrays
+#define MAX_RENDER_WIDTH 1920
+#define MAX_RENDER_HEIGHT 1200
 
-#define SECTOR_FLAG 0x80000000
+#define FOV (90.0f*DEG2RAD)
 
-typedef struct pol
-{
-	float x, y;
-} pol_Vec2;
+#define WALL_TEXTURE_PATH "greenman.png"
 
 typedef struct
 {
@@ -40,22 +37,131 @@ typedef struct
 	float view_angle;
 } PlayerCam;
 
+#define MAX_MIP_LEVELS 16
+
+// Power of two RGBA image stored column major, so texel (x, y) is at
+// pixels[(x << h_bits) + y] and wall columns read contiguous memory.
+typedef struct
+{
+	int w, h;
+	int w_bits, h_bits;
+	int w_mask, h_mask;
+	pol_Color *pixels;
+	// Palette indices in the same layout, set when the palette is on
+	Uint8 *indices;
+} MipLevel;
+
+// levels[0] is the full resolution image, each further level halves both
+// sides down to 1x1.
+typedef struct
+{
+	int w, h;
+	int num_levels;
+	MipLevel levels[MAX_MIP_LEVELS];
+} Texture;
+
+// Light levels in every colormap, and the distance at which the darkest one
+// is reached
+#define NUM_LIGHT_LEVELS 32
+#define LIGHT_FADE_DISTANCE 512.0f
+// Texels per light level the palette is built from, sampled evenly across
+// the level's textures
+#define PALETTE_SAMPLE_TEXELS 65536
+
+// 8-bit pipeline: textures are quantized to one shared palette and walls
+// and flats write palette indices through a colormap picked by distance.
+// Index 0 is always black.
+typedef struct
+{
+	SDL_bool enabled;
+	pol_Color colors[256];
+	// colormaps[light][index] is the index closest to colour index darkened
+	// to that light level
+	Uint8 colormaps[NUM_LIGHT_LEVELS][256];
+} Palette;
+
 typedef struct
 {
-	int v1, v2;
-} LineSegment;
+	time_t mtime;
+	off_t size;
+} FileStamp;
+
+// Index into the texture cache. -1 always draws the placeholder.
+typedef Sint32 TextureHandle;
+
+#define MAX_TEXTURES 1024
+#define TEXTURE_DECODE_THREADS 2
+// Default for --texture-mb
+#define DEFAULT_TEXTURE_BUDGET_MB 64
+// Textures of walls in leaves this close to the camera are loaded ahead of
+// being seen
+#define TEXTURE_PREFETCH_RADIUS 1024.0f
+
+typedef enum
+{
+	TEXTURE_IDLE,
+	TEXTURE_QUEUED,
+	TEXTURE_DECODING,
+	TEXTURE_DECODED,
+	TEXTURE_FAILED
+} TextureJob;
 
 typedef struct
 {
-	LineSegment *items;
-	size_t len;
-} SegmentArray;
+	char path[LEVEL_TEXTURE_PATH_SIZE];
+
+	// Owned by the render thread and read by render workers during a frame
+	SDL_bool resident;
+	Texture tex;
+	size_t bytes;
+	// Cache frame the texture was last drawn or prefetched in
+	SDL_atomic_t last_used;
+
+	// Guarded by the cache lock. decoded belongs to a decode thread while
+	// job is TEXTURE_DECODING.
+	TextureJob job;
+	Texture decoded;
+
+	// Only touched by the live edit watcher
+	FileStamp stamp;
+} CachedTexture;
+
+// Walls, flats and things refer to textures by handle. Decode threads load
+// and convert them in the background and the render thread makes finished
+// ones resident between frames, so a frame never waits on disk or decoding
+// and draws the placeholder until then. When resident textures go over the
+// byte budget the least recently used ones are dropped, but never one used
+// in the last frame, so the textures in view can exceed it.
+typedef struct
+{
+	CachedTexture items[MAX_TEXTURES];
+	// Only grows, written with the lock held
+	int count;
+	Texture placeholder;
+	size_t budget;
+	size_t resident_bytes;
+	Uint32 frame;
+
+	SDL_mutex *lock;
+	SDL_cond *wake;
+	SDL_bool quit;
+	// Handles waiting for a decode thread, each queued at most once
+	TextureHandle queue[MAX_TEXTURES];
+	int queue_head, queue_len;
+	// Queued, decoding or decoded but not yet resident
+	int in_flight;
+	SDL_Thread *threads[TEXTURE_DECODE_THREADS];
+
+	// Totals for the benchmark
+	int loads, evictions;
+} TextureCache;
 
 typedef struct
 {
 	LineSegment *line_seg;
+	SegmentInfo *info;
 	float floor_height, ceiling_height;
-	SDL_Surface *tex;
+	TextureHandle texture;
 } DrawSegment;
 
 typedef struct
@@ -63,55 +169,264 @@ typedef struct
 	int x;
 	int tex_x;
 	int y1, y2;
-	float v_start, v_end;
-	float sy1, sy2;
+	// Texture v at row y is v_base + y*v_step
+	float v_base, v_step;
 } DrawColumn;
 
+// Per-segment inputs of the wall column setup pass
 typedef struct
 {
-	int start_row;
-	int end_row;
-	int x;
-	float normalized_x;
-	float view_plane_height;
-	PlayerCam *player_cam;
-} DrawPlaneColumn;
+	int first_col;
+	float screen_x1;
+	float inv_width;
+	// Top and bottom screen rows at first_col and their slopes
+	float screen_y1, screen_y2;
+	float slope1, slope2;
+	// Perspective correct u: ((1-t)*u1 + t*u2) / ((1-t)*w1 + t*w2)
+	float u1, u2;
+	float w1, w2;
+	float v_start, v_end;
+	float tex_w;
+} WallSetup;
 
+// Results of the setup pass, indexed by screen column
 typedef struct
 {
-	int num_segments;
-	LineSegment *line_segs;
-} Sector;
+	int tex_x[MAX_RENDER_WIDTH];
+	int y1[MAX_RENDER_WIDTH];
+	int y2[MAX_RENDER_WIDTH];
+	float v_base[MAX_RENDER_WIDTH];
+	float v_step[MAX_RENDER_WIDTH];
+} WallColumns;
+
+#define MAX_VISPLANES 128
 
+// Floor or ceiling area collected column by column while walls are drawn,
+// then rasterized as horizontal spans.
 typedef struct
 {
-	Sector *items[128];
-	size_t len;
-} SectorPointerArray;
-
-typedef struct Node
+	float view_height;
+	Texture *tex;
+	int min_x, max_x;
+	short top[MAX_RENDER_WIDTH];
+	short bottom[MAX_RENDER_WIDTH];
+} Visplane;
+
+// Billboard standing on the floor
+typedef struct
+{
+	pol_Vec2 pos;
+	float radius, height;
+	TextureHandle texture;
+	// Next thing in the same sector, -1 at the end
+	Sint32 next;
+} Thing;
+
+// Things are linked into the leaf they stand in, so the front to back walk
+// reaches only the things in leaves it visits. Nodes keep bounds of the
+// things under each child, since a leaf's walls can be out of view while
+// things in it are not.
+typedef struct
+{
+	Thing *items;
+	size_t count, capacity;
+	// First thing of every sector, -1 without one
+	Sint32 *sector_first;
+	// [node][0] bounds the things under the left child, [node][1] under the
+	// right one, indexed with BOX_*. They only ever grow.
+	float (*node_boxes)[2][4];
+} ThingSet;
+
+#define THING_RADIUS 16.0f
+#define THING_HEIGHT 32.0f
+
+// Thing projected into one strip
+typedef struct
 {
-	LineSegment splitter;
-	int left;
-	int right;
-} Node;
+	Thing *thing;
+	// Columns it covers in the strip
+	int x1, x2;
+	// Unclipped left edge and top row, and pixels per world unit
+	float screen_left, screen_top;
+	float scale;
+	float depth;
+} VisSprite;
+
+// Sprites are sorted into buckets this many world units deep. Farther ones
+// share the last bucket.
+#define SPRITE_DEPTH_BUCKETS 1024
+#define SPRITE_BUCKET_DEPTH 2.0f
+// Things closer than this to the camera plane aren't drawn
+#define SPRITE_NEAR 1.0f
 
+typedef enum
+{
+	HEATMAP_OFF,
+	// Writes per pixel
+	HEATMAP_OVERDRAW,
+	// Time spent filling each screen column
+	HEATMAP_COLUMN_TIME,
+	HEATMAP_MODE_COUNT
+} HeatmapMode;
+
+// Debug view filled in by the normal wall and span paths and turned into
+// false colour once the frame is done. Owned by whichever thread renders.
+typedef struct
+{
+	HeatmapMode mode;
+	// Writes per pixel, width*height, saturating at 255
+	Uint8 *writes;
+	// Performance counter ticks per column. Strips own disjoint columns.
+	Uint64 column_ticks[MAX_RENDER_WIDTH];
+	// Writes per covered pixel in the last overdraw frame
+	float overdraw;
+} Heatmap;
+
+// Internal render resolution and the tables that depend on it. Shared by
+// every strip and only changed between frames.
+typedef struct
+{
+	int width, height;
+	// Distance in pixels between rows of the target buffer
+	int pitch;
+	float half_width, half_height;
+	// Vertical projection scale, keeping pixels square
+	float y_scale;
+	// Distance along the view axis to a plane of height 1 seen through each row
+	float row_distance[MAX_RENDER_HEIGHT];
+} Viewport;
+
+// Per-frame occlusion state for the strip of columns [x_start, x_end].
+// Walls are drawn front to back, so every row outside
+// (ceiling_clip, floor_clip) of a column is already final.
+typedef struct
+{
+	pol_Color *pixels;
+	// Palette index target, written instead of pixels when set
+	Uint8 *indices;
+	Viewport *view;
+	int x_start, x_end;
+	int open_columns;
+	// Rotation taking world offsets into view space
+	float view_cos, view_sin;
+	// Level.vertices transformed into view space for this frame
+	float *view_x, *view_y;
+	WallColumns wall_columns;
+	short ceiling_clip[MAX_RENDER_WIDTH];
+	short floor_clip[MAX_RENDER_WIDTH];
+	Visplane planes[MAX_VISPLANES];
+	int num_planes;
+	// View depth of the wall that closed each column, INFINITY while open
+	float wall_depth[MAX_RENDER_WIDTH];
+	// Things in the leaves visited so far, drawn back to front after the
+	// planes and clipped against wall_depth
+	VisSprite *sprites;
+	VisSprite *sorted_sprites;
+	size_t num_sprites;
+	size_t sprites_capacity, sorted_capacity;
+	int sprite_buckets[SPRITE_DEPTH_BUCKETS+1];
+	// Profiler lane and frame, and counters handed to it after each strip
+	int profile_lane;
+	Uint32 frame;
+	Uint64 counters[PROFILE_COUNTER_COUNT];
+} RenderContext;
+
+// Nodes and sectors that can hold something visible from the camera's
+// sector are stamped with the current visframe, so nothing has to be cleared
+// when the camera moves to another sector.
 typedef struct
 {
-	pol_Vec2 *vertices;
-	size_t num_vertices;
-	Node *nodes;
-	size_t num_nodes;
-	Sector *sectors;
-	size_t num_sectors;
-} Level;
+	Sint32 *node_parent;
+	Sint32 *sector_parent;
+	Uint32 *node_visframe;
+	Uint32 *sector_visframe;
+	Uint8 *row;
+	Uint32 visframe;
+	Sint32 camera_sector;
+	// Off when the level has no PVS or the camera is outside pvs_box
+	SDL_bool active;
+} VisState;
 
 typedef struct
 {
+	// Camera the frame is rendered from, between the last two ticks
 	PlayerCam player_cam;
+	// Player at the latest simulation tick and at the one before it
+	PlayerCam player;
+	PlayerCam prev_player;
 	Level level;
+	VisState vis;
+	ThingSet things;
+	// Cache handle of every Level.textures entry, or of the default texture
+	// for a level that names none. Floors and ceilings use the first one.
+	TextureHandle *level_textures;
 } GameState;
 
+// Simulation runs at a fixed rate, independent of how fast frames render
+#define TICK_RATE 60
+// Ticks run before a frame at most. After a longer stall the simulation
+// drops the missing time instead of trying to catch up with it.
+#define MAX_TICKS_PER_FRAME 8
+// Distance the player is kept from walls
+#define PLAYER_RADIUS 16.0f
+
+typedef struct
+{
+	// Performance counter units
+	Uint64 tick_length;
+	Uint64 last_time;
+	Uint64 accumulator;
+	Uint32 tick;
+	// Ticks given up on because of MAX_TICKS_PER_FRAME
+	Uint32 dropped_ticks;
+} SimClock;
+
+typedef struct
+{
+	SDL_Thread *thread;
+	SDL_sem *start;
+	RenderContext ctx;
+} RenderWorker;
+
+// Persistent strip renderers, woken once per frame
+typedef struct
+{
+	int num_workers;
+	RenderWorker *workers;
+	SDL_sem *done;
+	SDL_bool quit;
+
+	GameState *game;
+} RenderPool;
+
+// Scales the internal resolution to keep render time near target_ms. It
+// only steps down after several frames over budget and only steps up after
+// many frames well under it, so it doesn't oscillate around the budget.
+typedef struct
+{
+	SDL_bool enabled;
+	float target_ms;
+	int base_width, base_height;
+	// Percent of the base resolution
+	int scale;
+	int frames_over, frames_under;
+} ResolutionGovernor;
+
+#define GOVERNOR_MIN_SCALE 25
+#define GOVERNOR_STEP_DOWN 10
+#define GOVERNOR_STEP_UP 5
+#define GOVERNOR_FRAMES_OVER 3
+#define GOVERNOR_FRAMES_UNDER 30
+// Frames faster than this fraction of the budget count as under it
+#define GOVERNOR_HEADROOM 0.7f
+
+// Largest generated map in the scaling benchmark, sizes go up by 10x from 10
+#define SCALE_BENCH_MAX_SEGMENTS 1000000
+// Growth exponent over the previous size that counts as a regression, and
+// the build time below which the exponent is too noisy to check
+#define SCALE_SLOPE_LIMIT 1.5
+#define SCALE_MIN_CHECKED_MS 5.0
+
 typedef enum
 {
 	POL_KEY_FORWARD,
@@ -124,241 +439,709 @@ typedef enum
 	POL_KEY_ZOOM,
 	POL_KEY_ASCEND,
 	POL_KEY_DESCEND,
+	POL_KEY_HEATMAP,
 	POL_KEY_COUNT
 } pol_Key;
 
+#define MAX_FRAME_BUFFERS 3
+
+typedef enum
+{
+	FRAME_FREE,
+	FRAME_RENDERING,
+	FRAME_QUEUED,
+	FRAME_PRESENTING
+} FrameState;
+
+typedef struct
+{
+	pol_Color *pixels;
+	// Palette indices, allocated when the palette is on
+	Uint8 *indices;
+	// Set when the frame is in indices and still has to be expanded
+	SDL_bool palettized;
+	FrameState state;
+	int width, height;
+	// Order frames were started in, to find the oldest
+	Uint32 sequence;
+} FrameBuffer;
+
+// Totals since the main thread last took them
+typedef struct
+{
+	int frames_rendered;
+	int frames_dropped;
+	int ticks;
+	double tick_ms;
+	double render_ms;
+	// Running total from the simulation clock
+	Uint32 ticks_dropped;
+	double overdraw;
+	int overdraw_frames;
+} FrameStats;
+
+// Live editing checks the level source and the textures this often
+#define LIVE_EDIT_POLL_MS 250
+
+// --edit: a watcher thread rebuilds the level when its text source changes
+// and the render thread swaps it in between frames. The watcher doesn't
+// look at the level while a rebuild is waiting, so the level it rebuilds
+// from is never swapped out under it. Changed textures are decoded again by
+// the texture cache.
+typedef struct
+{
+	SDL_bool enabled;
+	const char *level_path;
+	FileStamp level_stamp;
+	// Cache entries whose file stamp has been taken
+	int num_watched_textures;
+	SDL_Thread *thread;
+	// Guarded by the pipeline lock
+	Level *pending_level;
+} LiveEdit;
+
+// Software framebuffers passed from the render thread, which runs the
+// simulation and fills them, to the main thread, which uploads and presents
+// them. When every other buffer is queued the render thread waits up to a
+// tick for one to be released and then takes back the oldest one, so a slow
+// present never holds rendering back for long and the queue holds at most
+// num_buffers - 1 frames.
+typedef struct
+{
+	FrameBuffer buffers[MAX_FRAME_BUFFERS];
+	int num_buffers;
+	Uint32 next_sequence;
+	SDL_mutex *lock;
+	SDL_cond *queued;
+	SDL_cond *released;
+	SDL_bool quit;
+	// Written by the main thread, copied by the render thread every frame
+	SDL_bool keys[POL_KEY_COUNT];
+	FrameStats stats;
+
+	// Only touched by the render thread
+	SDL_Thread *thread;
+	GameState *game;
+	SimClock clock;
+	ResolutionGovernor governor;
+
+	LiveEdit edit;
+} FramePipeline;
+
 SDL_bool global_is_running = SDL_TRUE;
 float global_focal_length;
+Viewport global_viewport;
+Heatmap global_heatmap;
+Palette global_palette;
+// Far points on the left and right view edges
+pol_Vec2 global_clip_left, global_clip_right;
+RenderPool global_render_pool;
+TextureCache global_textures;
+
+typedef void (*SetupWallColumnsFunc)(WallColumns *cols, WallSetup *w, int start_col, int end_col);
+SetupWallColumnsFunc global_setup_wall_columns;
+typedef void (*ExpandPaletteFunc)(pol_Color *dest, Uint8 *src, int count, pol_Color *colors);
+ExpandPaletteFunc global_expand_palette;
+const char *global_simd_name;
 
-inline float vec2_dot_product(pol_Vec2 v1, pol_Vec2 v2)
+pol_Vec2 view_to_world(pol_Vec2 v, PlayerCam *player_cam)
 {
-	return v1.x*v2.x + v1.y*v2.y;
+	v = vec2_rotate(v, player_cam->view_angle - 90.0f*DEG2RAD);
+	v = vec2_add(v, player_cam->pos);
+	return v;
 }
 
-inline float vec2_cross_product(pol_Vec2 v1, pol_Vec2 v2)
+pol_Vec2 world_to_view(pol_Vec2 v, PlayerCam *player_cam)
 {
-	return v1.x * v2.y - v1.y*v2.x;
+	v = vec2_subtract(v, player_cam->pos);
+	v = vec2_rotate(v, -player_cam->view_angle + 90.0f*DEG2RAD);
+	return v;
 }
 
-pol_Vec2 vec2_rotate(pol_Vec2 v, float angle)
+// Picks the mip level whose texels are closest to one per screen pixel
+int mip_level_for_rate(Texture *tex, float texels_per_pixel)
 {
-    pol_Vec2 result;
+	int n = texels_per_pixel;
+	int level = 0;
+	while (n > 1 && level < tex->num_levels-1)
+	{
+		n >>= 1;
+		level++;
+	}
 
-    float cosres = SDL_cosf(angle);
-    float sinres = SDL_sinf(angle);
+	return level;
+}
 
-    result.x = v.x*cosres - v.y*sinres;
-    result.y = v.x*sinres + v.y*cosres;
+// Returns what to draw for handle this frame: the texture once it is
+// resident and the placeholder until then. Called by render workers, so it
+// only records that the texture was wanted.
+Texture *use_texture(TextureHandle handle)
+{
+	TextureCache *cache = &global_textures;
+	if (handle < 0)
+		return &cache->placeholder;
 
-    return result;
+	CachedTexture *entry = &cache->items[handle];
+	SDL_AtomicSet(&entry->last_used, cache->frame);
+	return entry->resident ? &entry->tex : &cache->placeholder;
 }
 
-inline float vec2_angle(pol_Vec2 v1, pol_Vec2 v2)
+void set_heatmap_mode(HeatmapMode mode)
 {
-    float result;
-
-    float dot = v1.x*v2.x + v1.y*v2.y;
-    float det = v1.x*v2.y - v1.y*v2.x;
+	Heatmap *heatmap = &global_heatmap;
 
-    result = SDL_atan2f(det, dot);
+	if (mode != HEATMAP_OFF && !heatmap->writes)
+		heatmap->writes = SDL_calloc(MAX_RENDER_WIDTH*MAX_RENDER_HEIGHT, 1);
 
-    return result;
+	heatmap->mode = mode;
 }
 
-inline float vec2_len(pol_Vec2 v1)
+void heatmap_column(Viewport *view, int x, int y1, int y2, Uint64 start)
 {
-	return SDL_sqrtf(v1.x * v1.x + v1.y * v1.y);
+	Heatmap *heatmap = &global_heatmap;
+
+	if (heatmap->mode == HEATMAP_COLUMN_TIME)
+	{
+		heatmap->column_ticks[x] += SDL_GetPerformanceCounter() - start;
+		return;
+	}
+
+	Uint8 *writes = heatmap->writes + x + y1*view->width;
+	for (int y = y1; y <= y2; y++, writes += view->width)
+	{
+		if (*writes < 255)
+			(*writes)++;
+	}
 }
 
-pol_Vec2 line_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4)
+void heatmap_span(Viewport *view, int y, int x1, int x2, Uint64 start)
 {
-	pol_Vec2 v;
+	Heatmap *heatmap = &global_heatmap;
+
+	if (heatmap->mode == HEATMAP_COLUMN_TIME)
+	{
+		// Split evenly over the columns the span covers
+		Uint64 ticks = (SDL_GetPerformanceCounter() - start) / (x2 - x1 + 1);
+		for (int x = x1; x <= x2; x++)
+			heatmap->column_ticks[x] += ticks;
+		return;
+	}
+
+	Uint8 *writes = heatmap->writes + y*view->width;
+	for (int x = x1; x <= x2; x++)
+	{
+		if (writes[x] < 255)
+			writes[x]++;
+	}
+}
 
-	float det = (v1.x - v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x - v4.x);
-	if (SDL_fabsf(det) < EPSILON)
-		return (pol_Vec2){NAN, NAN};
+// Black for untouched pixels, then blue, green, yellow and red as t goes
+// from 0 to 1
+pol_Color heat_color(float t)
+{
+	static const pol_Color ramp[] = {
+		{0, 0, 255, 255}, {0, 255, 0, 255}, {255, 255, 0, 255}, {255, 0, 0, 255}
+	};
 
-	v.x = ((v1.x*v2.y - v1.y*v2.x)*(v3.x - v4.x) - (v1.x - v2.x)*(v3.x*v4.y - v3.y*v4.x))/det;
-	v.y = ((v1.x*v2.y - v1.y*v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x*v4.y - v3.y*v4.x))/det;
+	t = CLAMP(t, 0.0f, 1.0f);
+	t *= 3.0f;
+	int i = MIN((int)t, 2);
+	float f = t - i;
 
-	return v;
+	return (pol_Color){
+		ramp[i].r + (ramp[i+1].r - ramp[i].r)*f,
+		ramp[i].g + (ramp[i+1].g - ramp[i].g)*f,
+		ramp[i].b + (ramp[i+1].b - ramp[i].b)*f,
+		255
+	};
 }
 
-pol_Vec2 line_segment_intersect(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 v3, pol_Vec2 v4)
+// Replaces the finished frame with the heatmap and clears it for the next one
+void resolve_heatmap(pol_Color *pixels, Viewport *view)
 {
-    pol_Vec2 v = {NAN, NAN};
+	Heatmap *heatmap = &global_heatmap;
+
+	if (heatmap->mode == HEATMAP_OVERDRAW)
+	{
+		Uint64 total_writes = 0;
+		Uint64 covered = 0;
 
-    float det = (v1.x - v2.x)*(v3.y - v4.y) - (v1.y - v2.y)*(v3.x - v4.x);
-    if (SDL_fabsf(det) < EPSILON)
-        return v;
+		for (int y = 0; y < view->height; y++)
+		{
+			Uint8 *writes = heatmap->writes + y*view->width;
+			pol_Color *dest = pixels + y*view->pitch;
 
-    float t_num = (v1.x - v3.x)*(v3.y - v4.y) - (v1.y - v3.y)*(v3.x - v4.x);
-    float u_num = (v1.x - v2.x)*(v1.y - v3.y) - (v1.y - v2.y)*(v1.x - v3.x);
+			for (int x = 0; x < view->width; x++)
+			{
+				total_writes += writes[x];
+				covered += writes[x] > 0;
 
-    float t = t_num / det;
-    float u = -u_num / det;
+				// One write is blue, four or more is red
+				dest[x] = writes[x] ? heat_color((writes[x] - 1) / 3.0f) : (pol_Color){0, 0, 0, 255};
+			}
 
-    if (t < 0.0f || t > 1.0f || u < 0.0f || u > 1.0f)
-        return v;
+			SDL_memset(writes, 0, view->width);
+		}
 
-    v.x = v1.x + t*(v2.x - v1.x);
-    v.y = v1.y + t*(v2.y - v1.y);
+		heatmap->overdraw = covered ? (float)total_writes / covered : 0.0f;
+	}
+	else if (heatmap->mode == HEATMAP_COLUMN_TIME)
+	{
+		// Average columns land in the middle of the ramp, so a single
+		// slow outlier doesn't wash out the rest
+		Uint64 total_ticks = 1;
+		for (int x = 0; x < view->width; x++)
+			total_ticks += heatmap->column_ticks[x];
+		float scale = view->width / (2.0f * total_ticks);
+
+		for (int x = 0; x < view->width; x++)
+		{
+			pol_Color color = heat_color(heatmap->column_ticks[x] * scale);
+			for (int y = 0; y < view->height; y++)
+				pixels[x + y*view->pitch] = color;
 
-    return v;
+			heatmap->column_ticks[x] = 0;
+		}
+	}
 }
 
-inline pol_Vec2 vec2_subtract(pol_Vec2 v1, pol_Vec2 v2)
+void draw_column(pol_Color *pixels, int pitch, DrawColumn *column, Texture *tex)
 {
-	pol_Vec2 result;
-	result.x = v1.x - v2.x;
-	result.y = v1.y - v2.y;
+	int y1 = column->y1;
+	int y2 = column->y2;
+	int x = column->x;
 
-	return result;
+	MipLevel *mip = &tex->levels[mip_level_for_rate(tex, column->v_step * tex->h)];
+
+	float v = column->v_base + y1*column->v_step;
+
+	// Due to fp errors, v can be slightly below 0.
+	if (v < 0)
+		v = 0;
+
+	// 16.16 fixed point texel row
+	Uint32 tex_v = v * mip->h * 65536.0f;
+	Uint32 tex_step = column->v_step * mip->h * 65536.0f;
+
+	int tex_x = (column->tex_x * mip->w / tex->w) & mip->w_mask;
+	pol_Color *texels = mip->pixels + (tex_x << mip->h_bits);
+	pol_Color *dest = pixels + x + y1*pitch;
+
+	for (int y = y1; y <= y2; y++)
+	{
+		*dest = texels[(tex_v >> 16) & mip->h_mask];
+		dest += pitch;
+		tex_v += tex_step;
+	}
 }
 
-inline pol_Vec2 vec2_add(pol_Vec2 v1, pol_Vec2 v2)
+Uint8 *light_colormap(float distance)
 {
-	pol_Vec2 result;
-	result.x = v1.x + v2.x;
-	result.y = v1.y + v2.y;
+	int level = distance * (NUM_LIGHT_LEVELS / LIGHT_FADE_DISTANCE);
+	level = CLAMP(level, 0, NUM_LIGHT_LEVELS-1);
 
-	return result;
+	return global_palette.colormaps[level];
 }
 
-inline int point_on_side(pol_Vec2 v1, pol_Vec2 v2, pol_Vec2 p)
+// draw_column for the palettized pipeline
+void draw_column_8(Uint8 *indices, int pitch, DrawColumn *column, Texture *tex, Uint8 *colormap)
 {
-	float cross = vec2_cross_product(vec2_subtract(v2, v1), vec2_subtract(p, v1));
+	int y1 = column->y1;
+	int y2 = column->y2;
+	int x = column->x;
+
+	MipLevel *mip = &tex->levels[mip_level_for_rate(tex, column->v_step * tex->h)];
+
+	float v = column->v_base + y1*column->v_step;
+	if (v < 0)
+		v = 0;
 
-	// On the line
-	if (SDL_fabsf(cross) < EPSILON)
-		return 0;
+	Uint32 tex_v = v * mip->h * 65536.0f;
+	Uint32 tex_step = column->v_step * mip->h * 65536.0f;
 
-	if (cross > 0)
-		return -1;
+	int tex_x = (column->tex_x * mip->w / tex->w) & mip->w_mask;
+	Uint8 *texels = mip->indices + (tex_x << mip->h_bits);
+	Uint8 *dest = indices + x + y1*pitch;
 
-	return 1;
+	for (int y = y1; y <= y2; y++)
+	{
+		*dest = colormap[texels[(tex_v >> 16) & mip->h_mask]];
+		dest += pitch;
+		tex_v += tex_step;
+	}
 }
 
-pol_Vec2 view_to_world(pol_Vec2 v, PlayerCam *player_cam)
+// Computes texture column, clipped rows and v stepping for the columns
+// [start_col, end_col] of a wall. Every variant below must do exactly the
+// same float operations in the same order so they produce identical frames.
+void setup_wall_columns_scalar(WallColumns *cols, WallSetup *w, int start_col, int end_col)
 {
-	v = vec2_rotate(v, player_cam->view_angle - 90.0f*DEG2RAD);
-	v = vec2_add(v, player_cam->pos);
-	return v;
+	for (int x = start_col; x <= end_col; x++)
+	{
+		float rel = (float)(x - w->first_col);
+		float sy1 = w->screen_y1 + rel*w->slope1;
+		float sy2 = w->screen_y2 + rel*w->slope2;
+
+		float t = ((float)x + 0.5f - w->screen_x1) * w->inv_width;
+		float u = ((1.0f - t)*w->u1 + t*w->u2) / ((1.0f - t)*w->w1 + t*w->w2);
+		float v_step = (w->v_end - w->v_start) / (sy2 - sy1);
+
+		cols->tex_x[x] = (u - SDL_floorf(u)) * w->tex_w;
+		cols->y1[x] = sy1 + 0.5f;
+		cols->y2[x] = sy2 - 0.5f;
+		cols->v_step[x] = v_step;
+		cols->v_base[x] = w->v_start + v_step*(0.5f - sy1);
+	}
 }
 
-pol_Vec2 world_to_view(pol_Vec2 v, PlayerCam *player_cam)
+#ifdef POL_X86
+__attribute__((target("sse4.1")))
+void setup_wall_columns_sse41(WallColumns *cols, WallSetup *w, int start_col, int end_col)
 {
-	v = vec2_subtract(v, player_cam->pos);
-	v = vec2_rotate(v, -player_cam->view_angle + 90.0f*DEG2RAD);
-	return v;
+	__m128 lane = _mm_setr_ps(0, 1, 2, 3);
+	__m128 half = _mm_set1_ps(0.5f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 screen_y1 = _mm_set1_ps(w->screen_y1);
+	__m128 screen_y2 = _mm_set1_ps(w->screen_y2);
+	__m128 slope1 = _mm_set1_ps(w->slope1);
+	__m128 slope2 = _mm_set1_ps(w->slope2);
+	__m128 screen_x1 = _mm_set1_ps(w->screen_x1);
+	__m128 inv_width = _mm_set1_ps(w->inv_width);
+	__m128 u1 = _mm_set1_ps(w->u1);
+	__m128 u2 = _mm_set1_ps(w->u2);
+	__m128 w1 = _mm_set1_ps(w->w1);
+	__m128 w2 = _mm_set1_ps(w->w2);
+	__m128 v_start = _mm_set1_ps(w->v_start);
+	__m128 v_range = _mm_set1_ps(w->v_end - w->v_start);
+	__m128 tex_w = _mm_set1_ps(w->tex_w);
+
+	int x = start_col;
+	for (; x + 3 <= end_col; x += 4)
+	{
+		__m128 rel = _mm_add_ps(_mm_set1_ps((float)(x - w->first_col)), lane);
+		__m128 sy1 = _mm_add_ps(screen_y1, _mm_mul_ps(rel, slope1));
+		__m128 sy2 = _mm_add_ps(screen_y2, _mm_mul_ps(rel, slope2));
+
+		__m128 xf = _mm_add_ps(_mm_set1_ps((float)x), lane);
+		__m128 t = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(xf, half), screen_x1), inv_width);
+		__m128 s = _mm_sub_ps(one, t);
+		__m128 u = _mm_div_ps(_mm_add_ps(_mm_mul_ps(s, u1), _mm_mul_ps(t, u2)),
+				      _mm_add_ps(_mm_mul_ps(s, w1), _mm_mul_ps(t, w2)));
+		__m128 v_step = _mm_div_ps(v_range, _mm_sub_ps(sy2, sy1));
+
+		__m128 frac = _mm_sub_ps(u, _mm_floor_ps(u));
+		_mm_storeu_si128((__m128i*)(cols->tex_x + x), _mm_cvttps_epi32(_mm_mul_ps(frac, tex_w)));
+		_mm_storeu_si128((__m128i*)(cols->y1 + x), _mm_cvttps_epi32(_mm_add_ps(sy1, half)));
+		_mm_storeu_si128((__m128i*)(cols->y2 + x), _mm_cvttps_epi32(_mm_sub_ps(sy2, half)));
+		_mm_storeu_ps(cols->v_step + x, v_step);
+		_mm_storeu_ps(cols->v_base + x, _mm_add_ps(v_start, _mm_mul_ps(v_step, _mm_sub_ps(half, sy1))));
+	}
+
+	setup_wall_columns_scalar(cols, w, x, end_col);
 }
 
-void draw_column(pol_Color *pixels, DrawColumn *column, SDL_Surface *tex)
+__attribute__((target("avx2")))
+void setup_wall_columns_avx2(WallColumns *cols, WallSetup *w, int start_col, int end_col)
 {
-	int y1 = column->y1;
-	int y2 = column->y2;
-	float sy1 = column->sy1;
-	float sy2 = column->sy2;
-	float v_start = column->v_start;
-	float v_end = column->v_end;
-	int x = column->x;
-	int tex_x = column->tex_x;
+	__m256 lane = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256 half = _mm256_set1_ps(0.5f);
+	__m256 one = _mm256_set1_ps(1.0f);
+	__m256 screen_y1 = _mm256_set1_ps(w->screen_y1);
+	__m256 screen_y2 = _mm256_set1_ps(w->screen_y2);
+	__m256 slope1 = _mm256_set1_ps(w->slope1);
+	__m256 slope2 = _mm256_set1_ps(w->slope2);
+	__m256 screen_x1 = _mm256_set1_ps(w->screen_x1);
+	__m256 inv_width = _mm256_set1_ps(w->inv_width);
+	__m256 u1 = _mm256_set1_ps(w->u1);
+	__m256 u2 = _mm256_set1_ps(w->u2);
+	__m256 w1 = _mm256_set1_ps(w->w1);
+	__m256 w2 = _mm256_set1_ps(w->w2);
+	__m256 v_start = _mm256_set1_ps(w->v_start);
+	__m256 v_range = _mm256_set1_ps(w->v_end - w->v_start);
+	__m256 tex_w = _mm256_set1_ps(w->tex_w);
+
+	int x = start_col;
+	for (; x + 7 <= end_col; x += 8)
+	{
+		__m256 rel = _mm256_add_ps(_mm256_set1_ps((float)(x - w->first_col)), lane);
+		__m256 sy1 = _mm256_add_ps(screen_y1, _mm256_mul_ps(rel, slope1));
+		__m256 sy2 = _mm256_add_ps(screen_y2, _mm256_mul_ps(rel, slope2));
+
+		__m256 xf = _mm256_add_ps(_mm256_set1_ps((float)x), lane);
+		__m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_add_ps(xf, half), screen_x1), inv_width);
+		__m256 s = _mm256_sub_ps(one, t);
+		__m256 u = _mm256_div_ps(_mm256_add_ps(_mm256_mul_ps(s, u1), _mm256_mul_ps(t, u2)),
+					 _mm256_add_ps(_mm256_mul_ps(s, w1), _mm256_mul_ps(t, w2)));
+		__m256 v_step = _mm256_div_ps(v_range, _mm256_sub_ps(sy2, sy1));
+
+		__m256 frac = _mm256_sub_ps(u, _mm256_floor_ps(u));
+		_mm256_storeu_si256((__m256i*)(cols->tex_x + x), _mm256_cvttps_epi32(_mm256_mul_ps(frac, tex_w)));
+		_mm256_storeu_si256((__m256i*)(cols->y1 + x), _mm256_cvttps_epi32(_mm256_add_ps(sy1, half)));
+		_mm256_storeu_si256((__m256i*)(cols->y2 + x), _mm256_cvttps_epi32(_mm256_sub_ps(sy2, half)));
+		_mm256_storeu_ps(cols->v_step + x, v_step);
+		_mm256_storeu_ps(cols->v_base + x, _mm256_add_ps(v_start, _mm256_mul_ps(v_step, _mm256_sub_ps(half, sy1))));
+	}
 
-	float deltay = v_end - v_start;
-	float deltax = sy2 - sy1;
-	float slope = deltay/deltax;
+	setup_wall_columns_scalar(cols, w, x, end_col);
+}
+#endif
 
-	float v = slope*(y1 + 0.5f - sy1) + v_start;
+// Turns count palette indices into colours
+void expand_palette_scalar(pol_Color *dest, Uint8 *src, int count, pol_Color *colors)
+{
+	for (int i = 0; i < count; i++)
+		dest[i] = colors[src[i]];
+}
 
-	for (int y = y1; y <= y2; y++)
+#ifdef POL_X86
+// Eight pixels per step with a gather from the palette
+__attribute__((target("avx2")))
+void expand_palette_avx2(pol_Color *dest, Uint8 *src, int count, pol_Color *colors)
+{
+	int i = 0;
+	for (; i + 7 < count; i += 8)
 	{
-		// Due to fp errors, v can be slightly below 0.
-		if (v < 0)
-			v = 0;
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i*)(src + i)));
+		__m256i color = _mm256_i32gather_epi32((const int*)colors, index, 4);
+		_mm256_storeu_si256((__m256i*)(dest + i), color);
+	}
 
-		int tex_y = (v - SDL_floorf(v)) * tex->h;
+	expand_palette_scalar(dest + i, src + i, count - i, colors);
+}
+#endif
 
-		pol_Color *tex_pixels = tex->pixels;
+void init_simd(SDL_bool force_scalar)
+{
+	global_setup_wall_columns = setup_wall_columns_scalar;
+	global_expand_palette = expand_palette_scalar;
+	global_simd_name = "scalar";
 
-		pol_Color c = tex_pixels[tex_x + tex_y * tex->w];
-		pixels[x + y*SCREEN_WIDTH] = c;
+	if (force_scalar)
+		return;
 
-		v += slope;
+#ifdef POL_X86
+	if (SDL_HasAVX2())
+	{
+		global_setup_wall_columns = setup_wall_columns_avx2;
+		global_expand_palette = expand_palette_avx2;
+		global_simd_name = "avx2";
 	}
+	else if (SDL_HasSSE41())
+	{
+		global_setup_wall_columns = setup_wall_columns_sse41;
+		global_simd_name = "sse4.1";
+	}
+#endif
 }
 
-void draw_plane_column(pol_Color *pixels, SDL_Surface *tex, DrawPlaneColumn *column)
+void draw_span(RenderContext *ctx, Visplane *plane, PlayerCam *player_cam, int y, int x1, int x2)
 {
-	int start_row = column->start_row;
-	int end_row = column->end_row;
-	float view_plane_height = column->view_plane_height;
-	float normalized_x = column->normalized_x;
-	PlayerCam *player_cam = column->player_cam;
-	int x = column->x;
+	Texture *tex = plane->tex;
+	Viewport *view = ctx->view;
+
+	Uint64 heatmap_start = global_heatmap.mode == HEATMAP_COLUMN_TIME ? SDL_GetPerformanceCounter() : 0;
+
+	float distance = plane->view_height * view->row_distance[y];
+	float normalized_x = (0.5f - view->half_width) / view->half_width;
+
+	// View space point under column 0 and the step between neighbouring
+	// columns. Positions are computed from column 0 rather than accumulated
+	// from x1 so a span gives the same texels however it is cut into strips.
+	float view_x = normalized_x / global_focal_length * distance;
+	float view_y = distance;
+	float view_step = distance / (global_focal_length * view->half_width);
+
+	// Into tile space, one tile per 32 world units
+	float scale = 1.0f / 32.0f;
+	float tilex = (view_x*ctx->view_cos + view_y*ctx->view_sin + player_cam->pos.x) * scale;
+	float tiley = (-view_x*ctx->view_sin + view_y*ctx->view_cos + player_cam->pos.y) * scale;
+	float stepx = view_step*ctx->view_cos * scale;
+	float stepy = -view_step*ctx->view_sin * scale;
+
+	// The row distance fixes how many texels one screen pixel spans
+	int level = mip_level_for_rate(tex, view_step * scale * tex->w);
+	MipLevel *base = &tex->levels[0];
+	MipLevel *mip = &tex->levels[level];
+	pol_Color *tex_pixels = mip->pixels;
+
+	// 16.16 fixed point texels of the full size level, so the grid lines
+	// stay one base texel wide at every mip level. Only the low bits matter
+	// after masking, so the wrap around of unsigned overflow is harmless.
+	Uint32 u0 = (tilex - SDL_floorf(tilex)) * base->w * 65536.0f;
+	Uint32 v0 = (tiley - SDL_floorf(tiley)) * base->h * 65536.0f;
+	Uint32 du = (Sint32)(stepx * base->w * 65536.0f);
+	Uint32 dv = (Sint32)(stepy * base->h * 65536.0f);
+
+	ctx->counters[PROFILE_PIXELS] += x2 - x1 + 1;
+
+	if (ctx->indices)
+	{
+		Uint8 *dest = ctx->indices + y*view->pitch;
+		Uint8 *tex_indices = mip->indices;
+		Uint8 *colormap = light_colormap(SDL_fabsf(distance));
 
-	for (int y = start_row; y <= end_row; y++)
+		for (int x = x1; x <= x2; x++)
+		{
+			int base_x = ((u0 + x*du) >> 16) & base->w_mask;
+			int base_y = ((v0 + x*dv) >> 16) & base->h_mask;
+			int tex_x = base_x >> level;
+			int tex_y = base_y >> level;
+
+			if (base_x == base->w_mask || base_x == 0 || base_y == base->h_mask || base_y == 0)
+				dest[x] = 0;
+			else
+				dest[x] = colormap[tex_indices[(tex_x << mip->h_bits) + tex_y]];
+		}
+	}
+	else
 	{
-		float normalized_y = (SH2 - y + 0.5f) / (SH2 * YSCALE);
+		pol_Color *dest = ctx->pixels + y*view->pitch;
+
+		for (int x = x1; x <= x2; x++)
+		{
+			int base_x = ((u0 + x*du) >> 16) & base->w_mask;
+			int base_y = ((v0 + x*dv) >> 16) & base->h_mask;
+			int tex_x = base_x >> level;
+			int tex_y = base_y >> level;
 
-		pol_Vec2 floor;
-		floor.y = view_plane_height * global_focal_length / normalized_y;
-		floor.x = normalized_x / global_focal_length * floor.y;
+			if (base_x == base->w_mask || base_x == 0 || base_y == base->h_mask || base_y == 0)
+				dest[x] = (pol_Color){0};
+			else
+				dest[x] = tex_pixels[(tex_x << mip->h_bits) + tex_y];
+		}
+	}
 
-		floor = view_to_world(floor, player_cam);
+	if (global_heatmap.mode != HEATMAP_OFF)
+		heatmap_span(view, y, x1, x2, heatmap_start);
+}
 
-		float tiley = floor.y / 32.0f;
-		float tilex = floor.x / 32.0f;
+// Turns the per-column top/bottom rows of a plane into horizontal spans.
+// See: R_MakeSpans in the Doom source.
+void draw_plane(RenderContext *ctx, Visplane *plane, PlayerCam *player_cam)
+{
+	int span_start[MAX_RENDER_HEIGHT];
 
-		int tex_y = (tiley - SDL_floorf(tiley)) * tex->h;
-		int tex_x = (tilex - SDL_floorf(tilex)) * tex->w;
-		tex_y = CLAMP(tex_y, 0, tex->h-1);
-		tex_x = CLAMP(tex_x, 0, tex->w-1);
+	// MAX_RENDER_HEIGHT as top marks a column without rows
+	int t1 = MAX_RENDER_HEIGHT;
+	int b1 = -1;
 
-		if (tex_x == tex->w-1 || tex_x == 0 || tex_y == tex->h-1 || tex_y == 0)
+	for (int x = plane->min_x; x <= plane->max_x+1; x++)
+	{
+		int t2 = MAX_RENDER_HEIGHT;
+		int b2 = -1;
+		if (x <= plane->max_x)
 		{
-			pixels[x + y*SCREEN_WIDTH] = (pol_Color){0};
-			continue;
+			t2 = plane->top[x];
+			b2 = plane->bottom[x];
 		}
 
-		pol_Color *tex_pixels = tex->pixels;
-		pixels[x + y*SCREEN_WIDTH] = tex_pixels[tex_x + tex_y*tex->w];
+		// Close rows that ended in the previous column
+		for (; t1 < t2 && t1 <= b1; t1++)
+			draw_span(ctx, plane, player_cam, t1, span_start[t1], x-1);
+		for (; b1 > b2 && b1 >= t1; b1--)
+			draw_span(ctx, plane, player_cam, b1, span_start[b1], x-1);
+
+		// Open rows that start in this column
+		for (; t2 < t1 && t2 <= b2; t2++)
+			span_start[t2] = x;
+		for (; b2 > b1 && b2 >= t2; b2--)
+			span_start[b2] = x;
+
+		t1 = x <= plane->max_x ? plane->top[x] : MAX_RENDER_HEIGHT;
+		b1 = x <= plane->max_x ? plane->bottom[x] : -1;
+	}
+}
+
+void draw_planes(RenderContext *ctx, PlayerCam *player_cam)
+{
+	Uint64 start = profile_begin();
+
+	for (int i = 0; i < ctx->num_planes; i++)
+		draw_plane(ctx, &ctx->planes[i], player_cam);
+
+	ctx->num_planes = 0;
+
+	profile_end(ctx->profile_lane, ctx->frame, PROFILE_PLANE_FILL, start);
+}
+
+Visplane *find_plane(RenderContext *ctx, float view_height, Texture *tex)
+{
+	for (int i = 0; i < ctx->num_planes; i++)
+	{
+		Visplane *plane = &ctx->planes[i];
+		if (plane->view_height == view_height && plane->tex == tex)
+			return plane;
+	}
+
+	Visplane *plane = &ctx->planes[ctx->num_planes++];
+	plane->view_height = view_height;
+	plane->tex = tex;
+	plane->min_x = ctx->view->width;
+	plane->max_x = -1;
+
+	return plane;
+}
+
+void mark_plane(Visplane *plane, int x, int top, int bottom)
+{
+	if (plane->max_x < plane->min_x)
+	{
+		plane->min_x = x;
+		plane->max_x = x;
+	}
+	else if (x < plane->min_x)
+	{
+		for (int i = x+1; i < plane->min_x; i++)
+			plane->top[i] = MAX_RENDER_HEIGHT, plane->bottom[i] = -1;
+		plane->min_x = x;
+	}
+	else if (x > plane->max_x)
+	{
+		for (int i = plane->max_x+1; i < x; i++)
+			plane->top[i] = MAX_RENDER_HEIGHT, plane->bottom[i] = -1;
+		plane->max_x = x;
 	}
+
+	plane->top[x] = top;
+	plane->bottom[x] = bottom;
 }
 
-void render_line_segment(pol_Color *pixels, GameState *game, DrawSegment *draw_seg)
+// Returns SDL_FALSE when the segment is culled before reaching the screen
+SDL_bool render_line_segment(RenderContext *ctx, GameState *game, DrawSegment *draw_seg)
 {
 	LineSegment *line_seg = draw_seg->line_seg;
-	pol_Vec2 v1 = game->level.vertices[line_seg->v1];
-	pol_Vec2 v2 = game->level.vertices[line_seg->v2];
+	SegmentInfo *info = draw_seg->info;
 	float floor_height = draw_seg->floor_height;
 	float ceiling_height = draw_seg->ceiling_height;
-	SDL_Surface *tex = draw_seg->tex;
+	Texture *tex = use_texture(draw_seg->texture);
 
-	v1 = world_to_view(v1, &game->player_cam);
-	v2 = world_to_view(v2, &game->player_cam);
-	float view_floor_height = floor_height - game->player_cam.height;
-	float view_ceiling_height = ceiling_height - game->player_cam.height;
+	// Every pixel recorded so far is final, so a full plane list can be
+	// drawn early to make room for this wall's floor and ceiling.
+	if (ctx->num_planes > MAX_VISPLANES-2)
+		draw_planes(ctx, &game->player_cam);
 
-	if (v1.y <= 0 && v2.y <= 0)
-		return;
+	Uint64 setup_start = profile_begin();
 
 	// Backface culling
 	// See: https://gamemath.com/book/graphics.html#backface_culling
-	if (point_on_side(v1, v2, (pol_Vec2){0}) != 1)
-		return;
+	pol_Vec2 to_cam = vec2_subtract(game->player_cam.pos, game->level.vertices[line_seg->v1]);
+	if (vec2_dot_product(info->normal, to_cam) <= EPSILON)
+		return SDL_FALSE;
 
-	// Vectors for view edges
-	pol_Vec2 clipping_v1 = vec2_rotate((pol_Vec2){0, 10000.0f},  FOV/2);
-	pol_Vec2 clipping_v2 = vec2_rotate((pol_Vec2){0, 10000.0f}, -FOV/2);
+	pol_Vec2 v1 = {ctx->view_x[line_seg->v1], ctx->view_y[line_seg->v1]};
+	pol_Vec2 v2 = {ctx->view_x[line_seg->v2], ctx->view_y[line_seg->v2]};
+	float view_floor_height = floor_height - game->player_cam.height;
+	float view_ceiling_height = ceiling_height - game->player_cam.height;
 
-	// Clipped vectors
-	pol_Vec2 clipped_v1 = line_segment_intersect((pol_Vec2){0}, clipping_v1, v1, v2);
-	pol_Vec2 clipped_v2 = line_segment_intersect((pol_Vec2){0}, clipping_v2, v1, v2);
+	if (v1.y <= 0 && v2.y <= 0)
+		return SDL_FALSE;
 
-	float len = vec2_len((pol_Vec2){v2.x - v1.x, v2.y - v1.y});
+	// Clipped vectors
+	pol_Vec2 clipped_v1 = line_segment_intersect((pol_Vec2){0}, global_clip_left, v1, v2);
+	pol_Vec2 clipped_v2 = line_segment_intersect((pol_Vec2){0}, global_clip_right, v1, v2);
 
-	float u_start = 0.0f;
-	float u_end = len / tex->w;
+	float u_start = info->offset / tex->w;
+	float u_end = (info->offset + info->length) / tex->w;
 	float v_start = 0.0f;
 	float v_end = (view_ceiling_height - view_floor_height) / tex->h;
 
@@ -366,7 +1149,7 @@ void render_line_segment(pol_Color *pixels, GameState *game, DrawSegment *draw_s
 	if (!isnanf(clipped_v1.x))
 	{
 		float cliplen = vec2_len(vec2_subtract(clipped_v1, v1));
-		u_start = cliplen / tex->w;
+		u_start += cliplen / tex->w;
 		v1 = clipped_v1;
 	}
 	if (!isnanf(clipped_v2.x))
@@ -387,7 +1170,7 @@ void render_line_segment(pol_Color *pixels, GameState *game, DrawSegment *draw_s
 	float angle1 = vec2_angle(UP, v1);
 	float angle2 = vec2_angle(UP,v2);
 	if (angle1 < -FOV/2 || angle2 > FOV/2)
-		return;
+		return SDL_FALSE;
 
 	// Distance from the optical point to the projection plane
 
@@ -401,91 +1184,126 @@ void render_line_segment(pol_Color *pixels, GameState *game, DrawSegment *draw_s
 	float normalized_y2b = view_floor_height * global_focal_length / v2.y;
 
 	// Screen coordinates
-	float screen_x1 = SW2 + normalized_x1 * SW2;
-	float screen_x2 = SW2 + normalized_x2 * SW2;
-	float screen_y1a = SH2 - normalized_y1a * SH2 * YSCALE;
-	float screen_y1b = SH2 - normalized_y1b * SH2 * YSCALE;
-	float screen_y2a = SH2 - normalized_y2a * SH2 * YSCALE;
-	float screen_y2b = SH2 - normalized_y2b * SH2 * YSCALE;
+	Viewport *view = ctx->view;
+	float screen_x1 = view->half_width + normalized_x1 * view->half_width;
+	float screen_x2 = view->half_width + normalized_x2 * view->half_width;
+	float screen_y1a = view->half_height - normalized_y1a * view->half_height * view->y_scale;
+	float screen_y1b = view->half_height - normalized_y1b * view->half_height * view->y_scale;
+	float screen_y2a = view->half_height - normalized_y2a * view->half_height * view->y_scale;
+	float screen_y2b = view->half_height - normalized_y2b * view->half_height * view->y_scale;
 
 	float deltax = screen_x2 - screen_x1;
 	if (SDL_fabsf(deltax) < EPSILON)
-		return;
+		return SDL_FALSE;
 	float slope1 = (screen_y2a - screen_y1a) / deltax;
 	float slope2 = (screen_y2b - screen_y1b) / deltax;
 
 	int start_col = screen_x1 + 0.5f;
 	int end_col = screen_x2 - 0.5f;
 	int width = end_col - start_col + 1;
+	int first_col = start_col;
+
+	// Clip to the columns this context owns
+	if (start_col < ctx->x_start)
+		start_col = ctx->x_start;
+	if (end_col > ctx->x_end)
+		end_col = ctx->x_end;
+	if (start_col > end_col)
+		return SDL_FALSE;
+
+	Texture *flat = use_texture(game->level_textures[0]);
+	Visplane *ceiling_plane = NULL;
+	Visplane *floor_plane = NULL;
+	if (view_ceiling_height > 0)
+		ceiling_plane = find_plane(ctx, view_ceiling_height, flat);
+	if (view_floor_height < 0)
+		floor_plane = find_plane(ctx, view_floor_height, flat);
+
+	WallSetup setup = {
+		.first_col = first_col,
+		.screen_x1 = screen_x1,
+		.inv_width = 1.0f / width,
+		.screen_y1 = screen_y1a,
+		.screen_y2 = screen_y1b,
+		.slope1 = slope1,
+		.slope2 = slope2,
+		.u1 = u_start / v1.y,
+		.u2 = u_end / v2.y,
+		.w1 = 1.0f / v1.y,
+		.w2 = 1.0f / v2.y,
+		.v_start = v_start,
+		.v_end = v_end,
+		.tex_w = tex->w
+	};
+
+	WallColumns *cols = &ctx->wall_columns;
+	global_setup_wall_columns(cols, &setup, start_col, end_col);
 
-	float interpolated_screen_y1 = screen_y1a;
-	float interpolated_screen_y2 = screen_y1b;
+	profile_end(ctx->profile_lane, ctx->frame, PROFILE_SEGMENT_SETUP, setup_start);
+	Uint64 fill_start = profile_begin();
 
 	for (int x = start_col; x <= end_col; x++)
 	{
-		// Start and end rows
-		int y1 = interpolated_screen_y1 + 0.5f;
-		int y2 = interpolated_screen_y2 - 0.5f;
+		// Rows not yet covered by nearer walls
+		int top = ctx->ceiling_clip[x] + 1;
+		int bottom = ctx->floor_clip[x] - 1;
 
-		if (y1 >= SCREEN_HEIGHT || y2 < 0 || y2 < y1)
-		{
-			interpolated_screen_y1 += slope1;
-			interpolated_screen_y2 += slope2;
+		if (top > bottom)
 			continue;
-		}
-
-		y1 = CLAMP(y1, 0, SCREEN_HEIGHT-1);
-		y2 = CLAMP(y2, 0, SCREEN_HEIGHT-1);
 
-		float tx = (x + 0.5f - screen_x1)/width;
-		float u = ((1.0f - tx)*u_start/v1.y + tx*u_end/v2.y) /
-			  ((1.0f - tx)*1/v1.y + tx*1/v2.y);
-		int tex_x = (u - SDL_floorf(u)) * tex->w;
-
-		DrawColumn column = {
-			.x = x,
-			.tex_x = tex_x,
-			.y1 = y1,
-			.y2 = y2,
-			.sy1 = interpolated_screen_y1,
-			.sy2 = interpolated_screen_y2,
-			.v_start = v_start,
-			.v_end = v_end
-		};
+		// Start and end rows
+		int y1 = cols->y1[x];
+		int y2 = cols->y2[x];
 
-		draw_column(pixels, &column, tex);
+		int ceilingy2 = MIN(y1-1, bottom);
+		if (ceiling_plane && ceilingy2 >= top)
+			mark_plane(ceiling_plane, x, top, ceilingy2);
 
-		float normalized_x = (x + 0.5f - SW2) / SW2;
+		int wally1 = MAX(y1, top);
+		int wally2 = MIN(y2, bottom);
+		if (wally1 <= wally2)
+		{
+			DrawColumn column = {
+				.x = x,
+				.tex_x = cols->tex_x[x],
+				.y1 = wally1,
+				.y2 = wally2,
+				.v_base = cols->v_base[x],
+				.v_step = cols->v_step[x]
+			};
+
+			Uint64 heatmap_start = global_heatmap.mode == HEATMAP_COLUMN_TIME ? SDL_GetPerformanceCounter() : 0;
+
+			if (ctx->indices)
+			{
+				// Depth from how many world units one row covers
+				float distance = column.v_step * tex->h * global_focal_length * view->half_width;
+				draw_column_8(ctx->indices, view->pitch, &column, tex, light_colormap(distance));
+			}
+			else
+				draw_column(ctx->pixels, view->pitch, &column, tex);
 
-		int floory1 = interpolated_screen_y2 + 0.5f;
-		DrawPlaneColumn plane_column = {
-			.x = x,
-			.normalized_x = normalized_x,
-			.start_row = floory1,
-			.end_row = SCREEN_HEIGHT-1,
-			.view_plane_height = view_floor_height,
-			.player_cam = &game->player_cam
-		};
+			if (global_heatmap.mode != HEATMAP_OFF)
+				heatmap_column(view, x, wally1, wally2, heatmap_start);
+			ctx->counters[PROFILE_COLUMNS]++;
+			ctx->counters[PROFILE_PIXELS] += wally2 - wally1 + 1;
+		}
 
-		if (view_floor_height < 0)
-			draw_plane_column(pixels, tex, &plane_column);
+		int floory1 = MAX(y2+1, top);
+		if (floor_plane && floory1 <= bottom)
+			mark_plane(floor_plane, x, floory1, bottom);
 
-		int ceilingy2 = interpolated_screen_y1 - 0.5f;
-		DrawPlaneColumn ceiling_column = {
-			.x = x,
-			.normalized_x = normalized_x,
-			.start_row = 0,
-			.end_row = ceilingy2,
-			.view_plane_height = view_ceiling_height,
-			.player_cam = &game->player_cam
-		};
+		// Walls are solid, so the column is now closed
+		float t = ((float)x + 0.5f - screen_x1) * setup.inv_width;
+		ctx->wall_depth[x] = 1.0f / ((1.0f - t)*setup.w1 + t*setup.w2);
+		ctx->ceiling_clip[x] = view->height;
+		ctx->floor_clip[x] = -1;
+		ctx->open_columns--;
+	}
 
-		if (view_ceiling_height > 0)
-			draw_plane_column(pixels, tex, &ceiling_column);
+	profile_end(ctx->profile_lane, ctx->frame, PROFILE_WALL_FILL, fill_start);
 
-		interpolated_screen_y1 += slope1;
-		interpolated_screen_y2 += slope2;
-	}
+	return SDL_TRUE;
 }
 
 // NOTE(pol): Using an array of pairs of SDL_Scancode and pol_Key might be more
@@ -515,6 +1333,8 @@ pol_Key translate_scancode_to_pol_key(SDL_Scancode scancode)
 		case SDL_SCANCODE_E: return POL_KEY_ASCEND;
 		case SDL_SCANCODE_Q: return POL_KEY_DESCEND;
 
+		case SDL_SCANCODE_H: return POL_KEY_HEATMAP;
+
 		default: return POL_KEY_COUNT;
 	}
 }
@@ -541,273 +1361,2345 @@ void handle_key_event(SDL_Event *event, SDL_bool *keys)
 	}
 }
 
-SDL_bool is_convex(SegmentArray *segments_list, pol_Vec2 *vertices)
+// Queues the things in a leaf that may show in this strip. Runs before the
+// leaf's walls are drawn: a thing is always in front of the walls of its
+// own leaf, so columns closed at this point are closed by nearer walls.
+void project_things(RenderContext *ctx, GameState *game, int sector_index)
 {
-	LineSegment *segments = segments_list->items;
-	size_t num_segments = segments_list->len;
+	ThingSet *things = &game->things;
+	PlayerCam *player_cam = &game->player_cam;
+	Viewport *view = ctx->view;
 
-	for (int i = 0; i < num_segments; i++)
+	for (Sint32 i = things->sector_first[sector_index]; i >= 0; i = things->items[i].next)
 	{
-		pol_Vec2 v1 = vertices[segments[i].v1];
-		pol_Vec2 v2 = vertices[segments[i].v2];
-
-		for (int j = 0; j < num_segments; j++)
-		{
-			if (i == j)
-				continue;
-
-			pol_Vec2 v3 = vertices[segments[j].v1];
-			pol_Vec2 v4 = vertices[segments[j].v2];
+		Thing *thing = &things->items[i];
 
-			int a = point_on_side(v1, v2, v3);
-			int b = point_on_side(v1, v2, v4);
+		pol_Vec2 d = vec2_subtract(thing->pos, player_cam->pos);
+		float view_x = d.x*ctx->view_cos - d.y*ctx->view_sin;
+		float depth = d.x*ctx->view_sin + d.y*ctx->view_cos;
+		if (depth < SPRITE_NEAR)
+			continue;
 
-			// Intersection found
-			if (a * b == -1)
-				return SDL_FALSE;
+		float scale = global_focal_length * view->half_width / depth;
+		float screen_left = view->half_width + (view_x - thing->radius)*scale;
+		float screen_right = view->half_width + (view_x + thing->radius)*scale;
+
+		// Columns whose centers it covers
+		int x1 = SDL_ceilf(screen_left - 0.5f);
+		int x2 = (int)SDL_ceilf(screen_right - 0.5f) - 1;
+		if (x1 < ctx->x_start)
+			x1 = ctx->x_start;
+		if (x2 > ctx->x_end)
+			x2 = ctx->x_end;
+
+		// Coarse occlusion: trim columns already closed at either end, which
+		// rejects the sprite when nearer walls cover all of it
+		while (x1 <= x2 && ctx->ceiling_clip[x1] + 1 > ctx->floor_clip[x1] - 1)
+			x1++;
+		while (x2 >= x1 && ctx->ceiling_clip[x2] + 1 > ctx->floor_clip[x2] - 1)
+			x2--;
+		if (x1 > x2)
+			continue;
 
-			if (a == -1 || b == -1)
-				return SDL_FALSE;
-		}
+		ctx->sprites = grow_array(ctx->sprites, &ctx->sprites_capacity, ctx->num_sprites+1, sizeof(VisSprite));
+		ctx->sprites[ctx->num_sprites++] = (VisSprite){
+			.thing = thing,
+			.x1 = x1,
+			.x2 = x2,
+			.screen_left = screen_left,
+			.screen_top = view->half_height - (thing->height - player_cam->height)*scale,
+			.scale = scale,
+			.depth = depth
+		};
+		ctx->counters[PROFILE_SPRITES]++;
 	}
-
-	return SDL_TRUE;
 }
 
-void split_segments(SegmentArray *segments_list, SegmentArray *outleft, SegmentArray *outright, Level *level)
+// draw_column with transparency: texels under half alpha are skipped.
+// Writes palette indices through colormap when the context has them.
+void draw_sprite_column(RenderContext *ctx, DrawColumn *column, Texture *tex, Uint8 *colormap)
 {
-	LineSegment *segments = segments_list->items;
-	size_t num_segs = segments_list->len;
+	int pitch = ctx->view->pitch;
+	MipLevel *mip = &tex->levels[mip_level_for_rate(tex, column->v_step * tex->h)];
 
-	pol_Vec2 split_v1 = level->vertices[segments->v1];
-	pol_Vec2 split_v2 = level->vertices[segments->v2];
+	float v = column->v_base + column->y1*column->v_step;
+	if (v < 0)
+		v = 0;
 
-	LineSegment *left = NULL;
-	LineSegment *right = NULL;
-	int num_left = 0;
-	int num_right = 0;
-	
-	// Copy segments and put them in either the left or right list
-	for (int i = 1; i < num_segs; i++)
+	Uint32 tex_v = v * mip->h * 65536.0f;
+	Uint32 tex_step = column->v_step * mip->h * 65536.0f;
+
+	int tex_x = (column->tex_x * mip->w / tex->w) & mip->w_mask;
+	pol_Color *texels = mip->pixels + (tex_x << mip->h_bits);
+
+	if (colormap)
+	{
+		Uint8 *tex_indices = mip->indices + (tex_x << mip->h_bits);
+		Uint8 *dest = ctx->indices + column->x + column->y1*pitch;
+
+		for (int y = column->y1; y <= column->y2; y++)
+		{
+			int row = (tex_v >> 16) & mip->h_mask;
+			if (texels[row].a >= 128)
+				*dest = colormap[tex_indices[row]];
+			dest += pitch;
+			tex_v += tex_step;
+		}
+	}
+	else
+	{
+		pol_Color *dest = ctx->pixels + column->x + column->y1*pitch;
+
+		for (int y = column->y1; y <= column->y2; y++)
+		{
+			pol_Color texel = texels[(tex_v >> 16) & mip->h_mask];
+			if (texel.a >= 128)
+				*dest = texel;
+			dest += pitch;
+			tex_v += tex_step;
+		}
+	}
+}
+
+void draw_sprite(RenderContext *ctx, VisSprite *sprite)
+{
+	Thing *thing = sprite->thing;
+	Texture *tex = use_texture(thing->texture);
+	Viewport *view = ctx->view;
+
+	float screen_bottom = sprite->screen_top + thing->height*sprite->scale;
+	int y1 = SDL_ceilf(sprite->screen_top - 0.5f);
+	int y2 = (int)SDL_ceilf(screen_bottom - 0.5f) - 1;
+	if (y1 < 0)
+		y1 = 0;
+	if (y2 > view->height - 1)
+		y2 = view->height - 1;
+	if (y1 > y2)
+		return;
+
+	// Texture u and v per pixel
+	float u_step = 1.0f / (2.0f*thing->radius*sprite->scale);
+	float v_step = 1.0f / (thing->height*sprite->scale);
+	Uint8 *colormap = ctx->indices ? light_colormap(sprite->depth) : NULL;
+
+	for (int x = sprite->x1; x <= sprite->x2; x++)
+	{
+		// Behind the wall that closed this column
+		if (sprite->depth >= ctx->wall_depth[x])
+			continue;
+
+		float u = ((float)x + 0.5f - sprite->screen_left) * u_step;
+		DrawColumn column = {
+			.x = x,
+			.tex_x = u * tex->w,
+			.y1 = y1,
+			.y2 = y2,
+			.v_base = (0.5f - sprite->screen_top) * v_step,
+			.v_step = v_step
+		};
+
+		Uint64 heatmap_start = global_heatmap.mode == HEATMAP_COLUMN_TIME ? SDL_GetPerformanceCounter() : 0;
+
+		draw_sprite_column(ctx, &column, tex, colormap);
+
+		if (global_heatmap.mode != HEATMAP_OFF)
+			heatmap_column(view, x, y1, y2, heatmap_start);
+		ctx->counters[PROFILE_COLUMNS]++;
+		ctx->counters[PROFILE_PIXELS] += y2 - y1 + 1;
+	}
+}
+
+// Bucket sorts the queued sprites far to near and draws them over the
+// finished walls and planes
+void draw_sprites(RenderContext *ctx)
+{
+	if (ctx->num_sprites == 0)
+		return;
+
+	Uint64 start = profile_begin();
+
+	int *buckets = ctx->sprite_buckets;
+	SDL_memset(buckets, 0, sizeof(ctx->sprite_buckets));
+
+	// Bucket 0 holds the farthest sprites
+	for (size_t i = 0; i < ctx->num_sprites; i++)
+	{
+		int depth = ctx->sprites[i].depth / SPRITE_BUCKET_DEPTH;
+		if (depth > SPRITE_DEPTH_BUCKETS-1)
+			depth = SPRITE_DEPTH_BUCKETS-1;
+		buckets[SPRITE_DEPTH_BUCKETS - depth]++;
+	}
+	for (int i = 1; i <= SPRITE_DEPTH_BUCKETS; i++)
+		buckets[i] += buckets[i-1];
+
+	ctx->sorted_sprites = grow_array(ctx->sorted_sprites, &ctx->sorted_capacity, ctx->num_sprites, sizeof(VisSprite));
+	for (size_t i = 0; i < ctx->num_sprites; i++)
+	{
+		int depth = ctx->sprites[i].depth / SPRITE_BUCKET_DEPTH;
+		if (depth > SPRITE_DEPTH_BUCKETS-1)
+			depth = SPRITE_DEPTH_BUCKETS-1;
+		ctx->sorted_sprites[buckets[SPRITE_DEPTH_BUCKETS-1 - depth]++] = ctx->sprites[i];
+	}
+
+	for (size_t i = 0; i < ctx->num_sprites; i++)
+		draw_sprite(ctx, &ctx->sorted_sprites[i]);
+
+	ctx->num_sprites = 0;
+
+	profile_end(ctx->profile_lane, ctx->frame, PROFILE_SPRITE_FILL, start);
+}
+
+void render_sector(RenderContext *ctx, GameState *game, Sector *s)
+{
+	float floor_height = 0.0f;
+	float ceiling_height = 64.0f;
+
+	ctx->counters[PROFILE_SECTORS_VISITED]++;
+
+	if (game->things.count)
+		project_things(ctx, game, s - game->level.sectors);
+
+	for (int i = s->first_seg; i < s->first_seg + s->num_segments; i++)
+	{
+		DrawSegment draw_seg = {
+			.line_seg = game->level.segs+i,
+			.info = game->level.seg_infos+i,
+			.floor_height = floor_height,
+			.ceiling_height = ceiling_height,
+			.texture = game->level_textures[game->level.seg_infos[i].texture]
+		};
+
+		ctx->counters[PROFILE_SEGS_CONSIDERED]++;
+		if (!render_line_segment(ctx, game, &draw_seg))
+			ctx->counters[PROFILE_SEGS_CULLED]++;
+	}
+}
+
+// Returns SDL_FALSE if the box lies entirely outside the view wedge, behind
+// the camera, or only covers columns that are already closed.
+SDL_bool bbox_visible(RenderContext *ctx, PlayerCam *player_cam, float *box)
+{
+	float tan_half_fov = 1.0f/global_focal_length;
+
+	pol_Vec2 corners[4] = {
+		{box[BOX_LEFT], box[BOX_TOP]},
+		{box[BOX_RIGHT], box[BOX_TOP]},
+		{box[BOX_RIGHT], box[BOX_BOTTOM]},
+		{box[BOX_LEFT], box[BOX_BOTTOM]}
+	};
+
+	int outside_left = 0;
+	int outside_right = 0;
+	int behind = 0;
+	float min_x = INFINITY;
+	float max_x = -INFINITY;
+
+	for (int i = 0; i < 4; i++)
+	{
+		pol_Vec2 d = vec2_subtract(corners[i], player_cam->pos);
+		pol_Vec2 v = {
+			d.x*ctx->view_cos - d.y*ctx->view_sin,
+			d.x*ctx->view_sin + d.y*ctx->view_cos
+		};
+
+		if (v.x < -v.y*tan_half_fov)
+			outside_left++;
+		if (v.x > v.y*tan_half_fov)
+			outside_right++;
+
+		if (v.y <= EPSILON)
+		{
+			behind++;
+			continue;
+		}
+
+		float screen_x = ctx->view->half_width + v.x / v.y * global_focal_length * ctx->view->half_width;
+		min_x = MIN(min_x, screen_x);
+		max_x = MAX(max_x, screen_x);
+	}
+
+	if (outside_left == 4 || outside_right == 4 || behind == 4)
+		return SDL_FALSE;
+
+	// Corners behind the camera make the projected span unbounded
+	if (behind)
+		return SDL_TRUE;
+
+	if (max_x < ctx->x_start || min_x > ctx->x_end + 1)
+		return SDL_FALSE;
+
+	int start_col = CLAMP(min_x, ctx->x_start, ctx->x_end);
+	int end_col = CLAMP(max_x, ctx->x_start, ctx->x_end);
+
+	for (int x = start_col; x <= end_col; x++)
+	{
+		if (ctx->ceiling_clip[x] + 1 <= ctx->floor_clip[x] - 1)
+			return SDL_TRUE;
+	}
+
+	return SDL_FALSE;
+}
+
+// A child is entered when its walls or the things under it may be on screen
+SDL_bool child_visible(RenderContext *ctx, GameState *game, int node, int side)
+{
+	Node *n = &game->level.nodes[node];
+	if (bbox_visible(ctx, &game->player_cam, side ? n->right_box : n->left_box))
+		return SDL_TRUE;
+
+	if (!game->things.count)
+		return SDL_FALSE;
+
+	float *box = game->things.node_boxes[node][side];
+	return box[BOX_LEFT] <= box[BOX_RIGHT] && bbox_visible(ctx, &game->player_cam, box);
+}
+
+// True when node can hold a sector visible from the camera's sector
+SDL_bool in_pvs(VisState *vis, int node)
+{
+	if (!vis->active)
+		return SDL_TRUE;
+
+	if (node & SECTOR_FLAG)
+		return vis->sector_visframe[node & ~SECTOR_FLAG] == vis->visframe;
+
+	return vis->node_visframe[node] == vis->visframe;
+}
+
+// Walks the tree near to far, drawing each leaf as it is reached, and stops
+// as soon as every screen column has been closed by a wall. Children whose
+// bounds can't be seen are skipped without descending.
+void render_bsp(int node, RenderContext *ctx, GameState *game)
+{
+	if (ctx->open_columns == 0 || !in_pvs(&game->vis, node))
+		return;
+
+	if (node & SECTOR_FLAG)
+	{
+		int sector_index = node&(~SECTOR_FLAG);
+		render_sector(ctx, game, &game->level.sectors[sector_index]);
+
+		return;
+	}
+
+	Node *n = &game->level.nodes[node];
+	pol_Vec2 v1 = game->level.vertices[n->splitter.v1];
+	pol_Vec2 v2 = game->level.vertices[n->splitter.v2];
+	int side = point_on_side(v1, v2, game->player_cam.pos);
+
+	if (side == 1)
+	{
+		if (child_visible(ctx, game, node, 1))
+			render_bsp(n->right, ctx, game);
+		if (child_visible(ctx, game, node, 0))
+			render_bsp(n->left, ctx, game);
+	}
+	else
+	{
+		if (child_visible(ctx, game, node, 0))
+			render_bsp(n->left, ctx, game);
+		if (child_visible(ctx, game, node, 1))
+			render_bsp(n->right, ctx, game);
+	}
+}
+
+void set_parents(VisState *vis, Level *level, int node, int parent)
+{
+	if (node & SECTOR_FLAG)
+	{
+		vis->sector_parent[node & ~SECTOR_FLAG] = parent;
+		return;
+	}
+
+	vis->node_parent[node] = parent;
+	set_parents(vis, level, level->nodes[node].left, node);
+	set_parents(vis, level, level->nodes[node].right, node);
+}
+
+void init_vis(VisState *vis, Level *level)
+{
+	*vis = (VisState){.camera_sector = -1};
+
+	if (level->pvs_size == 0)
+		return;
+
+	vis->node_parent = SDL_malloc(sizeof(Sint32)*level->num_nodes);
+	vis->sector_parent = SDL_malloc(sizeof(Sint32)*level->num_sectors);
+	vis->node_visframe = SDL_calloc(level->num_nodes, sizeof(Uint32));
+	vis->sector_visframe = SDL_calloc(level->num_sectors, sizeof(Uint32));
+	vis->row = SDL_malloc((level->num_sectors + 7) >> 3);
+
+	set_parents(vis, level, 0, -1);
+}
+
+void free_vis(VisState *vis)
+{
+	SDL_free(vis->node_parent);
+	SDL_free(vis->sector_parent);
+	SDL_free(vis->node_visframe);
+	SDL_free(vis->sector_visframe);
+	SDL_free(vis->row);
+	*vis = (VisState){0};
+}
+
+// Finds the camera's sector and, when it changed, stamps every visible
+// sector and the nodes above it with a new visframe
+void update_vis(VisState *vis, Level *level, PlayerCam *player_cam)
+{
+	float *box = level->pvs_box;
+	pol_Vec2 pos = player_cam->pos;
+
+	vis->active = level->pvs_size > 0 &&
+		pos.x > box[BOX_LEFT] && pos.x < box[BOX_RIGHT] &&
+		pos.y > box[BOX_BOTTOM] && pos.y < box[BOX_TOP];
+
+	if (!vis->active)
+		return;
+
+	int sector = locate_sector(level, pos);
+	if (sector == vis->camera_sector)
+		return;
+
+	vis->camera_sector = sector;
+	vis->visframe++;
+
+	decompress_pvs_row(level, sector, vis->row);
+
+	// Sectors without area have no row of their own
+	if (!(vis->row[sector >> 3] & (1 << (sector & 7))))
+	{
+		vis->active = SDL_FALSE;
+		vis->camera_sector = -1;
+		return;
+	}
+
+	int row_bytes = (level->num_sectors + 7) >> 3;
+	for (int i = 0; i < row_bytes; i++)
+	{
+		if (!vis->row[i])
+			continue;
+
+		for (int bit = 0; bit < 8; bit++)
+		{
+			if (!(vis->row[i] & (1 << bit)))
+				continue;
+
+			int s = i*8 + bit;
+			vis->sector_visframe[s] = vis->visframe;
+
+			for (int n = vis->sector_parent[s]; n >= 0 && vis->node_visframe[n] != vis->visframe; n = vis->node_parent[n])
+				vis->node_visframe[n] = vis->visframe;
+		}
+	}
+}
+
+void init_things(ThingSet *things, Level *level)
+{
+	*things = (ThingSet){0};
+
+	things->sector_first = SDL_malloc(sizeof(Sint32)*level->num_sectors);
+	for (size_t i = 0; i < level->num_sectors; i++)
+		things->sector_first[i] = -1;
+
+	things->node_boxes = SDL_malloc(sizeof(*things->node_boxes)*level->num_nodes);
+	for (size_t i = 0; i < level->num_nodes; i++)
+	{
+		for (int side = 0; side < 2; side++)
+		{
+			float *box = things->node_boxes[i][side];
+			box[BOX_TOP] = box[BOX_RIGHT] = -INFINITY;
+			box[BOX_BOTTOM] = box[BOX_LEFT] = INFINITY;
+		}
+	}
+}
+
+void free_things(ThingSet *things)
+{
+	SDL_free(things->items);
+	SDL_free(things->sector_first);
+	SDL_free(things->node_boxes);
+	*things = (ThingSet){0};
+}
+
+// Links a new thing into the leaf at pos, growing the thing bounds of every
+// node on the way down
+Sint32 add_thing(ThingSet *things, Level *level, pol_Vec2 pos, float radius, float height, TextureHandle texture)
+{
+	int node = level->num_nodes ? 0 : SECTOR_FLAG;
+	while (!(node & SECTOR_FLAG))
+	{
+		Node *n = &level->nodes[node];
+		pol_Vec2 v1 = level->vertices[n->splitter.v1];
+		pol_Vec2 v2 = level->vertices[n->splitter.v2];
+		int side = point_on_side(v1, v2, pos) == 1;
+
+		float *box = things->node_boxes[node][side];
+		box[BOX_TOP] = SDL_max(box[BOX_TOP], pos.y + radius);
+		box[BOX_BOTTOM] = SDL_min(box[BOX_BOTTOM], pos.y - radius);
+		box[BOX_LEFT] = SDL_min(box[BOX_LEFT], pos.x - radius);
+		box[BOX_RIGHT] = SDL_max(box[BOX_RIGHT], pos.x + radius);
+
+		node = side ? n->right : n->left;
+	}
+
+	int sector = node & ~SECTOR_FLAG;
+	Sint32 index = things->count;
+
+	things->items = grow_array(things->items, &things->capacity, things->count+1, sizeof(Thing));
+	things->items[things->count++] = (Thing){
+		.pos = pos,
+		.radius = radius,
+		.height = height,
+		.texture = texture,
+		.next = things->sector_first[sector]
+	};
+	things->sector_first[sector] = index;
+
+	return index;
+}
+
+// Places count things at random spots at least their radius in front of
+// every wall of their leaf. The spots are the same on every run.
+void scatter_things(ThingSet *things, Level *level, int count, TextureHandle texture)
+{
+	if (count <= 0 || level->num_vertices == 0)
+		return;
+
+	float box[4] = {-INFINITY, INFINITY, INFINITY, -INFINITY};
+	for (size_t i = 0; i < level->num_vertices; i++)
+	{
+		pol_Vec2 v = level->vertices[i];
+		box[BOX_TOP] = SDL_max(box[BOX_TOP], v.y);
+		box[BOX_BOTTOM] = SDL_min(box[BOX_BOTTOM], v.y);
+		box[BOX_LEFT] = SDL_min(box[BOX_LEFT], v.x);
+		box[BOX_RIGHT] = SDL_max(box[BOX_RIGHT], v.x);
+	}
+
+	Uint32 seed = 0x2545f491;
+	int placed = 0;
+	for (int attempt = 0; placed < count && attempt < count*64; attempt++)
+	{
+		// xorshift32
+		float r[2];
+		for (int i = 0; i < 2; i++)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			r[i] = (seed >> 8) / 16777216.0f;
+		}
+
+		pol_Vec2 pos = {
+			box[BOX_LEFT] + r[0]*(box[BOX_RIGHT] - box[BOX_LEFT]),
+			box[BOX_BOTTOM] + r[1]*(box[BOX_TOP] - box[BOX_BOTTOM])
+		};
+
+		// Behind a wall of its leaf is outside the level
+		Sector *sector = &level->sectors[locate_sector(level, pos)];
+		SDL_bool open = SDL_TRUE;
+		for (int i = sector->first_seg; i < sector->first_seg + sector->num_segments; i++)
+		{
+			pol_Vec2 v1 = level->vertices[level->segs[i].v1];
+			if (vec2_dot_product(vec2_subtract(pos, v1), level->seg_infos[i].normal) < THING_RADIUS)
+				open = SDL_FALSE;
+		}
+
+		if (open)
+		{
+			add_thing(things, level, pos, THING_RADIUS, THING_HEIGHT, texture);
+			placed++;
+		}
+	}
+
+	if (placed < count)
+		fprintf(stderr, "Only found room for %d of %d things\n", placed, count);
+}
+
+// Links every thing into the leaves of a rebuilt level
+void relink_things(ThingSet *things, Level *level)
+{
+	ThingSet old = *things;
+	init_things(things, level);
+
+	for (size_t i = 0; i < old.count; i++)
+	{
+		Thing *thing = &old.items[i];
+		add_thing(things, level, thing->pos, thing->radius, thing->height, thing->texture);
+	}
+
+	free_things(&old);
+}
+
+SDL_bool init_game(GameState *game, const char *map_path)
+{
+	game->player_cam.height = 40.0f;
+	game->player_cam.view_angle = 90.0f*DEG2RAD;
+	game->player = game->player_cam;
+	game->prev_player = game->player_cam;
+
+	// Text levels are built here, without vis, so they can be edited live
+	size_t len = SDL_strlen(map_path);
+	if (len > 4 && SDL_strcmp(map_path + len - 4, ".txt") == 0)
+	{
+		SegmentArray segments;
+		if (!load_level_text(&game->level, &segments, map_path))
+			return SDL_FALSE;
+
+		BspOptions options = BSP_DEFAULT_OPTIONS;
+		options.num_threads = SDL_GetCPUCount();
+		generate_bsp_tree(&game->level, &segments, &options);
+	}
+	else if (!load_level_file(&game->level, map_path))
+		return SDL_FALSE;
+
+	init_vis(&game->vis, &game->level);
+	init_things(&game->things, &game->level);
+
+	return SDL_TRUE;
+}
+
+// Advances the player by one tick of input. Speeds are per tick.
+void tick_player(PlayerCam *player, Level *level, SDL_bool *keys)
+{
+	if (keys[POL_KEY_TURN_RIGHT])
+		player->view_angle -= 0.04f;
+	if (keys[POL_KEY_TURN_LEFT])
+		player->view_angle += 0.04f;
+
+	pol_Vec2 move = VEC2ZERO;
+	if (keys[POL_KEY_SPEED])
+	{
+		move.x += SDL_cosf(player->view_angle)*2;
+		move.y += SDL_sinf(player->view_angle)*2;
+	}
+	if (keys[POL_KEY_FORWARD])
+	{
+		move.x += SDL_cosf(player->view_angle);
+		move.y += SDL_sinf(player->view_angle);
+	}
+	if (keys[POL_KEY_BACK])
+	{
+		move.x -= SDL_cosf(player->view_angle);
+		move.y -= SDL_sinf(player->view_angle);
+	}
+	if (keys[POL_KEY_STRAFE_RIGHT])
+	{
+		move.x += SDL_sinf(player->view_angle);
+		move.y -= SDL_cosf(player->view_angle);
+	}
+	if (keys[POL_KEY_STRAFE_LEFT])
+	{
+		move.x -= SDL_sinf(player->view_angle);
+		move.y += SDL_cosf(player->view_angle);
+	}
+
+	SDL_bool blocked;
+	player->pos = move_circle(level, player->pos, move, PLAYER_RADIUS, &blocked);
+
+	if (keys[POL_KEY_ASCEND])
+		player->height += 0.5;
+	if (keys[POL_KEY_DESCEND])
+		player->height -= 0.5;
+}
+
+void interpolate_camera(PlayerCam *result, PlayerCam *from, PlayerCam *to, float t)
+{
+	result->pos.x = from->pos.x + (to->pos.x - from->pos.x)*t;
+	result->pos.y = from->pos.y + (to->pos.y - from->pos.y)*t;
+	result->height = from->height + (to->height - from->height)*t;
+	result->view_angle = from->view_angle + (to->view_angle - from->view_angle)*t;
+}
+
+void init_sim_clock(SimClock *clock)
+{
+	*clock = (SimClock){0};
+	clock->tick_length = SDL_GetPerformanceFrequency() / TICK_RATE;
+	clock->last_time = SDL_GetPerformanceCounter();
+}
+
+// Runs every tick that became due since the last call and places the render
+// camera between the last two of them. Returns the number of ticks run.
+int run_ticks(SimClock *clock, GameState *game, SDL_bool *keys)
+{
+	Uint64 now = SDL_GetPerformanceCounter();
+	clock->accumulator += now - clock->last_time;
+	clock->last_time = now;
+
+	int num_ticks = 0;
+	while (clock->accumulator >= clock->tick_length)
+	{
+		if (num_ticks == MAX_TICKS_PER_FRAME)
+		{
+			Uint64 behind = clock->accumulator / clock->tick_length;
+			clock->dropped_ticks += behind;
+			clock->accumulator -= behind * clock->tick_length;
+			break;
+		}
+
+		game->prev_player = game->player;
+		tick_player(&game->player, &game->level, keys);
+
+		clock->accumulator -= clock->tick_length;
+		clock->tick++;
+		num_ticks++;
+	}
+
+	float t = (float)clock->accumulator / clock->tick_length;
+	interpolate_camera(&game->player_cam, &game->prev_player, &game->player, t);
+
+	return num_ticks;
+}
+
+int next_power_of_two(int n)
+{
+	int result = 1;
+	while (result < n)
+		result <<= 1;
+
+	return result;
+}
+
+void init_mip_level(MipLevel *mip, int w, int h)
+{
+	mip->w = w;
+	mip->h = h;
+	mip->w_mask = w - 1;
+	mip->h_mask = h - 1;
+	mip->w_bits = 0;
+	mip->h_bits = 0;
+	while ((1 << mip->w_bits) < w)
+		mip->w_bits++;
+	while ((1 << mip->h_bits) < h)
+		mip->h_bits++;
+
+	mip->pixels = SDL_malloc(sizeof(pol_Color)*w*h);
+	mip->indices = NULL;
+}
+
+// Box filters each level down from the previous one, once levels[0] is set
+void build_mip_chain(Texture *tex)
+{
+	tex->num_levels = 1;
+
+	while (tex->num_levels < MAX_MIP_LEVELS)
+	{
+		MipLevel *src = &tex->levels[tex->num_levels-1];
+		if (src->w == 1 && src->h == 1)
+			break;
+
+		MipLevel *dst = &tex->levels[tex->num_levels++];
+		init_mip_level(dst, MAX(src->w/2, 1), MAX(src->h/2, 1));
+
+		int sx = src->w / dst->w;
+		int sy = src->h / dst->h;
+
+		for (int x = 0; x < dst->w; x++)
+		{
+			for (int y = 0; y < dst->h; y++)
+			{
+				int r = 0, g = 0, b = 0, a = 0;
+
+				for (int i = 0; i < sx; i++)
+				{
+					for (int j = 0; j < sy; j++)
+					{
+						pol_Color c = src->pixels[((x*sx + i) << src->h_bits) + y*sy + j];
+						r += c.r;
+						g += c.g;
+						b += c.b;
+						a += c.a;
+					}
+				}
+
+				int n = sx*sy;
+				dst->pixels[(x << dst->h_bits) + y] = (pol_Color){r/n, g/n, b/n, a/n};
+			}
+		}
+	}
+}
+
+// Loads an image and converts it once into the renderer's texture format:
+// RGBA bytes, power of two sides (nearest neighbour resampled), column
+// major storage and a full mip chain.
+SDL_bool load_texture(Texture *tex, const char *path)
+{
+	SDL_Surface *loaded = IMG_Load(path);
+	if (!loaded)
+	{
+		fprintf(stderr, "IMG_Load failed for %s. SDL_Error: %s\n", path, SDL_GetError());
+		return SDL_FALSE;
+	}
+
+	SDL_Surface *surface = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+	SDL_FreeSurface(loaded);
+	if (!surface)
+	{
+		fprintf(stderr, "SDL_ConvertSurfaceFormat failed for %s. SDL_Error: %s\n", path, SDL_GetError());
+		return SDL_FALSE;
+	}
+
+	MipLevel *base = &tex->levels[0];
+	init_mip_level(base, next_power_of_two(surface->w), next_power_of_two(surface->h));
+
+	SDL_LockSurface(surface);
+	for (int x = 0; x < base->w; x++)
+	{
+		int src_x = x * surface->w / base->w;
+
+		for (int y = 0; y < base->h; y++)
+		{
+			int src_y = y * surface->h / base->h;
+			Uint8 *row = (Uint8*)surface->pixels + src_y*surface->pitch;
+
+			base->pixels[(x << base->h_bits) + y] = ((pol_Color*)row)[src_x];
+		}
+	}
+	SDL_UnlockSurface(surface);
+
+	SDL_FreeSurface(surface);
+
+	tex->w = base->w;
+	tex->h = base->h;
+	build_mip_chain(tex);
+
+	return SDL_TRUE;
+}
+
+void free_texture(Texture *tex)
+{
+	for (int i = 0; i < tex->num_levels; i++)
+	{
+		SDL_free(tex->levels[i].pixels);
+		SDL_free(tex->levels[i].indices);
+		tex->levels[i].pixels = NULL;
+		tex->levels[i].indices = NULL;
+	}
+
+	tex->num_levels = 0;
+}
+
+int compare_red(const void *a, const void *b)
+{
+	return ((const pol_Color*)a)->r - ((const pol_Color*)b)->r;
+}
+
+int compare_green(const void *a, const void *b)
+{
+	return ((const pol_Color*)a)->g - ((const pol_Color*)b)->g;
+}
+
+int compare_blue(const void *a, const void *b)
+{
+	return ((const pol_Color*)a)->b - ((const pol_Color*)b)->b;
+}
+
+// Widest channel of colors[0..count) as 0, 1 or 2 for red, green and blue.
+// Returns its range.
+int widest_channel(pol_Color *colors, int count, int *channel)
+{
+	pol_Color lo = {255, 255, 255, 0};
+	pol_Color hi = {0, 0, 0, 0};
+	for (int i = 0; i < count; i++)
+	{
+		lo.r = MIN(lo.r, colors[i].r);
+		lo.g = MIN(lo.g, colors[i].g);
+		lo.b = MIN(lo.b, colors[i].b);
+		hi.r = MAX(hi.r, colors[i].r);
+		hi.g = MAX(hi.g, colors[i].g);
+		hi.b = MAX(hi.b, colors[i].b);
+	}
+
+	int ranges[3] = {hi.r - lo.r, hi.g - lo.g, hi.b - lo.b};
+	*channel = 0;
+	if (ranges[1] > ranges[*channel])
+		*channel = 1;
+	if (ranges[2] > ranges[*channel])
+		*channel = 2;
+
+	return ranges[*channel];
+}
+
+Uint8 nearest_palette_index(Palette *palette, int r, int g, int b)
+{
+	int best = 0;
+	int best_dist = SDL_MAX_SINT32;
+	for (int i = 0; i < 256; i++)
+	{
+		int dr = palette->colors[i].r - r;
+		int dg = palette->colors[i].g - g;
+		int db = palette->colors[i].b - b;
+		int dist = dr*dr + dg*dg + db*db;
+		if (dist < best_dist)
+		{
+			best = i;
+			best_dist = dist;
+		}
+	}
+
+	return best;
+}
+
+// Fills in the palette indices of every mip level
+void quantize_texture(Palette *palette, Texture *tex)
+{
+	for (int i = 0; i < tex->num_levels; i++)
+	{
+		MipLevel *mip = &tex->levels[i];
+		mip->indices = SDL_malloc(mip->w * mip->h);
+		for (int j = 0; j < mip->w * mip->h; j++)
+			mip->indices[j] = nearest_palette_index(palette, mip->pixels[j].r, mip->pixels[j].g, mip->pixels[j].b);
+	}
+}
+
+// Builds the palette from the textures with median cut, then the colormaps,
+// and quantizes every mip level of the textures to it
+void init_palette(Palette *palette, Texture **textures, int num_textures)
+{
+	// Texels of every texture at every light level, so the palette also
+	// covers the darkened colours the colormaps need. Past the sample limit
+	// each texture gives every stride-th texel, keeping their proportions.
+	int total = 0;
+	for (int t = 0; t < num_textures; t++)
+		total += textures[t]->levels[0].w * textures[t]->levels[0].h;
+	int stride = (total + PALETTE_SAMPLE_TEXELS - 1) / PALETTE_SAMPLE_TEXELS;
+	stride = MAX(stride, 1);
+
+	int per_level = 0;
+	for (int t = 0; t < num_textures; t++)
+		per_level += (textures[t]->levels[0].w * textures[t]->levels[0].h + stride - 1) / stride;
+
+	int num_texels = per_level * NUM_LIGHT_LEVELS;
+	pol_Color *texels = SDL_malloc(sizeof(pol_Color)*num_texels);
+	int n = 0;
+	for (int level = 0; level < NUM_LIGHT_LEVELS; level++)
+	{
+		float light = 1.0f - (float)level / NUM_LIGHT_LEVELS;
+		for (int t = 0; t < num_textures; t++)
+		{
+			MipLevel *base = &textures[t]->levels[0];
+			for (int i = 0; i < base->w * base->h; i += stride)
+			{
+				pol_Color c = base->pixels[i];
+				texels[n++] = (pol_Color){c.r*light, c.g*light, c.b*light, 255};
+			}
+		}
+	}
+
+	// Boxes are runs of texels. Split the box with the widest channel at
+	// its median until every palette entry but black has one.
+	int box_start[255] = {0};
+	int box_count[255] = {num_texels};
+	int num_boxes = 1;
+	while (num_boxes < 255)
+	{
+		int widest = -1;
+		int widest_range = 0;
+		int channel = 0;
+		for (int i = 0; i < num_boxes; i++)
+		{
+			int c;
+			int range = box_count[i] > 1 ? widest_channel(texels + box_start[i], box_count[i], &c) : 0;
+			if (range > widest_range)
+			{
+				widest = i;
+				widest_range = range;
+				channel = c;
+			}
+		}
+
+		if (widest < 0)
+			break;
+
+		int (*compare[3])(const void*, const void*) = {compare_red, compare_green, compare_blue};
+		SDL_qsort(texels + box_start[widest], box_count[widest], sizeof(pol_Color), compare[channel]);
+
+		int half = box_count[widest] / 2;
+		box_start[num_boxes] = box_start[widest] + half;
+		box_count[num_boxes] = box_count[widest] - half;
+		box_count[widest] = half;
+		num_boxes++;
+	}
+
+	SDL_memset(palette->colors, 0, sizeof(palette->colors));
+	for (int i = 0; i < 256; i++)
+		palette->colors[i].a = 255;
+
+	for (int i = 0; i < num_boxes; i++)
+	{
+		int r = 0, g = 0, b = 0;
+		for (int j = box_start[i]; j < box_start[i] + box_count[i]; j++)
+		{
+			r += texels[j].r;
+			g += texels[j].g;
+			b += texels[j].b;
+		}
+
+		int n = MAX(box_count[i], 1);
+		palette->colors[i+1] = (pol_Color){r/n, g/n, b/n, 255};
+	}
+
+	SDL_free(texels);
+
+	// Light level 0 is the palette itself, the rest fade linearly to black
+	for (int i = 0; i < 256; i++)
+		palette->colormaps[0][i] = i;
+
+	for (int level = 1; level < NUM_LIGHT_LEVELS; level++)
+	{
+		float light = 1.0f - (float)level / NUM_LIGHT_LEVELS;
+		for (int i = 0; i < 256; i++)
+		{
+			pol_Color c = palette->colors[i];
+			palette->colormaps[level][i] = nearest_palette_index(palette, c.r*light, c.g*light, c.b*light);
+		}
+	}
+
+	for (int t = 0; t < num_textures; t++)
+		quantize_texture(palette, textures[t]);
+
+	palette->enabled = SDL_TRUE;
+}
+
+// Turns a frame of palette indices into colours
+void expand_frame(pol_Color *dest, int dest_pitch, Uint8 *src, int src_pitch, int width, int height)
+{
+	for (int y = 0; y < height; y++)
+		global_expand_palette(dest + y*dest_pitch, src + y*src_pitch, width, global_palette.colors);
+}
+
+size_t texture_bytes(Texture *tex)
+{
+	size_t bytes = 0;
+	for (int i = 0; i < tex->num_levels; i++)
+	{
+		MipLevel *mip = &tex->levels[i];
+		bytes += (size_t)mip->w * mip->h * (sizeof(pol_Color) + (mip->indices ? 1 : 0));
+	}
+
+	return bytes;
+}
+
+int texture_decode_thread(void *data)
+{
+	TextureCache *cache = &global_textures;
+
+	SDL_LockMutex(cache->lock);
+	for (;;)
+	{
+		while (!cache->quit && cache->queue_len == 0)
+			SDL_CondWait(cache->wake, cache->lock);
+		if (cache->quit)
+			break;
+
+		TextureHandle handle = cache->queue[cache->queue_head];
+		cache->queue_head = (cache->queue_head + 1) % MAX_TEXTURES;
+		cache->queue_len--;
+
+		CachedTexture *entry = &cache->items[handle];
+		entry->job = TEXTURE_DECODING;
+		SDL_UnlockMutex(cache->lock);
+
+		// The palette is made before any texture is queued and never changes
+		Texture tex = {0};
+		SDL_bool loaded = load_texture(&tex, entry->path);
+		if (loaded && global_palette.enabled)
+			quantize_texture(&global_palette, &tex);
+
+		SDL_LockMutex(cache->lock);
+		if (loaded)
+		{
+			entry->decoded = tex;
+			entry->job = TEXTURE_DECODED;
+		}
+		else
+		{
+			// Stays on the placeholder until its file changes
+			entry->job = TEXTURE_FAILED;
+			cache->in_flight--;
+		}
+	}
+	SDL_UnlockMutex(cache->lock);
+
+	return 0;
+}
+
+// Must be called with the cache lock held
+void queue_texture(TextureCache *cache, TextureHandle handle)
+{
+	cache->items[handle].job = TEXTURE_QUEUED;
+	cache->queue[(cache->queue_head + cache->queue_len) % MAX_TEXTURES] = handle;
+	cache->queue_len++;
+	cache->in_flight++;
+	SDL_CondSignal(cache->wake);
+}
+
+// budget is in bytes. Textures are only queued by update_texture_cache, so
+// the palette can still be set up after this.
+SDL_bool init_texture_cache(size_t budget)
+{
+	TextureCache *cache = &global_textures;
+
+	cache->budget = budget;
+	cache->frame = 1;
+
+	// Grey checkerboard drawn while a texture loads or when it failed to
+	MipLevel *base = &cache->placeholder.levels[0];
+	init_mip_level(base, 16, 16);
+	for (int x = 0; x < base->w; x++)
+	{
+		for (int y = 0; y < base->h; y++)
+			base->pixels[(x << base->h_bits) + y] = ((x ^ y) & 8) ? (pol_Color){96, 96, 96, 255} : (pol_Color){48, 48, 48, 255};
+	}
+	cache->placeholder.w = base->w;
+	cache->placeholder.h = base->h;
+	build_mip_chain(&cache->placeholder);
+
+	cache->lock = SDL_CreateMutex();
+	cache->wake = SDL_CreateCond();
+
+	for (int i = 0; i < TEXTURE_DECODE_THREADS; i++)
+	{
+		cache->threads[i] = SDL_CreateThread(texture_decode_thread, "texture_decode", NULL);
+		if (!cache->threads[i])
+		{
+			fprintf(stderr, "SDL_CreateThread failed. SDL_Error: %s\n", SDL_GetError());
+			return SDL_FALSE;
+		}
+	}
+
+	return SDL_TRUE;
+}
+
+void shutdown_texture_cache(void)
+{
+	TextureCache *cache = &global_textures;
+
+	SDL_LockMutex(cache->lock);
+	cache->quit = SDL_TRUE;
+	SDL_CondBroadcast(cache->wake);
+	SDL_UnlockMutex(cache->lock);
+
+	for (int i = 0; i < TEXTURE_DECODE_THREADS; i++)
+		SDL_WaitThread(cache->threads[i], NULL);
+
+	for (int i = 0; i < cache->count; i++)
+	{
+		free_texture(&cache->items[i].tex);
+		free_texture(&cache->items[i].decoded);
+	}
+	free_texture(&cache->placeholder);
+
+	SDL_DestroyCond(cache->wake);
+	SDL_DestroyMutex(cache->lock);
+	*cache = (TextureCache){0};
+}
+
+// Returns the handle of the texture at path, adding it unloaded the first
+// time. Loading starts once it is drawn or prefetched.
+TextureHandle register_texture(const char *path)
+{
+	TextureCache *cache = &global_textures;
+	TextureHandle handle = -1;
+
+	SDL_LockMutex(cache->lock);
+	for (int i = 0; i < cache->count; i++)
+	{
+		if (SDL_strcmp(cache->items[i].path, path) == 0)
+			handle = i;
+	}
+
+	if (handle < 0 && cache->count < MAX_TEXTURES)
+	{
+		handle = cache->count;
+		SDL_strlcpy(cache->items[handle].path, path, LEVEL_TEXTURE_PATH_SIZE);
+		cache->count++;
+	}
+	SDL_UnlockMutex(cache->lock);
+
+	if (handle < 0)
+		fprintf(stderr, "More than %d textures, %s is drawn as the placeholder\n", MAX_TEXTURES, path);
+
+	return handle;
+}
+
+// Points game->level_textures at the cache entries for the current level
+void register_level_textures(GameState *game)
+{
+	Level *level = &game->level;
+	size_t count = MAX(level->num_textures, 1);
+
+	game->level_textures = SDL_realloc(game->level_textures, sizeof(TextureHandle)*count);
+	if (level->num_textures == 0)
+		game->level_textures[0] = register_texture(WALL_TEXTURE_PATH);
+
+	for (size_t i = 0; i < level->num_textures; i++)
+		game->level_textures[i] = register_texture(level->textures[i].path);
+}
+
+// Marks the textures of every wall in leaves near the camera as used
+void prefetch_textures(GameState *game, Sint32 node, float *box)
+{
+	Level *level = &game->level;
+
+	if (node & SECTOR_FLAG)
+	{
+		Sector *sector = &level->sectors[node & ~SECTOR_FLAG];
+		for (int i = sector->first_seg; i < sector->first_seg + sector->num_segments; i++)
+		{
+			TextureHandle handle = game->level_textures[level->seg_infos[i].texture];
+			if (handle >= 0)
+				SDL_AtomicSet(&global_textures.items[handle].last_used, global_textures.frame);
+		}
+		return;
+	}
+
+	Node *n = &level->nodes[node];
+	for (int side = 0; side < 2; side++)
+	{
+		float *child_box = side ? n->right_box : n->left_box;
+		if (child_box[BOX_LEFT] <= box[BOX_RIGHT] && child_box[BOX_RIGHT] >= box[BOX_LEFT] &&
+		    child_box[BOX_BOTTOM] <= box[BOX_TOP] && child_box[BOX_TOP] >= box[BOX_BOTTOM])
+			prefetch_textures(game, side ? n->right : n->left, box);
+	}
+}
+
+// Runs on the render thread before each frame, while no worker is drawing.
+// Makes decoded textures resident, queues the ones drawn as the placeholder
+// last frame or needed near the camera, and drops the least recently used
+// ones over the budget. Returns how many textures are still loading.
+int update_texture_cache(GameState *game)
+{
+	TextureCache *cache = &global_textures;
+
+	cache->frame++;
+
+	pol_Vec2 pos = game->player_cam.pos;
+	float box[4] = {
+		[BOX_TOP] = pos.y + TEXTURE_PREFETCH_RADIUS,
+		[BOX_BOTTOM] = pos.y - TEXTURE_PREFETCH_RADIUS,
+		[BOX_LEFT] = pos.x - TEXTURE_PREFETCH_RADIUS,
+		[BOX_RIGHT] = pos.x + TEXTURE_PREFETCH_RADIUS
+	};
+	prefetch_textures(game, game->level.num_nodes ? 0 : SECTOR_FLAG, box);
+
+	// Used last frame or prefetched for this one
+	int recent = cache->frame - 1;
+
+	SDL_LockMutex(cache->lock);
+	for (int i = 0; i < cache->count; i++)
+	{
+		CachedTexture *entry = &cache->items[i];
+
+		if (entry->job == TEXTURE_DECODED)
+		{
+			// A reload replaces the texture in place
+			if (entry->resident)
+			{
+				cache->resident_bytes -= entry->bytes;
+				free_texture(&entry->tex);
+			}
+
+			entry->tex = entry->decoded;
+			entry->decoded = (Texture){0};
+			entry->resident = SDL_TRUE;
+			entry->bytes = texture_bytes(&entry->tex);
+			entry->job = TEXTURE_IDLE;
+			cache->resident_bytes += entry->bytes;
+			cache->in_flight--;
+			cache->loads++;
+		}
+
+		if (!entry->resident && entry->job == TEXTURE_IDLE && SDL_AtomicGet(&entry->last_used) >= recent)
+			queue_texture(cache, i);
+	}
+	int in_flight = cache->in_flight;
+	SDL_UnlockMutex(cache->lock);
+
+	while (cache->resident_bytes > cache->budget)
+	{
+		CachedTexture *oldest = NULL;
+		for (int i = 0; i < cache->count; i++)
+		{
+			CachedTexture *entry = &cache->items[i];
+			int last_used = SDL_AtomicGet(&entry->last_used);
+			if (entry->resident && last_used < recent && (!oldest || last_used < SDL_AtomicGet(&oldest->last_used)))
+				oldest = entry;
+		}
+
+		// Everything left is in use
+		if (!oldest)
+			break;
+
+		free_texture(&oldest->tex);
+		oldest->resident = SDL_FALSE;
+		cache->resident_bytes -= oldest->bytes;
+		oldest->bytes = 0;
+		cache->evictions++;
+	}
+
+	return in_flight;
+}
+
+// Builds the palette from every texture of the level, loaded here rather
+// than through the cache, and maps the placeholder onto it. Textures that
+// fail to load are left out; they are drawn with the placeholder anyway.
+SDL_bool init_level_palette(GameState *game)
+{
+	Level *level = &game->level;
+	int count = MAX(level->num_textures, 1);
+
+	Texture *loaded = SDL_calloc(count, sizeof(Texture));
+	Texture **textures = SDL_malloc(sizeof(Texture*)*count);
+	int num_loaded = 0;
+	for (int i = 0; i < count; i++)
+	{
+		const char *path = level->num_textures ? level->textures[i].path : WALL_TEXTURE_PATH;
+		if (load_texture(&loaded[i], path))
+			textures[num_loaded++] = &loaded[i];
+	}
+
+	if (num_loaded > 0)
+	{
+		init_palette(&global_palette, textures, num_loaded);
+		quantize_texture(&global_palette, &global_textures.placeholder);
+	}
+
+	for (int i = 0; i < num_loaded; i++)
+		free_texture(textures[i]);
+	SDL_free(textures);
+	SDL_free(loaded);
+
+	return num_loaded > 0;
+}
+
+// Loads every texture of the level before the first frame, for the
+// benchmark, whose frames shouldn't depend on how fast decoding keeps up
+void preload_level_textures(GameState *game)
+{
+	TextureCache *cache = &global_textures;
+	size_t count = MAX(game->level.num_textures, 1);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (game->level_textures[i] >= 0)
+			SDL_AtomicSet(&cache->items[game->level_textures[i]].last_used, cache->frame);
+	}
+
+	while (update_texture_cache(game) > 0)
+		SDL_Delay(1);
+}
+
+// Publishes a finished frame to the export ring. Called by the thread that
+// presents frames, so rendering never waits on it.
+void export_frame(pol_Color *pixels, Uint8 *indices, SDL_bool palettized, int width, int height)
+{
+	pol_Color *dest = export_frame_begin(width, height);
+	if (palettized)
+		expand_frame(dest, width, indices, width, width, height);
+	else
+		SDL_memcpy(dest, pixels, sizeof(pol_Color)*width*height);
+	export_frame_end();
+}
+
+// Sets the internal resolution. Must not be called while a frame renders.
+void set_viewport(Viewport *view, int width, int height, int pitch)
+{
+	view->width = width;
+	view->height = height;
+	view->pitch = pitch;
+	view->half_width = width/2.0f;
+	view->half_height = height/2.0f;
+	view->y_scale = (float)width/height;
+
+	for (int y = 0; y < height; y++)
+	{
+		float normalized_y = (view->half_height - y + 0.5f) / (view->half_height * view->y_scale);
+		view->row_distance[y] = global_focal_length / normalized_y;
+	}
+}
+
+void init_tables(void)
+{
+	global_focal_length = 1/SDL_tanf(FOV/2);
+
+	global_clip_left = vec2_rotate((pol_Vec2){0, 10000.0f},  FOV/2);
+	global_clip_right = vec2_rotate((pol_Vec2){0, 10000.0f}, -FOV/2);
+}
+
+void render_strip(RenderContext *ctx, GameState *game)
+{
+	ctx->open_columns = ctx->x_end - ctx->x_start + 1;
+	for (int x = ctx->x_start; x <= ctx->x_end; x++)
+	{
+		ctx->ceiling_clip[x] = -1;
+		ctx->floor_clip[x] = ctx->view->height;
+		ctx->wall_depth[x] = INFINITY;
+	}
+
+	ctx->num_planes = 0;
+	ctx->num_sprites = 0;
+
+	Uint64 start = profile_begin();
+	render_bsp(0, ctx, game);
+	profile_end(ctx->profile_lane, ctx->frame, PROFILE_BSP, start);
+
+	draw_planes(ctx, &game->player_cam);
+	draw_sprites(ctx);
+
+	profile_add_counters(ctx->profile_lane, ctx->frame, ctx->counters);
+}
+
+int render_worker_main(void *data)
+{
+	RenderWorker *worker = data;
+	RenderPool *pool = &global_render_pool;
+
+	for (;;)
+	{
+		SDL_SemWait(worker->start);
+		if (pool->quit)
+			break;
+
+		render_strip(&worker->ctx, pool->game);
+		SDL_SemPost(pool->done);
+	}
+
+	return 0;
+}
+
+// Starts num_threads persistent workers, each owning one vertical strip of
+// the screen. With fewer than two threads the frame is rendered inline.
+void init_render_pool(int num_threads)
+{
+	RenderPool *pool = &global_render_pool;
+
+	if (num_threads < 2)
+		return;
+
+	pool->num_workers = num_threads;
+	pool->workers = SDL_calloc(num_threads, sizeof(RenderWorker));
+	pool->done = SDL_CreateSemaphore(0);
+	pool->quit = SDL_FALSE;
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		RenderWorker *worker = &pool->workers[i];
+		worker->start = SDL_CreateSemaphore(0);
+		worker->thread = SDL_CreateThread(render_worker_main, "render_worker", worker);
+	}
+}
+
+void shutdown_render_pool(void)
+{
+	RenderPool *pool = &global_render_pool;
+
+	pool->quit = SDL_TRUE;
+	for (int i = 0; i < pool->num_workers; i++)
+		SDL_SemPost(pool->workers[i].start);
+
+	for (int i = 0; i < pool->num_workers; i++)
+	{
+		SDL_WaitThread(pool->workers[i].thread, NULL);
+		SDL_DestroySemaphore(pool->workers[i].start);
+	}
+
+	SDL_DestroySemaphore(pool->done);
+	SDL_free(pool->workers);
+	pool->workers = NULL;
+	pool->num_workers = 0;
+}
+
+// Rotates every level vertex into view space once per frame. Kept as plain
+// float arrays so the loop vectorizes.
+void transform_vertices(float *restrict view_x, float *restrict view_y, Level *level, PlayerCam *player_cam, float view_cos, float view_sin)
+{
+	pol_Vec2 *vertices = level->vertices;
+	float pos_x = player_cam->pos.x;
+	float pos_y = player_cam->pos.y;
+	size_t num_vertices = level->num_vertices;
+
+	for (size_t i = 0; i < num_vertices; i++)
+	{
+		float dx = vertices[i].x - pos_x;
+		float dy = vertices[i].y - pos_y;
+		view_x[i] = dx*view_cos - dy*view_sin;
+		view_y[i] = dx*view_sin + dy*view_cos;
+	}
+}
+
+// Renders palette indices into indices when it is set and colours into
+// pixels otherwise. A heatmap always ends up in pixels.
+void render_frame(pol_Color *pixels, Uint8 *indices, GameState *game, Uint32 frame)
+{
+	static RenderContext ctx;
+	static float *view_x, *view_y;
+	static size_t view_capacity;
+
+	RenderPool *pool = &global_render_pool;
+	Viewport *view = &global_viewport;
+
+	Uint64 start = profile_begin();
+
+	float view_cos = SDL_cosf(-game->player_cam.view_angle + 90.0f*DEG2RAD);
+	float view_sin = SDL_sinf(-game->player_cam.view_angle + 90.0f*DEG2RAD);
+
+	if (view_capacity < game->level.num_vertices)
+	{
+		view_capacity = game->level.num_vertices;
+		view_x = SDL_realloc(view_x, sizeof(float)*view_capacity);
+		view_y = SDL_realloc(view_y, sizeof(float)*view_capacity);
+	}
+
+	transform_vertices(view_x, view_y, &game->level, &game->player_cam, view_cos, view_sin);
+	update_vis(&game->vis, &game->level, &game->player_cam);
+
+	if (pool->num_workers == 0)
+	{
+		ctx.pixels = pixels;
+		ctx.indices = indices;
+		ctx.view = view;
+		ctx.x_start = 0;
+		ctx.x_end = view->width - 1;
+		ctx.view_cos = view_cos;
+		ctx.view_sin = view_sin;
+		ctx.view_x = view_x;
+		ctx.view_y = view_y;
+		ctx.profile_lane = PROFILE_LANE_RENDER;
+		ctx.frame = frame;
+
+		render_strip(&ctx, game);
+		if (global_heatmap.mode != HEATMAP_OFF)
+			resolve_heatmap(pixels, view);
+
+		profile_end(PROFILE_LANE_RENDER, frame, PROFILE_RENDER, start);
+		return;
+	}
+
+	pool->game = game;
+
+	for (int i = 0; i < pool->num_workers; i++)
+	{
+		// Strips follow the current width, which can change between frames
+		RenderContext *worker_ctx = &pool->workers[i].ctx;
+		worker_ctx->pixels = pixels;
+		worker_ctx->indices = indices;
+		worker_ctx->view = view;
+		worker_ctx->x_start = view->width * i / pool->num_workers;
+		worker_ctx->x_end = view->width * (i+1) / pool->num_workers - 1;
+		worker_ctx->view_cos = view_cos;
+		worker_ctx->view_sin = view_sin;
+		worker_ctx->view_x = view_x;
+		worker_ctx->view_y = view_y;
+		worker_ctx->profile_lane = PROFILE_LANE_WORKER + i;
+		worker_ctx->frame = frame;
+
+		SDL_SemPost(pool->workers[i].start);
+	}
+
+	// Wait until every strip is finished
+	for (int i = 0; i < pool->num_workers; i++)
+		SDL_SemWait(pool->done);
+
+	if (global_heatmap.mode != HEATMAP_OFF)
+		resolve_heatmap(pixels, view);
+
+	profile_end(PROFILE_LANE_RENDER, frame, PROFILE_RENDER, start);
+}
+
+void init_governor(ResolutionGovernor *governor, int width, int height, float target_ms)
+{
+	*governor = (ResolutionGovernor){0};
+	governor->enabled = target_ms > 0.0f;
+	governor->target_ms = target_ms;
+	governor->base_width = width;
+	governor->base_height = height;
+	governor->scale = 100;
+}
+
+// Feeds the render time of the last frame to the governor. Returns SDL_TRUE
+// and the new resolution when it decided to change it.
+SDL_bool update_governor(ResolutionGovernor *governor, float frame_ms, int *width, int *height)
+{
+	if (!governor->enabled)
+		return SDL_FALSE;
+
+	if (frame_ms > governor->target_ms)
+	{
+		governor->frames_over++;
+		governor->frames_under = 0;
+	}
+	else if (frame_ms < governor->target_ms * GOVERNOR_HEADROOM)
+	{
+		governor->frames_under++;
+		governor->frames_over = 0;
+	}
+	else
+	{
+		governor->frames_over = 0;
+		governor->frames_under = 0;
+	}
+
+	int scale = governor->scale;
+	if (governor->frames_over >= GOVERNOR_FRAMES_OVER)
+		scale = MAX(scale - GOVERNOR_STEP_DOWN, GOVERNOR_MIN_SCALE);
+	else if (governor->frames_under >= GOVERNOR_FRAMES_UNDER)
+		scale = MIN(scale + GOVERNOR_STEP_UP, 100);
+
+	if (scale == governor->scale)
+		return SDL_FALSE;
+
+	// Measure the new resolution from scratch
+	governor->scale = scale;
+	governor->frames_over = 0;
+	governor->frames_under = 0;
+
+	// Even sizes keep the center of projection on a pixel boundary
+	*width = (governor->base_width * scale / 100) & ~1;
+	*height = (governor->base_height * scale / 100) & ~1;
+
+	return SDL_TRUE;
+}
+
+// Scripted camera path for the benchmark: one lap around the pillar while
+// sweeping the view back and forth, so every frame is reproducible.
+void benchmark_camera(PlayerCam *player_cam, int frame, int num_frames)
+{
+	float t = (float)frame / num_frames;
+	float orbit = t * 2.0f*M_PI;
+
+	player_cam->pos.x = SDL_cosf(orbit) * 96.0f;
+	player_cam->pos.y = SDL_sinf(orbit) * 96.0f;
+	player_cam->height = 40.0f + SDL_sinf(orbit*3.0f) * 8.0f;
+	player_cam->view_angle = orbit + 90.0f*DEG2RAD + SDL_sinf(orbit*5.0f) * 60.0f*DEG2RAD;
+}
+
+int compare_floats(const void *a, const void *b)
+{
+	float fa = *(const float*)a;
+	float fb = *(const float*)b;
+	return (fa > fb) - (fa < fb);
+}
+
+// Renders num_frames frames into a plain buffer without a window or renderer
+// and prints frame time percentiles and a checksum of the final frame.
+int run_benchmark(int num_frames, const char *map_path, int width, int height, float target_ms, SDL_bool use_palette, int num_things, size_t texture_budget)
+{
+	if (!IMG_Init(IMG_INIT_PNG))
+	{
+		fprintf(stderr, "IMG_Init failed. SDL_Error: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	if (!init_texture_cache(texture_budget))
+		return 1;
+
+	GameState game = {0};
+	if (!init_game(&game, map_path))
+		return 1;
+	register_level_textures(&game);
+	if (use_palette && !init_level_palette(&game))
+		return 1;
+	scatter_things(&game.things, &game.level, num_things, game.level_textures[0]);
+
+	benchmark_camera(&game.player_cam, 0, num_frames);
+	preload_level_textures(&game);
+
+	init_tables();
+	set_viewport(&global_viewport, width, height, width);
+
+	ResolutionGovernor governor;
+	init_governor(&governor, width, height, target_ms);
+
+	pol_Color *pixels = SDL_calloc(width*height, sizeof(pol_Color));
+	Uint8 *indices = use_palette ? SDL_calloc(width*height, 1) : NULL;
+	float *frame_times = SDL_malloc(sizeof(float)*num_frames);
+
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	double total_ms = 0.0;
+	double total_overdraw = 0.0;
+
+	for (int i = 0; i < num_frames; i++)
+	{
+		benchmark_camera(&game.player_cam, i, num_frames);
+
+		profile_begin_frame(i);
+
+		// The palette is expanded as part of the frame, as it would be for
+		// presenting it
+		Uint64 start = SDL_GetPerformanceCounter();
+		update_texture_cache(&game);
+		render_frame(pixels, indices, &game, i);
+		if (indices && global_heatmap.mode == HEATMAP_OFF)
+			expand_frame(pixels, global_viewport.width, indices, global_viewport.width, global_viewport.width, global_viewport.height);
+		Uint64 end = SDL_GetPerformanceCounter();
+
+		// Outside the frame time, as the game exports from the main thread
+		if (global_frame_export.enabled)
+			export_frame(pixels, indices, SDL_FALSE, global_viewport.width, global_viewport.height);
+
+		frame_times[i] = (double)(end - start) * 1000.0 / freq;
+		total_ms += frame_times[i];
+		total_overdraw += global_heatmap.overdraw;
+
+		int new_width, new_height;
+		if (update_governor(&governor, frame_times[i], &new_width, &new_height))
+			set_viewport(&global_viewport, new_width, new_height, new_width);
+	}
+
+	// FNV-1a over the final frame
+	Uint32 checksum = 2166136261u;
+	Uint8 *bytes = (Uint8*)pixels;
+	size_t frame_size = (size_t)global_viewport.width*global_viewport.height*sizeof(pol_Color);
+	for (size_t i = 0; i < frame_size; i++)
+	{
+		checksum ^= bytes[i];
+		checksum *= 16777619u;
+	}
+
+	SDL_qsort(frame_times, num_frames, sizeof(float), compare_floats);
+
+	int num_threads = MAX(global_render_pool.num_workers, 1);
+	printf("frames:   %d (%dx%d, %d %s, %s%s, %d things)\n", num_frames, global_viewport.width, global_viewport.height,
+		num_threads, num_threads == 1 ? "thread" : "threads", global_simd_name, use_palette ? ", palette" : "", (int)game.things.count);
+	printf("min:      %.3f ms\n", frame_times[0]);
+	printf("median:   %.3f ms\n", frame_times[num_frames/2]);
+	printf("p95:      %.3f ms\n", frame_times[(int)(num_frames*0.95f)]);
+	printf("p99:      %.3f ms\n", frame_times[(int)(num_frames*0.99f)]);
+	printf("max:      %.3f ms\n", frame_times[num_frames-1]);
+	printf("mean:     %.3f ms\n", total_ms / num_frames);
+	printf("checksum: %08x\n", checksum);
+	if (global_heatmap.mode == HEATMAP_OVERDRAW)
+		printf("overdraw: %.2fx\n", total_overdraw / num_frames);
+	printf("textures: %d loaded, %d evicted, %zu KB resident\n", global_textures.loads,
+		global_textures.evictions, global_textures.resident_bytes / 1024);
+
+	SDL_free(frame_times);
+	SDL_free(pixels);
+	SDL_free(indices);
+	shutdown_texture_cache();
+	SDL_free(game.level_textures);
+	free_things(&game.things);
+	free_vis(&game.vis);
+	free_level(&game.level);
+
+	return 0;
+}
+
+// Growth exponent between two points of a log-log curve, 0 when either is
+// too small to tell
+double scaling_slope(double size, double prev_size, double value, double prev_value)
+{
+	if (prev_size <= 0.0 || value <= 0.0 || prev_value <= 0.0 || size == prev_size)
+		return 0.0;
+
+	return SDL_log(value / prev_value) / SDL_log(size / prev_size);
+}
+
+// Builds every kind of generated map at sizes from 10 walls up to
+// max_segments and renders num_frames frames of each, printing one CSV row
+// per map. Each row has the growth exponent of build and frame time against
+// the previous size, 1 being linear. Returns 2 when a build exponent above
+// SCALE_SLOPE_LIMIT was seen, so a script can fail on it.
+int run_scale_benchmark(int num_frames, int width, int height, int max_segments, size_t texture_budget)
+{
+	if (!IMG_Init(IMG_INIT_PNG))
 	{
-		pol_Vec2 *v1 = level->vertices + segments[i].v1;
-		pol_Vec2 *v2 = level->vertices + segments[i].v2;
+		fprintf(stderr, "IMG_Init failed. SDL_Error: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	if (!init_texture_cache(texture_budget))
+		return 1;
+
+	init_tables();
+
+	BspOptions options = BSP_DEFAULT_OPTIONS;
+	options.num_threads = SDL_GetCPUCount();
+
+	pol_Color *pixels = SDL_calloc(width*height, sizeof(pol_Color));
+	float *frame_times = SDL_malloc(sizeof(float)*num_frames);
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	int result = 0;
 
-		int a = point_on_side(split_v1, split_v2, *v1);
-		int b = point_on_side(split_v1, split_v2, *v2);
+	printf("kind,walls,segs,splits,nodes,sectors,max_depth,avg_depth,level_kb,build_ms,"
+	       "frame_median_ms,frame_p99_ms,frame_mean_ms,build_slope,frame_slope\n");
 
-		// Intersection
-		if (a * b == -1)
+	for (int kind = 0; kind < MAP_KIND_COUNT; kind++)
+	{
+		double prev_walls = 0.0, prev_build_ms = 0.0, prev_frame_ms = 0.0;
+
+		for (int size = 10; size <= max_segments; size *= 10)
 		{
-			pol_Vec2 split_point = line_intersect(split_v1, split_v2, *v1, *v2);
-			level->vertices = SDL_realloc(level->vertices, sizeof(pol_Vec2)*(level->num_vertices+1));
-			level->vertices[level->num_vertices] = split_point;
+			GameState game = {0};
+
+			SegmentArray segments;
+			generate_map(&game.level, &segments, kind, size);
+			size_t num_walls = segments.len;
+
+			Uint64 build_start = SDL_GetPerformanceCounter();
+			generate_bsp_tree(&game.level, &segments, &options);
+			Uint64 build_end = SDL_GetPerformanceCounter();
+			SDL_free(segments.items);
 
-			left = SDL_realloc(left, sizeof(LineSegment)*(num_left+1));
-			right = SDL_realloc(right, sizeof(LineSegment)*(num_right+1));
+			BspTreeStats tree;
+			measure_bsp_tree(&game.level, &tree);
 
-			if (a == -1)
+			init_vis(&game.vis, &game.level);
+			init_things(&game.things, &game.level);
+			register_level_textures(&game);
+			benchmark_camera(&game.player_cam, 0, num_frames);
+			preload_level_textures(&game);
+			set_viewport(&global_viewport, width, height, width);
+
+			double total_ms = 0.0;
+			for (int i = 0; i < num_frames; i++)
 			{
-				left[num_left++] = (LineSegment){segments[i].v1, level->num_vertices};
-				right[num_right++] = (LineSegment){level->num_vertices, segments[i].v2};
+				benchmark_camera(&game.player_cam, i, num_frames);
+
+				Uint64 start = SDL_GetPerformanceCounter();
+				update_texture_cache(&game);
+				render_frame(pixels, NULL, &game, i);
+				Uint64 end = SDL_GetPerformanceCounter();
+
+				frame_times[i] = (double)(end - start) * 1000.0 / freq;
+				total_ms += frame_times[i];
 			}
-			else
+			SDL_qsort(frame_times, num_frames, sizeof(float), compare_floats);
+
+			double build_ms = (double)(build_end - build_start) * 1000.0 / freq;
+			double frame_ms = total_ms / num_frames;
+			double build_slope = scaling_slope(num_walls, prev_walls, build_ms, prev_build_ms);
+			double frame_slope = scaling_slope(num_walls, prev_walls, frame_ms, prev_frame_ms);
+			// Splits add one segment each
+			size_t splits = game.level.num_segs > num_walls ? game.level.num_segs - num_walls : 0;
+
+			printf("%s,%zu,%zu,%zu,%zu,%zu,%d,%.2f,%zu,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			       map_kind_names[kind], num_walls, game.level.num_segs, splits, game.level.num_nodes,
+			       game.level.num_sectors, tree.max_depth, tree.average_depth, tree.memory / 1024, build_ms,
+			       frame_times[num_frames/2], frame_times[(int)(num_frames*0.99f)], frame_ms, build_slope, frame_slope);
+			fflush(stdout);
+
+			if (prev_build_ms >= SCALE_MIN_CHECKED_MS && build_slope > SCALE_SLOPE_LIMIT)
 			{
-				right[num_right++] = (LineSegment){segments[i].v1, level->num_vertices};
-				left[num_left++] = (LineSegment){level->num_vertices, segments[i].v2};
+				fprintf(stderr, "%s: build time grew as walls^%.2f from %.0f to %zu walls\n",
+				        map_kind_names[kind], build_slope, prev_walls, num_walls);
+				result = 2;
 			}
 
-			level->num_vertices++;
+			prev_walls = num_walls;
+			prev_build_ms = build_ms;
+			prev_frame_ms = frame_ms;
 
-			continue;
-		}
-
-		// Right side
-		if (a == 1 || b == 1)
-		{
-			right = SDL_realloc(right, sizeof(LineSegment)*(num_right+1));
-			right[num_right++] = segments[i];
-			continue;
-		}
-		// Left side or splitter
-		else
-		{
-			left = SDL_realloc(left, sizeof(LineSegment)*(num_left+1));
-			left[num_left++] = segments[i];
-			continue;
+			SDL_free(game.level_textures);
+			free_things(&game.things);
+			free_vis(&game.vis);
+			free_level(&game.level);
 		}
 	}
 
-	// Move splitter to right side if empty
-	if (right == NULL)
+	SDL_free(frame_times);
+	SDL_free(pixels);
+	shutdown_texture_cache();
+
+	return result;
+}
+
+FrameBuffer *oldest_queued_frame(FramePipeline *pipeline)
+{
+	FrameBuffer *oldest = NULL;
+	for (int i = 0; i < pipeline->num_buffers; i++)
 	{
-		right = SDL_malloc(sizeof(LineSegment)*(num_right+1));
-		right[num_right++] = segments[0];
+		FrameBuffer *frame = &pipeline->buffers[i];
+		if (frame->state == FRAME_QUEUED && (!oldest || frame->sequence - oldest->sequence > 0x80000000u))
+			oldest = frame;
 	}
-	// Else in left side
-	else
+
+	return oldest;
+}
+
+FrameBuffer *free_frame(FramePipeline *pipeline)
+{
+	for (int i = 0; i < pipeline->num_buffers; i++)
 	{
-		left = SDL_realloc(left, sizeof(LineSegment)*(num_left+1));
-		left[num_left++] = segments[0];
+		if (pipeline->buffers[i].state == FRAME_FREE)
+			return &pipeline->buffers[i];
 	}
 
-	outleft->items = left;
-	outright->items = right;
-	outleft->len = num_left;
-	outright->len = num_right;
+	return NULL;
 }
 
+// Called with the lock held. There is always a free or queued buffer since
+// the main thread presents one at a time.
+FrameBuffer *acquire_frame(FramePipeline *pipeline)
+{
+	FrameBuffer *frame = free_frame(pipeline);
+	if (!frame)
+	{
+		SDL_CondWaitTimeout(pipeline->released, pipeline->lock, 1000 / TICK_RATE);
+		frame = free_frame(pipeline);
+	}
+
+	if (!frame)
+	{
+		frame = oldest_queued_frame(pipeline);
+		pipeline->stats.frames_dropped++;
+	}
+
+	frame->state = FRAME_RENDERING;
+	frame->sequence = pipeline->next_sequence++;
+	return frame;
+}
 
-int create_node(SegmentArray *segments, Level *level)
+// Returns SDL_TRUE when path was written since stamp was taken, and updates
+// the stamp
+SDL_bool file_changed(const char *path, FileStamp *stamp)
 {
-	Node node;
-	node.splitter = segments->items[0];
+	struct stat st;
+
+	// Missing while an editor saves it, so check again later
+	if (stat(path, &st) != 0)
+		return SDL_FALSE;
 
-	SegmentArray left;
-	SegmentArray right;
-	split_segments(segments, &left, &right, level);
-	SDL_free(segments->items);
+	if (st.st_mtime == stamp->mtime && st.st_size == stamp->size)
+		return SDL_FALSE;
 
-	int node_index = level->num_nodes++;
-	level->nodes = SDL_realloc(level->nodes, sizeof(Node)*(level->num_nodes));
+	stamp->mtime = st.st_mtime;
+	stamp->size = st.st_size;
+	return SDL_TRUE;
+}
 
-	if (!is_convex(&left, level->vertices))
+// Builds the edited level from the one the game is showing. Returns NULL
+// when the source doesn't parse, which keeps the current level.
+Level *rebuild_level(const char *path, Level *current)
+{
+	Level *level = SDL_malloc(sizeof(Level));
+	SegmentArray segments;
+	if (!load_level_text(level, &segments, path))
 	{
-		node.left = create_node(&left, level);
+		SDL_free(level);
+		return NULL;
 	}
-	else
+
+	BspOptions options = BSP_DEFAULT_OPTIONS;
+	options.num_threads = SDL_GetCPUCount();
+
+	BspRebuildStats stats;
+	Uint64 start = SDL_GetPerformanceCounter();
+	rebuild_bsp_tree(level, current, &segments, &options, &stats);
+	Uint64 end = SDL_GetPerformanceCounter();
+
+	printf("rebuilt %s in %.3f ms: %zu nodes, %zu kept; %zu sectors, %zu kept\n", path,
+		(double)(end - start) * 1000.0 / SDL_GetPerformanceFrequency(),
+		level->num_nodes, stats.reused_nodes, level->num_sectors, stats.reused_sectors);
+
+	return level;
+}
+
+// Decodes every texture whose file changed again. The cache swaps the new
+// one in like any other load.
+void reload_changed_textures(LiveEdit *edit)
+{
+	TextureCache *cache = &global_textures;
+
+	SDL_LockMutex(cache->lock);
+	int count = cache->count;
+	SDL_UnlockMutex(cache->lock);
+
+	for (int i = 0; i < count; i++)
 	{
-		level->sectors = realloc(level->sectors, sizeof(Sector)*(level->num_sectors+1));
-		level->sectors[level->num_sectors].num_segments = left.len;
-		level->sectors[level->num_sectors].line_segs = left.items;
-		node.left = level->num_sectors | SECTOR_FLAG;
-		level->num_sectors++;
+		CachedTexture *entry = &cache->items[i];
+
+		// The first look at a texture only takes its stamp
+		if (!file_changed(entry->path, &entry->stamp) || i >= edit->num_watched_textures)
+			continue;
+
+		SDL_LockMutex(cache->lock);
+		if (entry->job == TEXTURE_IDLE || entry->job == TEXTURE_FAILED)
+		{
+			queue_texture(cache, i);
+			printf("reloading %s\n", entry->path);
+		}
+		else if (entry->job != TEXTURE_QUEUED)
+		{
+			// The old file is still being decoded, so look again next time
+			entry->stamp = (FileStamp){0};
+		}
+		SDL_UnlockMutex(cache->lock);
 	}
 
-	if (!is_convex(&right, level->vertices))
+	edit->num_watched_textures = count;
+}
+
+int live_edit_thread(void *data)
+{
+	FramePipeline *pipeline = data;
+	LiveEdit *edit = &pipeline->edit;
+
+	for (;;)
 	{
-		node.right = create_node(&right, level);
+		SDL_LockMutex(pipeline->lock);
+		SDL_bool quit = pipeline->quit;
+		SDL_bool waiting = edit->pending_level != NULL;
+		SDL_UnlockMutex(pipeline->lock);
+
+		if (quit)
+			break;
+
+		if (!waiting)
+		{
+			// Only the render thread changes the level, and only when a
+			// result is pending, so it can be read without the lock here
+			if (file_changed(edit->level_path, &edit->level_stamp))
+			{
+				Level *level = rebuild_level(edit->level_path, &pipeline->game->level);
+
+				SDL_LockMutex(pipeline->lock);
+				edit->pending_level = level;
+				SDL_UnlockMutex(pipeline->lock);
+			}
+		}
+
+		reload_changed_textures(edit);
+
+		SDL_Delay(LIVE_EDIT_POLL_MS);
 	}
-	else
+
+	return 0;
+}
+
+// Swaps in what the watcher finished. Called by the render thread between
+// frames with the pipeline lock held, so the watcher can't start reading the
+// level halfway through.
+void apply_live_edits(FramePipeline *pipeline)
+{
+	LiveEdit *edit = &pipeline->edit;
+	GameState *game = pipeline->game;
+
+	if (edit->pending_level)
 	{
-		level->sectors = realloc(level->sectors, sizeof(Sector)*(level->num_sectors+1));
-		level->sectors[level->num_sectors].num_segments = right.len;
-		level->sectors[level->num_sectors].line_segs = right.items;
-		node.right = level->num_sectors | SECTOR_FLAG;
-		level->num_sectors++;
+		free_vis(&game->vis);
+		free_level(&game->level);
+		game->level = *edit->pending_level;
+		SDL_free(edit->pending_level);
+		edit->pending_level = NULL;
+
+		init_vis(&game->vis, &game->level);
+		relink_things(&game->things, &game->level);
+		register_level_textures(game);
 	}
+}
+
+// Starts watching level_path, a text level the game was started with, and
+// the textures in the cache
+SDL_bool start_live_edit(FramePipeline *pipeline, const char *level_path)
+{
+	LiveEdit *edit = &pipeline->edit;
+
+	edit->level_path = level_path;
+	file_changed(level_path, &edit->level_stamp);
 
-	level->nodes[node_index] = node;
+	SDL_LockMutex(pipeline->lock);
+	edit->enabled = SDL_TRUE;
+	SDL_UnlockMutex(pipeline->lock);
 
-	return node_index;
+	edit->thread = SDL_CreateThread(live_edit_thread, "live_edit", pipeline);
+	if (!edit->thread)
+	{
+		fprintf(stderr, "SDL_CreateThread failed. SDL_Error: %s\n", SDL_GetError());
+		return SDL_FALSE;
+	}
+
+	return SDL_TRUE;
 }
 
-void render_bsp(int node, SectorPointerArray *draw_sectors, GameState *game)
+int render_thread(void *data)
 {
-	if (node & SECTOR_FLAG)
+	FramePipeline *pipeline = data;
+	Uint64 freq = SDL_GetPerformanceFrequency();
+	SDL_bool keys[POL_KEY_COUNT];
+	SDL_bool heatmap_held = SDL_FALSE;
+
+	init_sim_clock(&pipeline->clock);
+
+	for (;;)
 	{
-		if (draw_sectors->len >= 128)
-			return;
+		SDL_LockMutex(pipeline->lock);
+		if (pipeline->quit)
+		{
+			SDL_UnlockMutex(pipeline->lock);
+			break;
+		}
+		SDL_memcpy(keys, pipeline->keys, sizeof(keys));
+		FrameBuffer *frame = acquire_frame(pipeline);
+		if (pipeline->edit.enabled)
+			apply_live_edits(pipeline);
+		SDL_UnlockMutex(pipeline->lock);
 
-		int sector_index = node&(~SECTOR_FLAG);
-		Sector *s = &game->level.sectors[sector_index];
-		draw_sectors->items[draw_sectors->len++] = s;
+		// Each press cycles through the heatmap modes
+		if (keys[POL_KEY_HEATMAP] && !heatmap_held)
+			set_heatmap_mode((global_heatmap.mode + 1) % HEATMAP_MODE_COUNT);
+		heatmap_held = keys[POL_KEY_HEATMAP];
 
-		return;
+		profile_begin_frame(frame->sequence);
+
+		Uint64 tick_start = SDL_GetPerformanceCounter();
+		Uint64 profile_start = profile_begin();
+		int ticks = run_ticks(&pipeline->clock, pipeline->game, keys);
+		profile_end(PROFILE_LANE_RENDER, frame->sequence, PROFILE_TICKS, profile_start);
+
+		update_texture_cache(pipeline->game);
+
+		Uint64 render_start = SDL_GetPerformanceCounter();
+		global_viewport.pitch = global_viewport.width;
+		frame->width = global_viewport.width;
+		frame->height = global_viewport.height;
+		render_frame(frame->pixels, frame->indices, pipeline->game, frame->sequence);
+		frame->palettized = frame->indices && global_heatmap.mode == HEATMAP_OFF;
+		Uint64 render_end = SDL_GetPerformanceCounter();
+
+		float render_ms = (double)(render_end - render_start) * 1000.0 / freq;
+
+		SDL_LockMutex(pipeline->lock);
+		{
+			frame->state = FRAME_QUEUED;
+
+			pipeline->stats.frames_rendered++;
+			pipeline->stats.ticks += ticks;
+			pipeline->stats.tick_ms += (double)(render_start - tick_start) * 1000.0 / freq;
+			pipeline->stats.render_ms += render_ms;
+			pipeline->stats.ticks_dropped = pipeline->clock.dropped_ticks;
+			if (global_heatmap.mode == HEATMAP_OVERDRAW)
+			{
+				pipeline->stats.overdraw += global_heatmap.overdraw;
+				pipeline->stats.overdraw_frames++;
+			}
+		}
+		SDL_CondSignal(pipeline->queued);
+		SDL_UnlockMutex(pipeline->lock);
+
+		int new_width, new_height;
+		if (update_governor(&pipeline->governor, render_ms, &new_width, &new_height))
+			set_viewport(&global_viewport, new_width, new_height, new_width);
 	}
 
-	Node *n = &game->level.nodes[node];
-	pol_Vec2 v1 = game->level.vertices[n->splitter.v1];
-	pol_Vec2 v2 = game->level.vertices[n->splitter.v2];
-	int side = point_on_side(v1, v2, game->player_cam.pos);
+	return 0;
+}
 
-	if (side == 1)
+SDL_bool start_frame_pipeline(FramePipeline *pipeline, int num_buffers, GameState *game)
+{
+	pipeline->num_buffers = num_buffers;
+	pipeline->lock = SDL_CreateMutex();
+	pipeline->queued = SDL_CreateCond();
+	pipeline->released = SDL_CreateCond();
+	pipeline->game = game;
+
+	for (int i = 0; i < num_buffers; i++)
 	{
-		render_bsp(n->right, draw_sectors, game);
-		render_bsp(n->left, draw_sectors, game);
+		// Sized for the full resolution, lower resolutions use the start of it
+		pipeline->buffers[i].pixels = SDL_malloc(global_viewport.width*global_viewport.height*sizeof(pol_Color));
+		if (global_palette.enabled)
+			pipeline->buffers[i].indices = SDL_malloc(global_viewport.width*global_viewport.height);
+		pipeline->buffers[i].state = FRAME_FREE;
 	}
-	else
+
+	pipeline->thread = SDL_CreateThread(render_thread, "render", pipeline);
+	if (!pipeline->thread)
 	{
-		render_bsp(n->left, draw_sectors, game);
-		render_bsp(n->right, draw_sectors, game);
+		fprintf(stderr, "SDL_CreateThread failed. SDL_Error: %s\n", SDL_GetError());
+		return SDL_FALSE;
 	}
+
+	return SDL_TRUE;
 }
 
-void generate_bsp_tree(Level *level)
+void stop_frame_pipeline(FramePipeline *pipeline)
 {
-	LineSegment segments_data[] = {
-		// Pillar
-		{14, 15},
-		{15, 16},
-		{16, 17},
-		{17, 14},
+	SDL_LockMutex(pipeline->lock);
+	pipeline->quit = SDL_TRUE;
+	SDL_UnlockMutex(pipeline->lock);
 
-		// Room
-		{0, 1},
-		{1, 2},
-		{2, 3},
-		{3, 4},
-		{4, 5},
-		{5, 6},
-		{6, 7},
-		{7, 8},
-		{8, 9},
-		{9, 10},
-		{10, 11},
-		{11, 12},
-		{12, 13},
-		{13, 0}
+	SDL_WaitThread(pipeline->thread, NULL);
 
-	};
-	SegmentArray segments;
-	segments.len = sizeof(segments_data)/sizeof(segments_data[0]);
-	segments.items = SDL_malloc(sizeof(LineSegment)*segments.len);
-	SDL_memcpy(segments.items, segments_data, sizeof(LineSegment)*segments.len);
+	if (pipeline->edit.thread)
+	{
+		SDL_WaitThread(pipeline->edit.thread, NULL);
+		if (pipeline->edit.pending_level)
+			free_level(pipeline->edit.pending_level);
+		SDL_free(pipeline->edit.pending_level);
+	}
 
-	create_node(&segments, level);
+	for (int i = 0; i < pipeline->num_buffers; i++)
+	{
+		SDL_free(pipeline->buffers[i].pixels);
+		SDL_free(pipeline->buffers[i].indices);
+	}
+	SDL_DestroyCond(pipeline->queued);
+	SDL_DestroyCond(pipeline->released);
+	SDL_DestroyMutex(pipeline->lock);
 }
 
-void init_game(GameState *game)
+// Waits up to timeout_ms for a finished frame and takes the oldest one.
+// Returns NULL on timeout, so the caller can keep handling events.
+FrameBuffer *take_frame(FramePipeline *pipeline, Uint32 timeout_ms)
 {
-	game->player_cam.height = 40.0f;
-	game->player_cam.view_angle = 90.0f*DEG2RAD;
-
-	pol_Vec2 vertices_data[] = {
-		{-256,  256},
-		{-128,  256},
-		{-128,  128},
-		{   0,  128},
-		{ 128,  128},
-		{ 128,  256},
-		{ 256,  256},
-
-		{ 256, -256},
-		{ 128, -256},
-		{ 128, -128},
-		{   0, -128},
-		{-128, -128},
-		{-128, -256},
-		{-256, -256},
-
-		{ 32,    32},
-		{-32,    32},
-		{-32,   -32},
-		{ 32,   -32}
-	};
+	SDL_LockMutex(pipeline->lock);
+	FrameBuffer *frame = oldest_queued_frame(pipeline);
+	if (!frame)
+	{
+		SDL_CondWaitTimeout(pipeline->queued, pipeline->lock, timeout_ms);
+		frame = oldest_queued_frame(pipeline);
+	}
+	if (frame)
+		frame->state = FRAME_PRESENTING;
+	SDL_UnlockMutex(pipeline->lock);
 
-	game->level.num_vertices = sizeof(vertices_data)/sizeof(vertices_data[0]),
-	game->level.vertices = SDL_malloc(sizeof(pol_Vec2)*game->level.num_vertices);
-	SDL_memcpy(game->level.vertices, vertices_data, sizeof(pol_Vec2)*game->level.num_vertices);
+	return frame;
+}
 
-	generate_bsp_tree(&game->level);
+void release_frame(FramePipeline *pipeline, FrameBuffer *frame)
+{
+	SDL_LockMutex(pipeline->lock);
+	frame->state = FRAME_FREE;
+	SDL_CondSignal(pipeline->released);
+	SDL_UnlockMutex(pipeline->lock);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	int bench_frames = 0;
+	int scale_frames = 0;
+	int scale_max = SCALE_BENCH_MAX_SEGMENTS;
+	int num_threads = 1;
+	SDL_bool force_scalar = SDL_FALSE;
+	const char *map_path = "maps/room.bsp";
+	int width = SCREEN_WIDTH;
+	int height = SCREEN_HEIGHT;
+	// Render time budget for dynamic resolution, 0 keeps it fixed
+	float target_ms = 0.0f;
+	// Software framebuffers between rendering and present
+	int num_buffers = 3;
+	SDL_bool profile = SDL_FALSE;
+	const char *trace_path = NULL;
+	SDL_bool use_palette = SDL_FALSE;
+	int num_things = 0;
+	SDL_bool live_edit = SDL_FALSE;
+	size_t texture_budget = (size_t)DEFAULT_TEXTURE_BUDGET_MB << 20;
+	const char *export_shm = NULL;
+	const char *export_path = NULL;
+	int export_slots = FRAME_EXPORT_DEFAULT_SLOTS;
+	for (int i = 1; i < argc; i++)
+	{
+		if (SDL_strcmp(argv[i], "--bench") == 0 && i+1 < argc)
+			bench_frames = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--bench-scale") == 0 && i+1 < argc)
+			scale_frames = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--scale-max") == 0 && i+1 < argc)
+			scale_max = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+			num_threads = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--scalar") == 0)
+			force_scalar = SDL_TRUE;
+		else if (SDL_strcmp(argv[i], "--map") == 0 && i+1 < argc)
+			map_path = argv[++i];
+		else if (SDL_strcmp(argv[i], "--res") == 0 && i+1 < argc)
+		{
+			if (SDL_sscanf(argv[++i], "%dx%d", &width, &height) != 2)
+			{
+				fprintf(stderr, "Bad resolution %s, expected WIDTHxHEIGHT\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (SDL_strcmp(argv[i], "--target-ms") == 0 && i+1 < argc)
+			target_ms = SDL_atof(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--buffers") == 0 && i+1 < argc)
+			num_buffers = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--heatmap") == 0 && i+1 < argc)
+		{
+			i++;
+			if (SDL_strcmp(argv[i], "overdraw") == 0)
+				set_heatmap_mode(HEATMAP_OVERDRAW);
+			else if (SDL_strcmp(argv[i], "time") == 0)
+				set_heatmap_mode(HEATMAP_COLUMN_TIME);
+			else
+			{
+				fprintf(stderr, "Unknown heatmap mode %s, expected overdraw or time\n", argv[i]);
+				return 1;
+			}
+		}
+		else if (SDL_strcmp(argv[i], "--palette") == 0)
+			use_palette = SDL_TRUE;
+		else if (SDL_strcmp(argv[i], "--things") == 0 && i+1 < argc)
+			num_things = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--edit") == 0)
+			live_edit = SDL_TRUE;
+		else if (SDL_strcmp(argv[i], "--texture-mb") == 0 && i+1 < argc)
+			texture_budget = (size_t)SDL_max(SDL_atoi(argv[++i]), 0) << 20;
+		else if (SDL_strcmp(argv[i], "--export-shm") == 0 && i+1 < argc)
+			export_shm = argv[++i];
+		else if (SDL_strcmp(argv[i], "--export-file") == 0 && i+1 < argc)
+			export_path = argv[++i];
+		else if (SDL_strcmp(argv[i], "--export-slots") == 0 && i+1 < argc)
+			export_slots = SDL_atoi(argv[++i]);
+		else if (SDL_strcmp(argv[i], "--profile") == 0)
+			profile = SDL_TRUE;
+		else if (SDL_strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+		{
+			profile = SDL_TRUE;
+			trace_path = argv[++i];
+		}
+	}
+
+	num_buffers = CLAMP(num_buffers, 2, MAX_FRAME_BUFFERS);
+
+	size_t map_len = SDL_strlen(map_path);
+	if (live_edit && (map_len < 4 || SDL_strcmp(map_path + map_len - 4, ".txt") != 0))
+	{
+		fprintf(stderr, "--edit needs a text level, not %s\n", map_path);
+		return 1;
+	}
+
+	if (width < 16 || height < 16 || width > MAX_RENDER_WIDTH || height > MAX_RENDER_HEIGHT)
+	{
+		fprintf(stderr, "Resolution %dx%d is outside 16x16 to %dx%d\n", width, height, MAX_RENDER_WIDTH, MAX_RENDER_HEIGHT);
+		return 1;
+	}
+
+	init_simd(force_scalar);
+
+	// 0 picks one strip per core
+	if (num_threads == 0)
+		num_threads = SDL_GetCPUCount();
+
+	init_render_pool(num_threads);
+
+	if (profile && !init_profiler(PROFILE_LANE_WORKER + global_render_pool.num_workers, trace_path))
+		return 1;
+
+	if ((export_shm || export_path) && !init_frame_export(export_shm, export_path, export_slots, width, height))
+		return 1;
+
+	if (scale_frames > 0)
+	{
+		int result = run_scale_benchmark(scale_frames, width, height, scale_max, texture_budget);
+		shutdown_frame_export();
+		shutdown_render_pool();
+		shutdown_profiler();
+		return result;
+	}
+
+	if (bench_frames > 0)
+	{
+		int result = run_benchmark(bench_frames, map_path, width, height, target_ms, use_palette, num_things, texture_budget);
+		shutdown_frame_export();
+		shutdown_render_pool();
+		shutdown_profiler();
+		return result;
+	}
+
 	SDL_Window *window = SDL_CreateWindow(
 		"My window",
 		SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-		SCREEN_WIDTH, SCREEN_HEIGHT,
+		width, height,
 		0
 	);
 
@@ -841,27 +3733,36 @@ int main()
 	Uint32 elapsedTime = 0;
 	int frameCount = 0;
 
-	pol_Color *screen_buffer;
-	int pitch;
 	SDL_Texture *screen_texture = SDL_CreateTexture(
 		renderer,
 		SDL_PIXELFORMAT_ABGR8888,
 		SDL_TEXTUREACCESS_STREAMING,
-		SCREEN_WIDTH,
-		SCREEN_HEIGHT
+		width,
+		height
 	);
 
-	SDL_Surface *walltex = IMG_Load("greenman.png");
-
-	float floor_height = 0.0f;
-	float ceiling_height = 64.0f;
+	if (!init_texture_cache(texture_budget))
+		return 1;
 
 	GameState game = {0};
-	init_game(&game);
+	if (!init_game(&game, map_path))
+		return 1;
+	register_level_textures(&game);
+	if (use_palette && !init_level_palette(&game))
+		return 1;
+	scatter_things(&game.things, &game.level, num_things, game.level_textures[0]);
 
-	global_focal_length = 1/SDL_tanf(FOV/2);
+	init_tables();
+	set_viewport(&global_viewport, width, height, width);
 
-	SectorPointerArray draw_sectors = {0};
+	// Simulation and rendering run on their own thread from here on, this
+	// one only handles events and presents finished frames
+	FramePipeline pipeline = {0};
+	init_governor(&pipeline.governor, width, height, target_ms);
+	if (!start_frame_pipeline(&pipeline, num_buffers, &game))
+		return 1;
+	if (live_edit && !start_live_edit(&pipeline, map_path))
+		return 1;
 
 	SDL_Event event;
 	while(global_is_running)
@@ -883,83 +3784,70 @@ int main()
 			}
 		}
 
-		if (keys[POL_KEY_TURN_RIGHT])
-			game.player_cam.view_angle -= 0.04f;
-		if (keys[POL_KEY_TURN_LEFT])
-			game.player_cam.view_angle += 0.04f;
+		SDL_LockMutex(pipeline.lock);
+		SDL_memcpy(pipeline.keys, keys, sizeof(keys));
+		SDL_UnlockMutex(pipeline.lock);
 
-		if (keys[POL_KEY_SPEED])
-		{
-			game.player_cam.pos.x += SDL_cosf(game.player_cam.view_angle)*2;
-			game.player_cam.pos.y += SDL_sinf(game.player_cam.view_angle)*2;
-		}
-		if (keys[POL_KEY_FORWARD])
-		{
-			game.player_cam.pos.x += SDL_cosf(game.player_cam.view_angle);
-			game.player_cam.pos.y += SDL_sinf(game.player_cam.view_angle);
-		}
-		if (keys[POL_KEY_BACK])
-		{
-			game.player_cam.pos.x -= SDL_cosf(game.player_cam.view_angle);
-			game.player_cam.pos.y -= SDL_sinf(game.player_cam.view_angle);
-		}
-		if (keys[POL_KEY_STRAFE_RIGHT])
-		{
-			game.player_cam.pos.x += SDL_sinf(game.player_cam.view_angle);
-			game.player_cam.pos.y -= SDL_cosf(game.player_cam.view_angle);
-		}
-		if (keys[POL_KEY_STRAFE_LEFT])
+		FrameBuffer *frame = take_frame(&pipeline, 100);
+		if (!frame)
+			continue;
+
+		Uint32 sequence = frame->sequence;
+		SDL_Rect view_rect = {0, 0, frame->width, frame->height};
+
+		Uint64 start = profile_begin();
+		if (frame->palettized)
 		{
-			game.player_cam.pos.x -= SDL_sinf(game.player_cam.view_angle);
-			game.player_cam.pos.y += SDL_cosf(game.player_cam.view_angle);
+			// Expanded straight into the texture
+			pol_Color *texels;
+			int pitch;
+			SDL_LockTexture(screen_texture, &view_rect, (void**)&texels, &pitch);
+			expand_frame(texels, pitch / sizeof(pol_Color), frame->indices, frame->width, frame->width, frame->height);
+			SDL_UnlockTexture(screen_texture);
 		}
-		if (keys[POL_KEY_ASCEND])
-			game.player_cam.height += 0.5;
-		if (keys[POL_KEY_DESCEND])
-			game.player_cam.height -= 0.5;
+		else
+			SDL_UpdateTexture(screen_texture, &view_rect, frame->pixels, frame->width*sizeof(pol_Color));
+		profile_end(PROFILE_LANE_MAIN, sequence, PROFILE_UPLOAD, start);
 
-		SDL_LockTexture(screen_texture, NULL, (void*)&screen_buffer, &pitch);
+		if (global_frame_export.enabled)
 		{
-			draw_sectors.len = 0;
-
-			// memset(screen_buffer, 0, SCREEN_WIDTH*SCREEN_HEIGHT*sizeof(pol_Color));
-
-			render_bsp(0, &draw_sectors, &game);
-
-			// Render far to near
-			for (int j = draw_sectors.len-1; j >= 0; j--)
-			{
-				Sector *s = draw_sectors.items[j];
-
-				for (int i = 0; i < s->num_segments; i++)
-				{
-					DrawSegment draw_seg = {
-						.line_seg = s->line_segs+i,
-						.floor_height = floor_height,
-						.ceiling_height = ceiling_height,
-						.tex = walltex
-					};
-
-					render_line_segment(screen_buffer, &game, &draw_seg);
-				}
-			}
-
-
-		} SDL_UnlockTexture(screen_texture);
-
-		SDL_RenderCopy(renderer, screen_texture, NULL, NULL);
+			start = profile_begin();
+			export_frame(frame->pixels, frame->indices, frame->palettized, frame->width, frame->height);
+			profile_end(PROFILE_LANE_MAIN, sequence, PROFILE_EXPORT, start);
+		}
+		release_frame(&pipeline, frame);
 
+		// Scaled up to the window
+		start = profile_begin();
+		SDL_RenderCopy(renderer, screen_texture, &view_rect, NULL);
 		SDL_RenderPresent(renderer);
-		
+		profile_end(PROFILE_LANE_MAIN, sequence, PROFILE_PRESENT, start);
+
 		frameCount += 1;
 		elapsedTime += SDL_GetTicks() - startTime;
 		if (elapsedTime >= 1000)
 		{
-			printf("FPS: %i\n", frameCount);
+			SDL_LockMutex(pipeline.lock);
+			FrameStats stats = pipeline.stats;
+			pipeline.stats = (FrameStats){0};
+			SDL_UnlockMutex(pipeline.lock);
+
+			int rendered = MAX(stats.frames_rendered, 1);
+			printf("FPS: %i (%d rendered, %d dropped, %d ticks, tick %.3f ms, render %.3f ms per frame, %u ticks dropped)\n",
+				frameCount, stats.frames_rendered, stats.frames_dropped, stats.ticks,
+				stats.tick_ms / rendered, stats.render_ms / rendered, stats.ticks_dropped);
+			if (stats.overdraw_frames)
+				printf("overdraw: %.2fx\n", stats.overdraw / stats.overdraw_frames);
 			elapsedTime = elapsedTime - 1000;
 			frameCount = 0;
 		}
 
 		startTime = SDL_GetTicks();
 	}
+
+	stop_frame_pipeline(&pipeline);
+	shutdown_frame_export();
+	shutdown_texture_cache();
+	shutdown_profiler();
+	shutdown_render_pool();
 }
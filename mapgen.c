@@ -0,0 +1,276 @@
+#include "level.h"
+
+// Procedural stress maps. Every kind is centered on the origin and leaves a
+// circle of MAP_CLEAR_RADIUS there open, so the benchmark camera's orbit
+// stays inside the map at any size. Walls are 64 units apart in the tile
+// based kinds, like the room map.
+
+const char *map_kind_names[MAP_KIND_COUNT] = {"pillars", "arena", "maze", "corridor"};
+
+#define MAP_CLEAR_RADIUS 128.0f
+#define MAP_TILE 64.0f
+
+typedef struct
+{
+	Level *level;
+	SegmentArray *segments;
+	size_t vertices_capacity;
+	size_t segments_capacity;
+	Uint32 seed;
+} MapBuilder;
+
+// xorshift32, so maps are the same on every run
+static Uint32 next_random(MapBuilder *b)
+{
+	b->seed ^= b->seed << 13;
+	b->seed ^= b->seed >> 17;
+	b->seed ^= b->seed << 5;
+	return b->seed;
+}
+
+static Sint32 add_vertex(MapBuilder *b, float x, float y)
+{
+	Level *level = b->level;
+	level->vertices = grow_array(level->vertices, &b->vertices_capacity, level->num_vertices+1, sizeof(pol_Vec2));
+	level->vertices[level->num_vertices] = (pol_Vec2){x, y};
+	return level->num_vertices++;
+}
+
+// Wall seen from its right side, looking from a to b
+static void add_wall(MapBuilder *b, float ax, float ay, float bx, float by)
+{
+	SegmentArray *segments = b->segments;
+	Sint32 v1 = add_vertex(b, ax, ay);
+	Sint32 v2 = add_vertex(b, bx, by);
+	segments->items = grow_array(segments->items, &b->segments_capacity, segments->len+1, sizeof(LineSegment));
+	segments->items[segments->len++] = (LineSegment){v1, v2, 0.0f};
+}
+
+// Square seen from outside, or from inside for the walls around a room
+static void add_box(MapBuilder *b, float x0, float y0, float x1, float y1, SDL_bool inside)
+{
+	if (inside)
+	{
+		add_wall(b, x1, y0, x0, y0);
+		add_wall(b, x0, y0, x0, y1);
+		add_wall(b, x0, y1, x1, y1);
+		add_wall(b, x1, y1, x1, y0);
+	}
+	else
+	{
+		add_wall(b, x0, y0, x1, y0);
+		add_wall(b, x1, y0, x1, y1);
+		add_wall(b, x1, y1, x0, y1);
+		add_wall(b, x0, y1, x0, y0);
+	}
+}
+
+// Square room holding a side*side grid of pillars of varying size, with the
+// ones in the middle left out
+static void generate_pillars(MapBuilder *b, int num_segments)
+{
+	int side = SDL_max((int)SDL_ceilf(SDL_sqrtf(num_segments / 4.0f)), 1);
+	float half = (side/2 + 1) * MAP_TILE + MAP_CLEAR_RADIUS;
+	float clear = MAP_CLEAR_RADIUS + MAP_TILE/2;
+
+	add_box(b, -half, -half, half, half, SDL_TRUE);
+
+	for (int i = 0; i < side; i++)
+	{
+		for (int j = 0; j < side; j++)
+		{
+			float x = (i - side/2) * MAP_TILE;
+			float y = (j - side/2) * MAP_TILE;
+			if (x*x + y*y < clear*clear)
+				continue;
+
+			float s = 8.0f + next_random(b) % 13;
+			add_box(b, x - s, y - s, x + s, y + s, SDL_FALSE);
+		}
+	}
+}
+
+// Octagonal room with pillars spread thinly over a jittered grid, four
+// times as far apart as in the pillar field
+static void generate_arena(MapBuilder *b, int num_segments)
+{
+	int side = SDL_max((int)SDL_ceilf(SDL_sqrtf(num_segments / 4.0f)), 1);
+	float spacing = MAP_TILE * 4.0f;
+	float extent = side * spacing / 2;
+	float h = extent * 1.5f + MAP_CLEAR_RADIUS * 2.0f;
+	float a = h / 3.0f;
+
+	// Clockwise, so every wall faces the middle
+	float corners[9][2] = {{h, a}, {h, -a}, {a, -h}, {-a, -h}, {-h, -a}, {-h, a}, {-a, h}, {a, h}, {h, a}};
+	for (int i = 0; i < 8; i++)
+		add_wall(b, corners[i][0], corners[i][1], corners[i+1][0], corners[i+1][1]);
+
+	float clear = MAP_CLEAR_RADIUS + MAP_TILE/2;
+	for (int i = 0; i < side; i++)
+	{
+		for (int j = 0; j < side; j++)
+		{
+			float jitter_x = (next_random(b) % 1024 / 1024.0f - 0.5f) * spacing/2;
+			float jitter_y = (next_random(b) % 1024 / 1024.0f - 0.5f) * spacing/2;
+			float x = (i + 0.5f) * spacing - extent + jitter_x;
+			float y = (j + 0.5f) * spacing - extent + jitter_y;
+			if (x*x + y*y < clear*clear)
+				continue;
+
+			float s = 8.0f + next_random(b) % 13;
+			add_box(b, x - s, y - s, x + s, y + s, SDL_FALSE);
+		}
+	}
+}
+
+// Walls between solid and open tiles of a w*h grid, centered on the origin.
+// Tiles outside the grid count as solid.
+static void add_tile_walls(MapBuilder *b, Uint8 *solid, int w, int h)
+{
+	float left = -w/2 * MAP_TILE - MAP_TILE/2;
+	float bottom = -h/2 * MAP_TILE - MAP_TILE/2;
+
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			if (solid[y*w + x])
+				continue;
+
+			float x0 = left + x*MAP_TILE, x1 = x0 + MAP_TILE;
+			float y0 = bottom + y*MAP_TILE, y1 = y0 + MAP_TILE;
+
+			// Each wall faces into this open tile
+			if (y == 0 || solid[(y-1)*w + x])
+				add_wall(b, x1, y0, x0, y0);
+			if (y == h-1 || solid[(y+1)*w + x])
+				add_wall(b, x0, y1, x1, y1);
+			if (x == 0 || solid[y*w + x-1])
+				add_wall(b, x0, y0, x0, y1);
+			if (x == w-1 || solid[y*w + x+1])
+				add_wall(b, x1, y1, x1, y0);
+		}
+	}
+}
+
+// Opens the tiles within radius of the middle of the grid
+static void clear_middle(Uint8 *solid, int w, int h, float radius)
+{
+	for (int y = 0; y < h; y++)
+	{
+		for (int x = 0; x < w; x++)
+		{
+			float dx = (x - w/2) * MAP_TILE;
+			float dy = (y - h/2) * MAP_TILE;
+			if (dx*dx + dy*dy <= radius*radius)
+				solid[y*w + x] = 0;
+		}
+	}
+}
+
+// Perfect maze over a cells*cells grid, carved by a depth first walk.
+// Cells sit on the odd tiles of a (2*cells+1) square grid.
+static void generate_maze(MapBuilder *b, int num_segments)
+{
+	int cells = SDL_max((int)SDL_ceilf(SDL_sqrtf(num_segments / 4.0f)), 2);
+	int w = cells*2 + 1;
+	Uint8 *solid = SDL_malloc(w*w);
+	SDL_memset(solid, 1, w*w);
+
+	int *stack = SDL_malloc(sizeof(int)*cells*cells);
+	int top = 0;
+	stack[top++] = 0;
+	solid[1*w + 1] = 0;
+
+	while (top > 0)
+	{
+		int cell = stack[top-1];
+		int cx = cell % cells, cy = cell / cells;
+
+		int options[4];
+		int num_options = 0;
+		int dirs[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+		for (int i = 0; i < 4; i++)
+		{
+			int nx = cx + dirs[i][0], ny = cy + dirs[i][1];
+			if (nx >= 0 && ny >= 0 && nx < cells && ny < cells && solid[(ny*2+1)*w + nx*2+1])
+				options[num_options++] = i;
+		}
+
+		if (num_options == 0)
+		{
+			top--;
+			continue;
+		}
+
+		int dir = options[next_random(b) % num_options];
+		int nx = cx + dirs[dir][0], ny = cy + dirs[dir][1];
+		solid[(cy*2+1 + dirs[dir][1])*w + cx*2+1 + dirs[dir][0]] = 0;
+		solid[(ny*2+1)*w + nx*2+1] = 0;
+		stack[top++] = ny*cells + nx;
+	}
+
+	clear_middle(solid, w, w, MAP_CLEAR_RADIUS + MAP_TILE);
+	add_tile_walls(b, solid, w, w);
+
+	SDL_free(stack);
+	SDL_free(solid);
+}
+
+// Straight corridor five tiles wide with an alcove on each side every other
+// tile, so most of its walls are in view down its length
+static void generate_corridor(MapBuilder *b, int num_segments)
+{
+	int length = SDL_max(num_segments / 4, 8);
+	int w = length, h = 9;
+	Uint8 *solid = SDL_malloc(w*h);
+	SDL_memset(solid, 1, w*h);
+
+	for (int x = 1; x < w-1; x++)
+	{
+		for (int y = 2; y <= 6; y++)
+			solid[y*w + x] = 0;
+
+		if (x % 2 == 0)
+		{
+			solid[1*w + x] = 0;
+			solid[7*w + x] = 0;
+		}
+	}
+
+	add_tile_walls(b, solid, w, h);
+	SDL_free(solid);
+}
+
+// Fills level and segments with a map of about num_segments walls, ready for
+// generate_bsp_tree. The walls are the same on every run.
+void generate_map(Level *level, SegmentArray *segments, MapKind kind, int num_segments)
+{
+	*level = (Level){0};
+	*segments = (SegmentArray){0};
+
+	MapBuilder b = {level, segments, 0, 0, 0x2545f491};
+	switch (kind)
+	{
+		case MAP_PILLARS: generate_pillars(&b, num_segments); break;
+		case MAP_ARENA: generate_arena(&b, num_segments); break;
+		case MAP_MAZE: generate_maze(&b, num_segments); break;
+		case MAP_CORRIDOR: generate_corridor(&b, num_segments); break;
+		default: break;
+	}
+}
+
+// Returns SDL_FALSE for an unknown name
+SDL_bool map_kind_from_name(const char *name, MapKind *kind)
+{
+	for (int i = 0; i < MAP_KIND_COUNT; i++)
+	{
+		if (SDL_strcmp(name, map_kind_names[i]) == 0)
+		{
+			*kind = i;
+			return SDL_TRUE;
+		}
+	}
+
+	return SDL_FALSE;
+}
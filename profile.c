@@ -0,0 +1,215 @@
+#include "profile.h"
+
+// Emit out-of-line copies of the inline helpers in profile.h
+extern inline Uint64 profile_begin(void);
+extern inline void profile_end(int lane, Uint32 frame, ProfileStage stage, Uint64 start);
+extern inline void profile_add_counters(int lane, Uint32 frame, Uint64 *counters);
+
+Profiler global_profiler;
+
+static const char *stage_names[PROFILE_STAGE_COUNT] = {
+	"ticks", "render", "bsp", "segment setup", "wall fill", "plane fill", "sprite fill", "upload", "export", "present"
+};
+
+static const char *counter_names[PROFILE_COUNTER_COUNT] = {
+	"segs considered", "segs culled", "sectors visited", "columns", "pixels", "sprites"
+};
+
+static void write_event(const char *format, ...)
+{
+	Profiler *p = &global_profiler;
+
+	fputs(p->wrote_event ? ",\n" : "\n", p->trace);
+	p->wrote_event = SDL_TRUE;
+
+	va_list args;
+	va_start(args, format);
+	vfprintf(p->trace, format, args);
+	va_end(args);
+}
+
+static double to_us(Uint64 time)
+{
+	Profiler *p = &global_profiler;
+	return (double)(time - p->base_time) * p->ms_per_tick * 1000.0;
+}
+
+// Writes a finished frame to the trace and adds it to the summary
+static void flush_frame(ProfileFrame *frame)
+{
+	Profiler *p = &global_profiler;
+
+	double frame_ms[PROFILE_STAGE_COUNT] = {0};
+	Uint64 counters[PROFILE_COUNTER_COUNT] = {0};
+	Uint64 frame_start = 0;
+
+	for (int lane = 0; lane < p->num_lanes; lane++)
+	{
+		ProfileLane *l = &frame->lanes[lane];
+
+		for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++)
+		{
+			if (l->calls[stage] == 0)
+				continue;
+
+			double ms = l->ticks[stage] * p->ms_per_tick;
+			frame_ms[stage] += ms;
+			p->stage_calls[stage] += l->calls[stage];
+			if (frame_start == 0 || l->start[stage] < frame_start)
+				frame_start = l->start[stage];
+
+			if (p->trace)
+			{
+				write_event("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u,\"calls\":%u}}",
+					stage_names[stage], lane, to_us(l->start[stage]), ms * 1000.0, frame->frame, l->calls[stage]);
+			}
+		}
+
+		for (int i = 0; i < PROFILE_COUNTER_COUNT; i++)
+			counters[i] += l->counters[i];
+	}
+
+	if (p->trace && frame_start)
+	{
+		fputs(p->wrote_event ? ",\n" : "\n", p->trace);
+		fprintf(p->trace, "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{",
+			PROFILE_LANE_RENDER, to_us(frame_start));
+		for (int i = 0; i < PROFILE_COUNTER_COUNT; i++)
+			fprintf(p->trace, "%s\"%s\":%llu", i ? "," : "", counter_names[i], (unsigned long long)counters[i]);
+		fputs("}}", p->trace);
+	}
+
+	for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++)
+	{
+		p->stage_ms[stage] += frame_ms[stage];
+		p->stage_max_ms[stage] = SDL_max(p->stage_max_ms[stage], frame_ms[stage]);
+	}
+	for (int i = 0; i < PROFILE_COUNTER_COUNT; i++)
+	{
+		p->counters[i] += counters[i];
+		p->counter_max[i] = SDL_max(p->counter_max[i], counters[i]);
+	}
+	p->num_frames++;
+
+	frame->used = SDL_FALSE;
+}
+
+// Turns recording on for num_lanes threads. trace_path may be NULL to only
+// print the summary.
+SDL_bool init_profiler(int num_lanes, const char *trace_path)
+{
+	Profiler *p = &global_profiler;
+
+	if (num_lanes > PROFILE_MAX_LANES)
+	{
+		fprintf(stderr, "Profiler supports %d threads, not %d\n", PROFILE_MAX_LANES, num_lanes);
+		return SDL_FALSE;
+	}
+
+	*p = (Profiler){0};
+	p->num_lanes = num_lanes;
+	p->frames = SDL_calloc(PROFILE_RING_SIZE, sizeof(ProfileFrame));
+	p->base_time = SDL_GetPerformanceCounter();
+	p->ms_per_tick = 1000.0 / SDL_GetPerformanceFrequency();
+
+	if (trace_path)
+	{
+		p->trace = fopen(trace_path, "w");
+		if (!p->trace)
+		{
+			fprintf(stderr, "Couldn't open trace file %s\n", trace_path);
+			SDL_free(p->frames);
+			return SDL_FALSE;
+		}
+
+		fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", p->trace);
+		for (int lane = 0; lane < num_lanes; lane++)
+		{
+			if (lane < PROFILE_LANE_WORKER)
+			{
+				write_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+					lane, lane == PROFILE_LANE_MAIN ? "main" : "render");
+			}
+			else
+			{
+				write_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+					lane, lane - PROFILE_LANE_WORKER);
+			}
+		}
+	}
+
+	p->enabled = SDL_TRUE;
+	return SDL_TRUE;
+}
+
+// Called by the render thread before it records anything for frame
+void profile_begin_frame(Uint32 frame)
+{
+	Profiler *p = &global_profiler;
+	if (!p->enabled)
+		return;
+
+	ProfileFrame *slot = &p->frames[frame & (PROFILE_RING_SIZE-1)];
+	if (slot->used)
+		flush_frame(slot);
+
+	SDL_memset(slot, 0, sizeof(ProfileFrame));
+	slot->frame = frame;
+	slot->used = SDL_TRUE;
+}
+
+// Writes out the frames still in the ring, closes the trace and prints the
+// summary. Every recording thread must have stopped.
+void shutdown_profiler(void)
+{
+	Profiler *p = &global_profiler;
+	if (!p->enabled)
+		return;
+
+	p->enabled = SDL_FALSE;
+
+	// Oldest frame first, so the trace stays in order
+	Uint32 oldest = 0;
+	SDL_bool found = SDL_FALSE;
+	for (int i = 0; i < PROFILE_RING_SIZE; i++)
+	{
+		ProfileFrame *frame = &p->frames[i];
+		if (frame->used && (!found || frame->frame - oldest > 0x80000000u))
+		{
+			oldest = frame->frame;
+			found = SDL_TRUE;
+		}
+	}
+
+	for (Uint32 i = 0; found && i < PROFILE_RING_SIZE; i++)
+	{
+		ProfileFrame *frame = &p->frames[(oldest + i) & (PROFILE_RING_SIZE-1)];
+		if (frame->used && frame->frame == oldest + i)
+			flush_frame(frame);
+	}
+
+	if (p->trace)
+	{
+		fputs("\n]}\n", p->trace);
+		fclose(p->trace);
+	}
+
+	Uint32 num_frames = SDL_max(p->num_frames, 1);
+	printf("profile over %u frames, times summed over threads\n", p->num_frames);
+	printf("%-16s %10s %10s %12s\n", "stage", "mean ms", "max ms", "calls/frame");
+	for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++)
+	{
+		printf("%-16s %10.3f %10.3f %12.1f\n", stage_names[stage],
+			p->stage_ms[stage] / num_frames, p->stage_max_ms[stage],
+			(double)p->stage_calls[stage] / num_frames);
+	}
+	printf("%-16s %10s %10s\n", "counter", "mean", "max");
+	for (int i = 0; i < PROFILE_COUNTER_COUNT; i++)
+	{
+		printf("%-16s %10.1f %10llu\n", counter_names[i],
+			(double)p->counters[i] / num_frames, (unsigned long long)p->counter_max[i]);
+	}
+
+	SDL_free(p->frames);
+	p->frames = NULL;
+}
@@ -0,0 +1,123 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <SDL2/SDL.h>
+
+// Stages timed per frame. Segment setup and wall fill run once per wall, so
+// they are recorded as the summed time of every call in the frame.
+typedef enum
+{
+	PROFILE_TICKS,
+	PROFILE_RENDER,
+	PROFILE_BSP,
+	PROFILE_SEGMENT_SETUP,
+	PROFILE_WALL_FILL,
+	PROFILE_PLANE_FILL,
+	PROFILE_SPRITE_FILL,
+	PROFILE_UPLOAD,
+	PROFILE_EXPORT,
+	PROFILE_PRESENT,
+	PROFILE_STAGE_COUNT
+} ProfileStage;
+
+typedef enum
+{
+	PROFILE_SEGS_CONSIDERED,
+	PROFILE_SEGS_CULLED,
+	PROFILE_SECTORS_VISITED,
+	PROFILE_COLUMNS,
+	PROFILE_PIXELS,
+	PROFILE_SPRITES,
+	PROFILE_COUNTER_COUNT
+} ProfileCounter;
+
+// Thread a stage ran on. Render workers use PROFILE_LANE_WORKER + index.
+enum { PROFILE_LANE_MAIN, PROFILE_LANE_RENDER, PROFILE_LANE_WORKER };
+
+#define PROFILE_MAX_LANES 64
+// Frames kept in memory before they are written out, a power of two
+#define PROFILE_RING_SIZE 256
+
+typedef struct
+{
+	// Performance counter at the first call in the frame
+	Uint64 start[PROFILE_STAGE_COUNT];
+	Uint64 ticks[PROFILE_STAGE_COUNT];
+	Uint32 calls[PROFILE_STAGE_COUNT];
+	Uint64 counters[PROFILE_COUNTER_COUNT];
+} ProfileLane;
+
+typedef struct
+{
+	Uint32 frame;
+	SDL_bool used;
+	ProfileLane lanes[PROFILE_MAX_LANES];
+} ProfileFrame;
+
+// Every thread writes only its own lane of the frame it works on, so
+// recording takes no locks. A ring slot is written out when the render
+// thread reuses it, which assumes no thread is PROFILE_RING_SIZE frames
+// behind.
+typedef struct
+{
+	SDL_bool enabled;
+	int num_lanes;
+	ProfileFrame *frames;
+	Uint64 base_time;
+	double ms_per_tick;
+
+	FILE *trace;
+	SDL_bool wrote_event;
+
+	// Totals over every frame written out, for the summary
+	Uint32 num_frames;
+	double stage_ms[PROFILE_STAGE_COUNT];
+	double stage_max_ms[PROFILE_STAGE_COUNT];
+	Uint64 stage_calls[PROFILE_STAGE_COUNT];
+	Uint64 counters[PROFILE_COUNTER_COUNT];
+	Uint64 counter_max[PROFILE_COUNTER_COUNT];
+} Profiler;
+
+extern Profiler global_profiler;
+
+// Returns the start time to pass to profile_end, or 0 when disabled
+inline Uint64 profile_begin(void)
+{
+	if (!global_profiler.enabled)
+		return 0;
+
+	return SDL_GetPerformanceCounter();
+}
+
+inline void profile_end(int lane, Uint32 frame, ProfileStage stage, Uint64 start)
+{
+	if (!global_profiler.enabled)
+		return;
+
+	Uint64 now = SDL_GetPerformanceCounter();
+	ProfileLane *l = &global_profiler.frames[frame & (PROFILE_RING_SIZE-1)].lanes[lane];
+	if (l->calls[stage]++ == 0)
+		l->start[stage] = start;
+	l->ticks[stage] += now - start;
+}
+
+// Adds a lane's counters for the frame and clears them
+inline void profile_add_counters(int lane, Uint32 frame, Uint64 *counters)
+{
+	if (global_profiler.enabled)
+	{
+		ProfileLane *l = &global_profiler.frames[frame & (PROFILE_RING_SIZE-1)].lanes[lane];
+		for (int i = 0; i < PROFILE_COUNTER_COUNT; i++)
+			l->counters[i] += counters[i];
+	}
+
+	SDL_memset(counters, 0, sizeof(Uint64)*PROFILE_COUNTER_COUNT);
+}
+
+SDL_bool init_profiler(int num_lanes, const char *trace_path);
+void profile_begin_frame(Uint32 frame);
+void shutdown_profiler(void);
+
+#endif
@@ -0,0 +1,368 @@
+#include "level.h"
+
+// Point location, movement and line of sight against the BSP.
+//
+// Every query walks the tree instead of scanning all segments. Point lookup
+// descends one path, while sweeps and traces only enter children whose
+// bounding box they overlap. Walls are one-sided like in the renderer: they
+// block what comes at them from the side their normal points to and are
+// ignored from behind.
+
+// Slides a sweep tries before it gives up on the rest of the move
+#define MOVE_ITERATIONS 4
+// Gap left between a stopped circle and the wall it hit
+#define MOVE_SKIN 0.01f
+
+typedef struct
+{
+	Level *level;
+	pol_Vec2 pos;
+	pol_Vec2 delta;
+	float radius;
+	float box[4];
+
+	// Earliest hit so far as a fraction of delta, 1 without one
+	float t;
+	pol_Vec2 normal;
+} Sweep;
+
+typedef struct
+{
+	Level *level;
+	pol_Vec2 from;
+	pol_Vec2 to;
+	float box[4];
+
+	float fraction;
+	Sint32 seg;
+} Trace;
+
+static Sint32 root_node(Level *level)
+{
+	// A level with a single leaf has no nodes
+	return level->num_nodes ? 0 : SECTOR_FLAG;
+}
+
+static void box_around(float *box, pol_Vec2 a, pol_Vec2 b, float margin)
+{
+	box[BOX_TOP] = SDL_max(a.y, b.y) + margin;
+	box[BOX_BOTTOM] = SDL_min(a.y, b.y) - margin;
+	box[BOX_LEFT] = SDL_min(a.x, b.x) - margin;
+	box[BOX_RIGHT] = SDL_max(a.x, b.x) + margin;
+}
+
+static SDL_bool boxes_overlap(float *a, float *b)
+{
+	return a[BOX_LEFT] <= b[BOX_RIGHT] && a[BOX_RIGHT] >= b[BOX_LEFT] &&
+		a[BOX_BOTTOM] <= b[BOX_TOP] && a[BOX_TOP] >= b[BOX_BOTTOM];
+}
+
+// Returns the leaf sector containing p, the same walk the renderer uses to
+// find the camera's sector
+Sint32 locate_sector(Level *level, pol_Vec2 p)
+{
+	Sint32 node = root_node(level);
+	while (!(node & SECTOR_FLAG))
+	{
+		Node *n = &level->nodes[node];
+		pol_Vec2 v1 = level->vertices[n->splitter.v1];
+		pol_Vec2 v2 = level->vertices[n->splitter.v2];
+		node = point_on_side(v1, v2, p) == 1 ? n->right : n->left;
+	}
+
+	return node & ~SECTOR_FLAG;
+}
+
+void locate_sectors(Level *level, pol_Vec2 *points, Sint32 *sectors, int count)
+{
+	for (int i = 0; i < count; i++)
+		sectors[i] = locate_sector(level, points[i]);
+}
+
+static void sweep_hit(Sweep *sweep, float t, pol_Vec2 normal)
+{
+	if (t < sweep->t)
+	{
+		sweep->t = t;
+		sweep->normal = normal;
+	}
+}
+
+// Time of impact of the circle with a wall endpoint
+static void sweep_point(Sweep *sweep, pol_Vec2 p)
+{
+	pol_Vec2 m = vec2_subtract(sweep->pos, p);
+	float b = vec2_dot_product(m, sweep->delta);
+	// Moving away from it
+	if (b >= 0)
+		return;
+
+	float a = vec2_dot_product(sweep->delta, sweep->delta);
+	float c = vec2_dot_product(m, m) - sweep->radius*sweep->radius;
+	float t = 0;
+	if (c > 0)
+	{
+		float disc = b*b - a*c;
+		if (disc < 0)
+			return;
+		t = (-b - SDL_sqrtf(disc)) / a;
+	}
+
+	if (t >= sweep->t)
+		return;
+
+	pol_Vec2 hit = {sweep->pos.x + sweep->delta.x*t - p.x, sweep->pos.y + sweep->delta.y*t - p.y};
+	float len = vec2_len(hit);
+	if (len < EPSILON)
+		return;
+
+	sweep_hit(sweep, t, (pol_Vec2){hit.x/len, hit.y/len});
+}
+
+static void sweep_segment(Sweep *sweep, Sint32 index)
+{
+	Level *level = sweep->level;
+	LineSegment *seg = &level->segs[index];
+	SegmentInfo *info = &level->seg_infos[index];
+	pol_Vec2 v1 = level->vertices[seg->v1];
+	pol_Vec2 v2 = level->vertices[seg->v2];
+
+	// Behind the wall or not moving toward it
+	float dist = vec2_dot_product(vec2_subtract(sweep->pos, v1), info->normal);
+	float speed = vec2_dot_product(sweep->delta, info->normal);
+	if (dist < 0 || speed >= 0)
+		return;
+
+	// When the circle touches the wall's line, where along the wall it does
+	float t = SDL_max((dist - sweep->radius) / -speed, 0.0f);
+	pol_Vec2 dir = vec2_subtract(v2, v1);
+	pol_Vec2 contact = {
+		sweep->pos.x + sweep->delta.x*t - info->normal.x*SDL_min(dist, sweep->radius),
+		sweep->pos.y + sweep->delta.y*t - info->normal.y*SDL_min(dist, sweep->radius)
+	};
+	float along = vec2_dot_product(vec2_subtract(contact, v1), dir);
+
+	if (along >= 0 && along <= info->length*info->length)
+	{
+		sweep_hit(sweep, t, info->normal);
+		return;
+	}
+
+	// Missed the face, but may still catch a corner
+	sweep_point(sweep, v1);
+	sweep_point(sweep, v2);
+}
+
+static void sweep_node(Sweep *sweep, Sint32 node)
+{
+	Level *level = sweep->level;
+
+	if (node & SECTOR_FLAG)
+	{
+		Sector *sector = &level->sectors[node & ~SECTOR_FLAG];
+		for (int i = 0; i < sector->num_segments; i++)
+			sweep_segment(sweep, sector->first_seg + i);
+		return;
+	}
+
+	Node *n = &level->nodes[node];
+	if (boxes_overlap(n->left_box, sweep->box))
+		sweep_node(sweep, n->left);
+	if (boxes_overlap(n->right_box, sweep->box))
+		sweep_node(sweep, n->right);
+}
+
+// Moves a circle by delta, sliding along the walls it runs into. Returns the
+// new position and sets blocked when any wall was hit.
+pol_Vec2 move_circle(Level *level, pol_Vec2 pos, pol_Vec2 delta, float radius, SDL_bool *blocked)
+{
+	*blocked = SDL_FALSE;
+
+	for (int i = 0; i < MOVE_ITERATIONS; i++)
+	{
+		if (vec2_len(delta) < EPSILON)
+			break;
+
+		Sweep sweep = {level, pos, delta, radius};
+		sweep.t = 1.0f;
+		box_around(sweep.box, pos, vec2_add(pos, delta), radius);
+		sweep_node(&sweep, root_node(level));
+
+		if (sweep.t >= 1.0f)
+			return vec2_add(pos, delta);
+
+		*blocked = SDL_TRUE;
+
+		// Stop at the wall, then slide what is left along it
+		pos.x += delta.x*sweep.t + sweep.normal.x*MOVE_SKIN;
+		pos.y += delta.y*sweep.t + sweep.normal.y*MOVE_SKIN;
+
+		pol_Vec2 rest = {delta.x*(1.0f - sweep.t), delta.y*(1.0f - sweep.t)};
+		float into = vec2_dot_product(rest, sweep.normal);
+		delta.x = rest.x - sweep.normal.x*into;
+		delta.y = rest.y - sweep.normal.y*into;
+	}
+
+	return pos;
+}
+
+// Tests segments of one leaf. Returns true when one was hit.
+static SDL_bool trace_sector(Trace *trace, Sint32 sector_index)
+{
+	Level *level = trace->level;
+	Sector *sector = &level->sectors[sector_index];
+	pol_Vec2 r = vec2_subtract(trace->to, trace->from);
+	SDL_bool hit = SDL_FALSE;
+
+	for (int i = 0; i < sector->num_segments; i++)
+	{
+		Sint32 index = sector->first_seg + i;
+		LineSegment *seg = &level->segs[index];
+		pol_Vec2 v1 = level->vertices[seg->v1];
+		pol_Vec2 v2 = level->vertices[seg->v2];
+
+		// Only the front of a wall stops a line
+		if (vec2_dot_product(r, level->seg_infos[index].normal) >= 0)
+			continue;
+
+		pol_Vec2 s = vec2_subtract(v2, v1);
+		float denom = vec2_cross_product(r, s);
+		if (SDL_fabsf(denom) < EPSILON)
+			continue;
+
+		pol_Vec2 d = vec2_subtract(v1, trace->from);
+		float t = vec2_cross_product(d, s) / denom;
+		float u = vec2_cross_product(d, r) / denom;
+		if (t < 0 || t > trace->fraction || u < 0 || u > 1)
+			continue;
+
+		trace->fraction = t;
+		trace->seg = index;
+		hit = SDL_TRUE;
+	}
+
+	return hit;
+}
+
+// Visits the side of each splitter holding the start of the line first, so
+// the first leaf with a hit has the nearest one
+static SDL_bool trace_node(Trace *trace, Sint32 node)
+{
+	if (node & SECTOR_FLAG)
+		return trace_sector(trace, node & ~SECTOR_FLAG);
+
+	Level *level = trace->level;
+	Node *n = &level->nodes[node];
+	pol_Vec2 v1 = level->vertices[n->splitter.v1];
+	pol_Vec2 v2 = level->vertices[n->splitter.v2];
+
+	int side = point_on_side(v1, v2, trace->from);
+	if (side == 0)
+		side = point_on_side(v1, v2, trace->to);
+
+	// Along the splitter, so either side may hold the nearest hit
+	if (side == 0)
+	{
+		SDL_bool hit = SDL_FALSE;
+		if (boxes_overlap(n->left_box, trace->box))
+			hit = trace_node(trace, n->left);
+		if (boxes_overlap(n->right_box, trace->box))
+			hit = trace_node(trace, n->right) || hit;
+		return hit;
+	}
+
+	Sint32 near = side == 1 ? n->right : n->left;
+	Sint32 far = side == 1 ? n->left : n->right;
+	float *near_box = side == 1 ? n->right_box : n->left_box;
+	float *far_box = side == 1 ? n->left_box : n->right_box;
+
+	if (boxes_overlap(near_box, trace->box) && trace_node(trace, near))
+		return SDL_TRUE;
+	if (boxes_overlap(far_box, trace->box))
+		return trace_node(trace, far);
+
+	return SDL_FALSE;
+}
+
+// Returns how far along from -> to the first wall is hit, 1 when nothing is.
+// seg is set to the wall hit or -1, and may be NULL.
+float trace_line(Level *level, pol_Vec2 from, pol_Vec2 to, Sint32 *seg)
+{
+	Trace trace = {level, from, to};
+	trace.fraction = 1.0f;
+	trace.seg = -1;
+	box_around(trace.box, from, to, 0);
+
+	trace_node(&trace, root_node(level));
+
+	if (seg)
+		*seg = trace.seg;
+	return trace.fraction;
+}
+
+SDL_bool line_of_sight(Level *level, pol_Vec2 from, pol_Vec2 to)
+{
+	Sint32 seg;
+	trace_line(level, from, to, &seg);
+	return seg < 0;
+}
+
+typedef struct
+{
+	Sint32 sector;
+	int index;
+} QueryOrder;
+
+static int compare_query_order(const void *a, const void *b)
+{
+	const QueryOrder *qa = a;
+	const QueryOrder *qb = b;
+
+	if (qa->sector != qb->sector)
+		return qa->sector < qb->sector ? -1 : 1;
+	return qa->index - qb->index;
+}
+
+// Orders queries by the sector they start in, so queries in the same area run
+// back to back over nodes and segments that are already in cache. Every query
+// struct starts with its start point.
+static QueryOrder *order_queries(Level *level, void *queries, size_t stride, int count)
+{
+	QueryOrder *order = SDL_malloc(count * sizeof(QueryOrder));
+
+	for (int i = 0; i < count; i++)
+	{
+		pol_Vec2 *start = (pol_Vec2 *)((Uint8 *)queries + i*stride);
+		order[i].sector = locate_sector(level, *start);
+		order[i].index = i;
+	}
+
+	SDL_qsort(order, count, sizeof(QueryOrder), compare_query_order);
+	return order;
+}
+
+void move_circles(Level *level, CircleMove *moves, int count)
+{
+	QueryOrder *order = order_queries(level, moves, sizeof(CircleMove), count);
+
+	for (int i = 0; i < count; i++)
+	{
+		CircleMove *move = &moves[order[i].index];
+		move->result = move_circle(level, move->pos, move->delta, move->radius, &move->blocked);
+	}
+
+	SDL_free(order);
+}
+
+void trace_lines(Level *level, LineTrace *traces, int count)
+{
+	QueryOrder *order = order_queries(level, traces, sizeof(LineTrace), count);
+
+	for (int i = 0; i < count; i++)
+	{
+		LineTrace *trace = &traces[order[i].index];
+		trace->fraction = trace_line(level, trace->from, trace->to, &trace->seg);
+	}
+
+	SDL_free(order);
+}
@@ -0,0 +1,798 @@
+#include "level.h"
+
+#include <stdio.h>
+
+// Potentially visible set between leaf sectors, built offline by bspc.
+//
+// Every leaf owns the convex region cut out by the splitters above it. The
+// parts of each splitter line that separate two regions and aren't covered
+// by a wall are portals. A sector sees another when a line can pass from its
+// region through a chain of portals into the other's, which is tested by
+// clipping each next portal to the lines separating the source portal from
+// the last one passed (2D version of Quake's vis).
+
+#define VIS_EPSILON 0.001f
+// Regions smaller than this are slivers left by collinear splitters
+#define VIS_MIN_AREA 0.01f
+// Marks a row that is the shared all visible one
+#define PVS_FULL_ROW 0xffffffffu
+
+// Leads into sector `to`, which lies to the left of p1 -> p2
+typedef struct
+{
+	pol_Vec2 p1, p2;
+	Sint32 from, to;
+} Portal;
+
+// Piece of a splitter line touching one leaf, as distances along the line
+typedef struct
+{
+	Sint32 leaf;
+	float t0, t1;
+} LinePiece;
+
+typedef struct
+{
+	LinePiece *items;
+	size_t len;
+	size_t capacity;
+} LinePieceArray;
+
+typedef struct
+{
+	Level *level;
+
+	Portal *portals;
+	size_t num_portals;
+	size_t portals_capacity;
+	// Portals sorted by `from`, leaf i owning [first_portal[i], first_portal[i+1])
+	Sint32 *first_portal;
+
+	SDL_bool *degenerate;
+
+	// Sectors with a wall in front of which lies leaf i's region, from
+	// first_wall_owner[i] to first_wall_owner[i+1]
+	Sint32 *wall_owners;
+	Sint32 *first_wall_owner;
+
+	int row_bytes;
+	int max_steps;
+} VisBuilder;
+
+static float line_side(pol_Vec2 v1, pol_Vec2 dir, pol_Vec2 p)
+{
+	return vec2_cross_product(dir, vec2_subtract(p, v1));
+}
+
+static pol_Vec2 line_dir(pol_Vec2 v1, pol_Vec2 v2)
+{
+	pol_Vec2 d = vec2_subtract(v2, v1);
+	float len = vec2_len(d);
+
+	return (pol_Vec2){d.x/len, d.y/len};
+}
+
+// Keeps the part of a convex polygon on one side of the line through v1 with
+// direction dir: sign 1 keeps the left child's side, -1 the right's
+static int clip_polygon(pol_Vec2 *in, int num_in, pol_Vec2 v1, pol_Vec2 dir, float sign, pol_Vec2 *out)
+{
+	int num_out = 0;
+
+	for (int i = 0; i < num_in; i++)
+	{
+		pol_Vec2 a = in[i];
+		pol_Vec2 b = in[(i+1) % num_in];
+		float da = sign*line_side(v1, dir, a);
+		float db = sign*line_side(v1, dir, b);
+
+		if (da >= 0.0f)
+			out[num_out++] = a;
+
+		if ((da > 0.0f && db < 0.0f) || (da < 0.0f && db > 0.0f))
+		{
+			float t = da/(da - db);
+			out[num_out++] = (pol_Vec2){a.x + t*(b.x - a.x), a.y + t*(b.y - a.y)};
+		}
+	}
+
+	return num_out;
+}
+
+static float polygon_area(pol_Vec2 *points, int num_points)
+{
+	float area = 0.0f;
+	for (int i = 0; i < num_points; i++)
+		area += vec2_cross_product(points[i], points[(i+1) % num_points]);
+
+	return SDL_fabsf(area)*0.5f;
+}
+
+// Range of distances along the line through v1 that lies inside a convex
+// polygon. Returns SDL_FALSE when the line misses it.
+static SDL_bool clip_line_to_polygon(pol_Vec2 *points, int num_points, pol_Vec2 v1, pol_Vec2 dir, float *t0, float *t1)
+{
+	pol_Vec2 center = VEC2ZERO;
+	for (int i = 0; i < num_points; i++)
+		center = vec2_add(center, points[i]);
+	center.x /= num_points;
+	center.y /= num_points;
+
+	*t0 = -INFINITY;
+	*t1 = INFINITY;
+
+	for (int i = 0; i < num_points; i++)
+	{
+		pol_Vec2 a = points[i];
+		pol_Vec2 b = points[(i+1) % num_points];
+		if (vec2_len(vec2_subtract(b, a)) < VIS_EPSILON)
+			continue;
+
+		pol_Vec2 edge = line_dir(a, b);
+		float inside = line_side(a, edge, center) < 0.0f ? -1.0f : 1.0f;
+
+		// Signed distance to the edge is f0 + t*f1
+		float f0 = inside*line_side(a, edge, v1);
+		float f1 = inside*vec2_cross_product(edge, dir);
+
+		if (SDL_fabsf(f1) < EPSILON)
+		{
+			if (f0 < -VIS_EPSILON)
+				return SDL_FALSE;
+		}
+		else if (f1 > 0.0f)
+		{
+			*t0 = SDL_max(*t0, -f0/f1);
+		}
+		else
+		{
+			*t1 = SDL_min(*t1, -f0/f1);
+		}
+	}
+
+	return *t1 - *t0 > VIS_EPSILON;
+}
+
+// Pushes the segment a-b down from node, cutting it by every splitter, and
+// appends the pieces that reach a leaf. Pieces lying on a splitter follow
+// `interior`, an offset pointing into the region the segment borders.
+static void push_segment(Level *level, Sint32 node, pol_Vec2 a, pol_Vec2 b, pol_Vec2 interior, pol_Vec2 origin, pol_Vec2 dir, LinePieceArray *out)
+{
+	if (node & SECTOR_FLAG)
+	{
+		float t0 = vec2_dot_product(vec2_subtract(a, origin), dir);
+		float t1 = vec2_dot_product(vec2_subtract(b, origin), dir);
+
+		out->items = grow_array(out->items, &out->capacity, out->len+1, sizeof(LinePiece));
+		out->items[out->len++] = (LinePiece){node & ~SECTOR_FLAG, SDL_min(t0, t1), SDL_max(t0, t1)};
+		return;
+	}
+
+	Node *n = &level->nodes[node];
+	pol_Vec2 v1 = level->vertices[n->splitter.v1];
+	pol_Vec2 split_dir = line_dir(v1, level->vertices[n->splitter.v2]);
+
+	float sa = line_side(v1, split_dir, a);
+	float sb = line_side(v1, split_dir, b);
+
+	// Lies on the splitter, so it borders whichever side `interior` is on
+	if (SDL_fabsf(sa) < VIS_EPSILON && SDL_fabsf(sb) < VIS_EPSILON)
+	{
+		pol_Vec2 mid = {(a.x + b.x)*0.5f + interior.x, (a.y + b.y)*0.5f + interior.y};
+		float side = line_side(v1, split_dir, mid);
+
+		if (side > -VIS_EPSILON*0.5f)
+			push_segment(level, n->left, a, b, interior, origin, dir, out);
+		if (side < VIS_EPSILON*0.5f)
+			push_segment(level, n->right, a, b, interior, origin, dir, out);
+		return;
+	}
+
+	if (sa > -VIS_EPSILON && sb > -VIS_EPSILON)
+	{
+		push_segment(level, n->left, a, b, interior, origin, dir, out);
+		return;
+	}
+
+	if (sa < VIS_EPSILON && sb < VIS_EPSILON)
+	{
+		push_segment(level, n->right, a, b, interior, origin, dir, out);
+		return;
+	}
+
+	float t = sa/(sa - sb);
+	pol_Vec2 mid = {a.x + t*(b.x - a.x), a.y + t*(b.y - a.y)};
+
+	if (sa > 0.0f)
+	{
+		push_segment(level, n->left, a, mid, interior, origin, dir, out);
+		push_segment(level, n->right, mid, b, interior, origin, dir, out);
+	}
+	else
+	{
+		push_segment(level, n->right, a, mid, interior, origin, dir, out);
+		push_segment(level, n->left, mid, b, interior, origin, dir, out);
+	}
+}
+
+static int compare_pieces(const void *a, const void *b)
+{
+	float ta = ((const LinePiece*)a)->t0;
+	float tb = ((const LinePiece*)b)->t0;
+	return (ta > tb) - (ta < tb);
+}
+
+// Collects the walls of a subtree that lie on the line, as distance ranges
+static void collect_walls_on_line(Level *level, Sint32 node, pol_Vec2 origin, pol_Vec2 dir, LinePieceArray *out)
+{
+	if (!(node & SECTOR_FLAG))
+	{
+		collect_walls_on_line(level, level->nodes[node].left, origin, dir, out);
+		collect_walls_on_line(level, level->nodes[node].right, origin, dir, out);
+		return;
+	}
+
+	Sector *sector = &level->sectors[node & ~SECTOR_FLAG];
+	for (int i = sector->first_seg; i < sector->first_seg + sector->num_segments; i++)
+	{
+		pol_Vec2 a = level->vertices[level->segs[i].v1];
+		pol_Vec2 b = level->vertices[level->segs[i].v2];
+
+		if (SDL_fabsf(line_side(origin, dir, a)) < VIS_EPSILON && SDL_fabsf(line_side(origin, dir, b)) < VIS_EPSILON)
+		{
+			float t0 = vec2_dot_product(vec2_subtract(a, origin), dir);
+			float t1 = vec2_dot_product(vec2_subtract(b, origin), dir);
+
+			out->items = grow_array(out->items, &out->capacity, out->len+1, sizeof(LinePiece));
+			out->items[out->len++] = (LinePiece){-1, SDL_min(t0, t1), SDL_max(t0, t1)};
+		}
+	}
+}
+
+static void add_portal(VisBuilder *vb, pol_Vec2 p1, pol_Vec2 p2, Sint32 from, Sint32 to)
+{
+	vb->portals = grow_array(vb->portals, &vb->portals_capacity, vb->num_portals+1, sizeof(Portal));
+	vb->portals[vb->num_portals++] = (Portal){p1, p2, from, to};
+}
+
+// Adds a portal both ways for every open stretch of [t0, t1] between
+// left_leaf and right_leaf. walls is sorted by t0.
+static void add_open_portals(VisBuilder *vb, LinePieceArray *walls, float t0, float t1, Sint32 left_leaf, Sint32 right_leaf, pol_Vec2 origin, pol_Vec2 dir)
+{
+	for (size_t i = 0; i <= walls->len && t0 < t1; i++)
+	{
+		float open_end = t1;
+		float next_start = t1;
+		if (i < walls->len)
+		{
+			if (walls->items[i].t1 <= t0)
+				continue;
+			open_end = SDL_min(t1, walls->items[i].t0);
+			next_start = walls->items[i].t1;
+		}
+
+		if (open_end - t0 > VIS_EPSILON)
+		{
+			pol_Vec2 p1 = {origin.x + dir.x*t0, origin.y + dir.y*t0};
+			pol_Vec2 p2 = {origin.x + dir.x*open_end, origin.y + dir.y*open_end};
+
+			// The left child lies to the left of the splitter's direction
+			add_portal(vb, p1, p2, right_leaf, left_leaf);
+			add_portal(vb, p2, p1, left_leaf, right_leaf);
+		}
+
+		t0 = SDL_max(t0, next_start);
+	}
+}
+
+// Walks the tree with the region of each node, making the portals on its
+// splitter and flagging sliver leaves
+static void build_portals(VisBuilder *vb, Sint32 node, pol_Vec2 *region, int num_points)
+{
+	Level *level = vb->level;
+
+	if (node & SECTOR_FLAG)
+	{
+		vb->degenerate[node & ~SECTOR_FLAG] = num_points < 3 || polygon_area(region, num_points) < VIS_MIN_AREA;
+		return;
+	}
+
+	Node *n = &level->nodes[node];
+	pol_Vec2 v1 = level->vertices[n->splitter.v1];
+	pol_Vec2 dir = line_dir(v1, level->vertices[n->splitter.v2]);
+
+	float t0, t1;
+	if (num_points >= 3 && clip_line_to_polygon(region, num_points, v1, dir, &t0, &t1))
+	{
+		pol_Vec2 a = {v1.x + dir.x*t0, v1.y + dir.y*t0};
+		pol_Vec2 b = {v1.x + dir.x*t1, v1.y + dir.y*t1};
+		pol_Vec2 to_left = {-dir.y*VIS_EPSILON*4.0f, dir.x*VIS_EPSILON*4.0f};
+		pol_Vec2 to_right = {-to_left.x, -to_left.y};
+
+		LinePieceArray left = {0};
+		LinePieceArray right = {0};
+		LinePieceArray walls = {0};
+		push_segment(level, n->left, a, b, to_left, v1, dir, &left);
+		push_segment(level, n->right, a, b, to_right, v1, dir, &right);
+		collect_walls_on_line(level, node, v1, dir, &walls);
+
+		SDL_qsort(left.items, left.len, sizeof(LinePiece), compare_pieces);
+		SDL_qsort(right.items, right.len, sizeof(LinePiece), compare_pieces);
+		SDL_qsort(walls.items, walls.len, sizeof(LinePiece), compare_pieces);
+
+		// Overlaps of left and right pieces are where two regions meet
+		size_t i = 0, j = 0;
+		while (i < left.len && j < right.len)
+		{
+			float start = SDL_max(left.items[i].t0, right.items[j].t0);
+			float end = SDL_min(left.items[i].t1, right.items[j].t1);
+
+			if (end - start > VIS_EPSILON)
+				add_open_portals(vb, &walls, start, end, left.items[i].leaf, right.items[j].leaf, v1, dir);
+
+			if (left.items[i].t1 < right.items[j].t1)
+				i++;
+			else
+				j++;
+		}
+
+		SDL_free(left.items);
+		SDL_free(right.items);
+		SDL_free(walls.items);
+	}
+
+	pol_Vec2 *child_region = SDL_malloc(sizeof(pol_Vec2)*(num_points + 1));
+
+	int num_child = clip_polygon(region, num_points, v1, dir, 1.0f, child_region);
+	build_portals(vb, n->left, child_region, num_child);
+
+	num_child = clip_polygon(region, num_points, v1, dir, -1.0f, child_region);
+	build_portals(vb, n->right, child_region, num_child);
+
+	SDL_free(child_region);
+}
+
+typedef struct
+{
+	Sint32 front, owner;
+} WallFront;
+
+static int compare_wall_fronts(const void *a, const void *b)
+{
+	const WallFront *wa = a;
+	const WallFront *wb = b;
+	if (wa->front != wb->front)
+		return (wa->front > wb->front) - (wa->front < wb->front);
+	return (wa->owner > wb->owner) - (wa->owner < wb->owner);
+}
+
+// A wall is seen from the region in front of it, which isn't always its own
+// sector's region, so a sector is also visible wherever a region in front of
+// one of its walls is. Builds, for every region, the sectors owning walls it
+// lies in front of.
+static void build_wall_owners(VisBuilder *vb)
+{
+	Level *level = vb->level;
+	LinePieceArray pieces = {0};
+	WallFront *fronts = NULL;
+	size_t num_fronts = 0;
+	size_t fronts_capacity = 0;
+
+	for (size_t s = 0; s < level->num_sectors; s++)
+	{
+		Sector *sector = &level->sectors[s];
+		for (int i = sector->first_seg; i < sector->first_seg + sector->num_segments; i++)
+		{
+			pol_Vec2 a = level->vertices[level->segs[i].v1];
+			pol_Vec2 b = level->vertices[level->segs[i].v2];
+			pol_Vec2 normal = level->seg_infos[i].normal;
+			pol_Vec2 offset = {normal.x*VIS_EPSILON*4.0f, normal.y*VIS_EPSILON*4.0f};
+
+			pieces.len = 0;
+			push_segment(level, 0, vec2_add(a, offset), vec2_add(b, offset), offset, a, line_dir(a, b), &pieces);
+
+			fronts = grow_array(fronts, &fronts_capacity, num_fronts + pieces.len, sizeof(WallFront));
+			for (size_t j = 0; j < pieces.len; j++)
+				fronts[num_fronts++] = (WallFront){pieces.items[j].leaf, s};
+		}
+	}
+
+	SDL_qsort(fronts, num_fronts, sizeof(WallFront), compare_wall_fronts);
+
+	vb->wall_owners = SDL_malloc(sizeof(Sint32)*(num_fronts + 1));
+	vb->first_wall_owner = SDL_malloc(sizeof(Sint32)*(level->num_sectors + 1));
+
+	size_t num_owners = 0;
+	for (size_t s = 0, i = 0; s < level->num_sectors; s++)
+	{
+		vb->first_wall_owner[s] = num_owners;
+		for (; i < num_fronts && fronts[i].front == s; i++)
+		{
+			if (num_owners > vb->first_wall_owner[s] && vb->wall_owners[num_owners-1] == fronts[i].owner)
+				continue;
+			vb->wall_owners[num_owners++] = fronts[i].owner;
+		}
+	}
+	vb->first_wall_owner[level->num_sectors] = num_owners;
+
+	SDL_free(fronts);
+	SDL_free(pieces.items);
+}
+
+static int compare_portals(const void *a, const void *b)
+{
+	const Portal *pa = a;
+	const Portal *pb = b;
+	return (pa->from > pb->from) - (pa->from < pb->from);
+}
+
+// Keeps the part of seg on the given side of the line a-b. Returns SDL_FALSE
+// when nothing is left.
+static SDL_bool clip_segment(pol_Vec2 *seg, pol_Vec2 a, pol_Vec2 b, float sign)
+{
+	pol_Vec2 dir = line_dir(a, b);
+	float d0 = sign*line_side(a, dir, seg[0]);
+	float d1 = sign*line_side(a, dir, seg[1]);
+
+	if (d0 < -VIS_EPSILON && d1 < -VIS_EPSILON)
+		return SDL_FALSE;
+
+	if (d0 < -VIS_EPSILON || d1 < -VIS_EPSILON)
+	{
+		float t = d0/(d0 - d1);
+		pol_Vec2 p = {seg[0].x + t*(seg[1].x - seg[0].x), seg[0].y + t*(seg[1].y - seg[0].y)};
+
+		if (d0 < 0.0f)
+			seg[0] = p;
+		else
+			seg[1] = p;
+	}
+
+	return vec2_len(vec2_subtract(seg[1], seg[0])) > VIS_EPSILON;
+}
+
+// Clips target to what can be seen from source through pass: the region
+// between the two lines that join an end of source to an end of pass with
+// the other two ends on opposite sides
+static SDL_bool clip_to_separators(pol_Vec2 *source, pol_Vec2 *pass, pol_Vec2 *target)
+{
+	for (int i = 0; i < 2; i++)
+	{
+		for (int j = 0; j < 2; j++)
+		{
+			pol_Vec2 a = source[i];
+			pol_Vec2 b = pass[j];
+			if (vec2_len(vec2_subtract(b, a)) < VIS_EPSILON)
+				continue;
+
+			pol_Vec2 dir = line_dir(a, b);
+			float s = line_side(a, dir, source[1-i]);
+			float p = line_side(a, dir, pass[1-j]);
+
+			if (s < -VIS_EPSILON && p > VIS_EPSILON)
+			{
+				if (!clip_segment(target, a, b, 1.0f))
+					return SDL_FALSE;
+			}
+			else if (s > VIS_EPSILON && p < -VIS_EPSILON)
+			{
+				if (!clip_segment(target, a, b, -1.0f))
+					return SDL_FALSE;
+			}
+		}
+	}
+
+	return SDL_TRUE;
+}
+
+typedef struct
+{
+	VisBuilder *vb;
+	Uint8 *visible;
+	Uint8 *on_stack;
+	int steps;
+} PortalFlow;
+
+// Marks everything reachable from leaf through portals that a line from
+// source, passing through pass, can still reach. source and pass are the same
+// portal for the first step out of the source sector.
+static void portal_flow(PortalFlow *flow, Sint32 leaf, pol_Vec2 *source, pol_Vec2 *pass, SDL_bool first)
+{
+	VisBuilder *vb = flow->vb;
+
+	if (++flow->steps > vb->max_steps)
+		return;
+
+	flow->on_stack[leaf] = 1;
+
+	for (Sint32 i = vb->first_portal[leaf]; i < vb->first_portal[leaf+1]; i++)
+	{
+		Portal *portal = &vb->portals[i];
+		if (flow->on_stack[portal->to])
+			continue;
+
+		// Only the part beyond the portal we came through
+		pol_Vec2 target[2] = {portal->p1, portal->p2};
+		if (!clip_segment(target, pass[0], pass[1], 1.0f))
+			continue;
+
+		pol_Vec2 next_source[2] = {source[0], source[1]};
+		if (!first)
+		{
+			if (!clip_to_separators(source, pass, target))
+				continue;
+			if (!clip_to_separators(target, pass, next_source))
+				continue;
+		}
+
+		flow->visible[portal->to >> 3] |= 1 << (portal->to & 7);
+		portal_flow(flow, portal->to, next_source, target, SDL_FALSE);
+
+		if (flow->steps > vb->max_steps)
+			break;
+	}
+
+	flow->on_stack[leaf] = 0;
+}
+
+// Run length encodes zero bytes as a zero followed by the run length
+static size_t compress_row(Uint8 *row, int row_bytes, Uint8 *out)
+{
+	size_t len = 0;
+
+	for (int i = 0; i < row_bytes; i++)
+	{
+		out[len++] = row[i];
+		if (row[i])
+			continue;
+
+		int run = 1;
+		while (i + 1 < row_bytes && row[i+1] == 0 && run < 255)
+		{
+			i++;
+			run++;
+		}
+		out[len++] = run;
+	}
+
+	return len;
+}
+
+void decompress_pvs_row(Level *level, Uint32 sector, Uint8 *row)
+{
+	int row_bytes = (level->num_sectors + 7) >> 3;
+	Uint8 *in = level->pvs + level->pvs_offsets[sector];
+
+	for (int i = 0; i < row_bytes;)
+	{
+		if (*in)
+		{
+			row[i++] = *in++;
+			continue;
+		}
+
+		int run = in[1];
+		in += 2;
+		for (int j = 0; j < run && i < row_bytes; j++)
+			row[i++] = 0;
+	}
+}
+
+typedef struct
+{
+	VisBuilder *vb;
+	Sint32 first, last;
+	Uint8 *out;
+	size_t out_size;
+	size_t out_capacity;
+	Uint32 *row_sizes;
+	int num_overflows;
+} VisTask;
+
+static int build_pvs_rows(void *data)
+{
+	VisTask *task = data;
+	VisBuilder *vb = task->vb;
+	Level *level = vb->level;
+
+	Uint8 *visible = SDL_malloc(vb->row_bytes);
+	Uint8 *row = SDL_malloc(vb->row_bytes);
+	Uint8 *packed = SDL_malloc(vb->row_bytes*2);
+	PortalFlow flow = {vb, visible, SDL_calloc(level->num_sectors, 1), 0};
+
+	for (Sint32 s = task->first; s < task->last; s++)
+	{
+		SDL_memset(visible, 0, vb->row_bytes);
+		visible[s >> 3] |= 1 << (s & 7);
+		flow.steps = 0;
+
+		if (!vb->degenerate[s])
+		{
+			for (Sint32 i = vb->first_portal[s]; i < vb->first_portal[s+1] && flow.steps <= vb->max_steps; i++)
+			{
+				Portal *portal = &vb->portals[i];
+				pol_Vec2 seg[2] = {portal->p1, portal->p2};
+
+				flow.on_stack[s] = 1;
+				visible[portal->to >> 3] |= 1 << (portal->to & 7);
+				portal_flow(&flow, portal->to, seg, seg, SDL_TRUE);
+				flow.on_stack[s] = 0;
+			}
+		}
+
+		// Sectors with too many paths see everything, and all share one row
+		if (flow.steps > vb->max_steps)
+		{
+			task->row_sizes[s - task->first] = PVS_FULL_ROW;
+			task->num_overflows++;
+			continue;
+		}
+
+		// The camera only ends up in a sliver when it stands exactly on a
+		// splitter. Those get an empty row, without even their own bit, and
+		// the renderer doesn't cull with it.
+		SDL_memcpy(row, visible, vb->row_bytes);
+		if (vb->degenerate[s])
+			SDL_memset(row, 0, vb->row_bytes);
+
+		for (int i = 0; i < vb->row_bytes && !vb->degenerate[s]; i++)
+		{
+			if (!visible[i])
+				continue;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				Sint32 front = i*8 + bit;
+				if (!(visible[i] & (1 << bit)) || front >= level->num_sectors)
+					continue;
+
+				for (Sint32 j = vb->first_wall_owner[front]; j < vb->first_wall_owner[front+1]; j++)
+					row[vb->wall_owners[j] >> 3] |= 1 << (vb->wall_owners[j] & 7);
+			}
+		}
+
+		// Padding bits past the last sector stay clear
+		if (level->num_sectors & 7)
+			row[vb->row_bytes-1] &= (1 << (level->num_sectors & 7)) - 1;
+
+		size_t len = compress_row(row, vb->row_bytes, packed);
+		task->out = grow_array(task->out, &task->out_capacity, task->out_size + len, 1);
+		SDL_memcpy(task->out + task->out_size, packed, len);
+		task->out_size += len;
+		task->row_sizes[s - task->first] = len;
+	}
+
+	SDL_free(flow.on_stack);
+	SDL_free(packed);
+	SDL_free(row);
+	SDL_free(visible);
+
+	return 0;
+}
+
+// Computes level->pvs for a freshly built tree. Sources that need more than
+// max_steps portal flow steps see everything. Rows are split between
+// num_threads threads and joined in sector order, so the result doesn't
+// depend on the thread count.
+void build_pvs(Level *level, int num_threads, int max_steps)
+{
+	if (level->num_sectors == 0)
+		return;
+
+	VisBuilder vb = {.level = level, .max_steps = max_steps};
+	vb.row_bytes = (level->num_sectors + 7) >> 3;
+	vb.degenerate = SDL_calloc(level->num_sectors, sizeof(SDL_bool));
+
+	float *box = level->pvs_box;
+	box[BOX_TOP] = box[BOX_RIGHT] = -INFINITY;
+	box[BOX_BOTTOM] = box[BOX_LEFT] = INFINITY;
+	for (size_t i = 0; i < level->num_vertices; i++)
+	{
+		box[BOX_TOP] = SDL_max(box[BOX_TOP], level->vertices[i].y + PVS_MARGIN);
+		box[BOX_BOTTOM] = SDL_min(box[BOX_BOTTOM], level->vertices[i].y - PVS_MARGIN);
+		box[BOX_LEFT] = SDL_min(box[BOX_LEFT], level->vertices[i].x - PVS_MARGIN);
+		box[BOX_RIGHT] = SDL_max(box[BOX_RIGHT], level->vertices[i].x + PVS_MARGIN);
+	}
+
+	pol_Vec2 region[4] = {
+		{box[BOX_LEFT], box[BOX_TOP]},
+		{box[BOX_RIGHT], box[BOX_TOP]},
+		{box[BOX_RIGHT], box[BOX_BOTTOM]},
+		{box[BOX_LEFT], box[BOX_BOTTOM]}
+	};
+	build_portals(&vb, 0, region, 4);
+	build_wall_owners(&vb);
+
+	SDL_qsort(vb.portals, vb.num_portals, sizeof(Portal), compare_portals);
+	vb.first_portal = SDL_malloc(sizeof(Sint32)*(level->num_sectors + 1));
+	for (size_t s = 0, i = 0; s <= level->num_sectors; s++)
+	{
+		while (i < vb.num_portals && vb.portals[i].from < s)
+			i++;
+		vb.first_portal[s] = i;
+	}
+
+	if (num_threads < 1)
+		num_threads = 1;
+	if (num_threads > level->num_sectors)
+		num_threads = level->num_sectors;
+
+	VisTask tasks[num_threads];
+	SDL_Thread *threads[num_threads];
+	for (int i = 0; i < num_threads; i++)
+	{
+		tasks[i] = (VisTask){
+			.vb = &vb,
+			.first = level->num_sectors * i / num_threads,
+			.last = level->num_sectors * (i+1) / num_threads
+		};
+		tasks[i].row_sizes = SDL_malloc(sizeof(Uint32)*(tasks[i].last - tasks[i].first + 1));
+
+		threads[i] = i > 0 ? SDL_CreateThread(build_pvs_rows, "bsp_vis", &tasks[i]) : NULL;
+		if (i > 0 && !threads[i])
+			build_pvs_rows(&tasks[i]);
+	}
+
+	if (num_threads > 0)
+		build_pvs_rows(&tasks[0]);
+
+	level->pvs_offsets = SDL_malloc(sizeof(Uint32)*level->num_sectors);
+	level->pvs = NULL;
+	level->pvs_size = 0;
+	size_t pvs_capacity = 0;
+	int num_overflows = 0;
+
+	for (int i = 0; i < num_threads; i++)
+	{
+		if (threads[i])
+			SDL_WaitThread(threads[i], NULL);
+
+		Uint32 offset = level->pvs_size;
+		for (Sint32 s = tasks[i].first; s < tasks[i].last; s++)
+		{
+			Uint32 row_size = tasks[i].row_sizes[s - tasks[i].first];
+			if (row_size == PVS_FULL_ROW)
+			{
+				level->pvs_offsets[s] = PVS_FULL_ROW;
+				continue;
+			}
+
+			level->pvs_offsets[s] = offset;
+			offset += row_size;
+		}
+
+		level->pvs = grow_array(level->pvs, &pvs_capacity, level->pvs_size + tasks[i].out_size, 1);
+		SDL_memcpy(level->pvs + level->pvs_size, tasks[i].out, tasks[i].out_size);
+		level->pvs_size += tasks[i].out_size;
+		num_overflows += tasks[i].num_overflows;
+
+		SDL_free(tasks[i].out);
+		SDL_free(tasks[i].row_sizes);
+	}
+
+	// Rows that gave up point at a single all visible row after the rest,
+	// so the file doesn't depend on how the sectors were split over threads
+	if (num_overflows)
+	{
+		Uint32 full_row_offset = level->pvs_size;
+		level->pvs = grow_array(level->pvs, &pvs_capacity, level->pvs_size + vb.row_bytes, 1);
+		SDL_memset(level->pvs + level->pvs_size, 0xff, vb.row_bytes);
+		if (level->num_sectors & 7)
+			level->pvs[level->pvs_size + vb.row_bytes-1] = (1 << (level->num_sectors & 7)) - 1;
+		level->pvs_size += vb.row_bytes;
+
+		for (size_t s = 0; s < level->num_sectors; s++)
+		{
+			if (level->pvs_offsets[s] == PVS_FULL_ROW)
+				level->pvs_offsets[s] = full_row_offset;
+		}
+	}
+
+	if (num_overflows)
+		printf("vis: %d sectors hit the flow limit and see everything\n", num_overflows);
+
+	SDL_free(vb.first_portal);
+	SDL_free(vb.first_wall_owner);
+	SDL_free(vb.wall_owners);
+	SDL_free(vb.portals);
+	SDL_free(vb.degenerate);
+}